@@ -0,0 +1,105 @@
+#include <fmt/format.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+#include "minipy/jitparse/parser.h"
+
+using namespace ::minipy;
+
+// Compares allocating parser trees from a TreeArena with one heap allocation
+// per node (ParserOptions::useArena):
+//   arena_benchmark [heap|arena|both] [lines] [iterations]
+// Parses a generated module of about 100k lines of defs, loops and
+// expressions, timing the parse and the destruction of the trees. Peak RSS
+// is per process, so "both" (the default) runs each mode in a child process
+// of its own.
+
+static std::string generatedSource(size_t lines) {
+  std::string src;
+  for (size_t i = 0; i * 11 < lines; i++) {
+    const auto n = std::to_string(i);
+    src += "def f" + n + "(a, b, c):\n";
+    src += "    x = a + b * c - " + n + "\n";
+    src += "    for i in range(b):\n";
+    src += "        if x > i:\n";
+    src += "            x = x - g(i, a, [c, 1.5])\n";
+    src += "        else:\n";
+    src += "            y = a.attr[i] + b\n";
+    src += "    while x < c:\n";
+    src += "        x = x + 1\n";
+    src += "    return x, y\n\n";
+  }
+  return src;
+}
+
+static void runMode(bool useArena, size_t lines, int iterations) {
+  const auto source = std::make_shared<Source>(generatedSource(lines));
+  std::vector<double> parseTimes;
+  std::vector<double> freeTimes;
+  for (int i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    std::optional<Mod> module = Parser(source, useArena).parseModule();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    parseTimes.push_back(elapsed.count());
+
+    start = std::chrono::steady_clock::now();
+    module.reset();
+    elapsed = std::chrono::steady_clock::now() - start;
+    freeTimes.push_back(elapsed.count());
+  }
+  std::sort(parseTimes.begin(), parseTimes.end());
+  std::sort(freeTimes.begin(), freeTimes.end());
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fmt::print(
+      "{:>5}, {} lines: parse best {:.1f}ms, median {:.1f}ms; "
+      "free best {:.1f}ms, median {:.1f}ms; peak RSS {:.1f}MB\n",
+      useArena ? "arena" : "heap",
+      std::count(source->text().begin(), source->text().end(), '\n'),
+      parseTimes.front(),
+      parseTimes[parseTimes.size() / 2],
+      freeTimes.front(),
+      freeTimes[freeTimes.size() / 2],
+      usage.ru_maxrss / 1024.0);
+}
+
+int main(int argc, char** argv) {
+  const char* mode = argc > 1 ? argv[1] : "both";
+  const size_t lines = argc > 2 ? std::atoi(argv[2]) : 100000;
+  const int iterations = argc > 3 ? std::atoi(argv[3]) : 5;
+  if (std::strcmp(mode, "heap") == 0 || std::strcmp(mode, "arena") == 0) {
+    runMode(std::strcmp(mode, "arena") == 0, lines, iterations);
+    return 0;
+  }
+  if (std::strcmp(mode, "both") != 0) {
+    fmt::print(
+        stderr,
+        "usage: {} [heap|arena|both] [lines] [iterations]\n",
+        argv[0]);
+    return 1;
+  }
+  for (bool useArena : {false, true}) {
+    const pid_t pid = fork();
+    if (pid == 0) {
+      runMode(useArena, lines, iterations);
+      std::fflush(stdout);
+      _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || status != 0) {
+      fmt::print(stderr, "benchmark process failed\n");
+      return 1;
+    }
+  }
+  return 0;
+}
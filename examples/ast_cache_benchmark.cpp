@@ -0,0 +1,67 @@
+#include <fmt/format.h>
+#include <chrono>
+#include <cstdlib>
+#include "minipy/jitparse/ast_cache.h"
+#include "minipy/jitparse/parser.h"
+
+using namespace ::minipy;
+
+// Compares parsing a module with loading it from an AstCache:
+//   ast_cache_benchmark <file.py> [cache_dir]
+// The first run in a fresh cache directory also measures writing the entry.
+// For true cold-start numbers, run it once to fill the cache and then again
+// in a new process.
+
+template <typename F>
+static double timeMs(F&& f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fmt::print(stderr, "usage: {} <file.py> [cache_dir]\n", argv[0]);
+    return 1;
+  }
+  const std::string dir = argc > 2 ? argv[2] : "/tmp/minipy_ast_cache";
+  std::shared_ptr<SourceView> source = std::make_shared<MappedSource>(argv[1]);
+  AstCache cache(dir);
+
+  // Load first, so a warm cache is measured before anything else in this
+  // process has touched the module.
+  // Every result is kept alive until the end, so that freeing trees isn't
+  // part of any measurement.
+  std::optional<Mod> loaded, arenaLoaded, parsed, arenaParsed;
+  const double loadMs = timeMs([&] { loaded = cache.load(source); });
+  const double arenaLoadMs =
+      timeMs([&] { arenaLoaded = cache.load(source, true); });
+  const double parseMs =
+      timeMs([&] { parsed = Parser(source).parseModule(); });
+  const double arenaParseMs =
+      timeMs([&] { arenaParsed = Parser(source, true).parseModule(); });
+
+  if (!loaded) {
+    bool stored = false;
+    const double storeMs =
+        timeMs([&] { stored = cache.store(source, *parsed); });
+    if (!stored) {
+      fmt::print(stderr, "failed to write to {}\n", dir);
+      return 1;
+    }
+    fmt::print(
+        "cache miss, wrote {} in {:.1f}ms; run again to time loading\n",
+        cache.pathFor(*source),
+        storeMs);
+  }
+
+  fmt::print("parse:          {:>8.1f}ms\n", parseMs);
+  fmt::print("parse (arena):  {:>8.1f}ms\n", arenaParseMs);
+  if (loaded) {
+    fmt::print("load:           {:>8.1f}ms\n", loadMs);
+    fmt::print("load (arena):   {:>8.1f}ms\n", arenaLoadMs);
+  }
+  return 0;
+}
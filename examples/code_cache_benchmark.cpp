@@ -0,0 +1,141 @@
+#include <fmt/format.h>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "minipy/compiler/CodeCache.h"
+#include "minipy/compiler/SymbolTable.h"
+#include "minipy/jitparse/parser.h"
+
+using namespace ::minipy;
+
+// Compares compiling a module with loading its code from a CodeCache:
+//   code_cache_benchmark [file.py] [cache_dir]
+// Without a file, uses a generated module of 20000 closure factories. The
+// first run in a fresh cache directory compiles and writes the entry; run it
+// again, in a new process, to time a cold start that hits the cache and skips
+// both parsing and compiling.
+//
+// Compiling here is parsing, building the SymbolTable and collecting each
+// code object's names, varnames and nested code objects from it; instruction
+// arrays are left empty.
+
+static std::string closureHeavySource(size_t num_defs) {
+  std::string src;
+  for (size_t i = 0; i < num_defs; i++) {
+    const auto n = std::to_string(i);
+    src += "def make" + n + "(a, b):\n";
+    src += "    total = a + " + n + "\n";
+    src += "    def add(x):\n";
+    src += "        return x + total + b\n";
+    src += "    return add\n\n";
+  }
+  return src;
+}
+
+template <typename F>
+static double timeMs(F&& f) {
+  const auto start = std::chrono::steady_clock::now();
+  f();
+  const std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Appends the records of `entry` and everything nested in it, parents first.
+static void collect(
+    const SymbolTableEntry& entry,
+    std::vector<CodeRecord>& codes) {
+  const size_t index = codes.size();
+  codes.emplace_back();
+  codes[index].name = entry.name;
+  for (const Symbol& arg : entry.args) {
+    codes[index].varnames.emplace_back(arg.str());
+  }
+  for (const auto& symbol : entry.symbols) {
+    const SymbolScope scope = symbol.second.getScope();
+    if (scope == SymbolScope::GLOBAL_IMPLICIT ||
+        scope == SymbolScope::GLOBAL_EXPLICIT) {
+      codes[index].names.emplace_back(symbol.first.str());
+    } else if (
+        (scope == SymbolScope::LOCAL || scope == SymbolScope::CELL) &&
+        !(symbol.second & SymbolFlag::DEF_PARAM)) {
+      codes[index].varnames.emplace_back(symbol.first.str());
+    }
+  }
+  for (const SymbolTableEntry* child : entry.children) {
+    CodeConstant constant;
+    constant.kind = CodeConstant::Kind::CODE;
+    constant.code = codes.size();
+    codes[index].constants.push_back(constant);
+    collect(*child, codes);
+  }
+  codes[index].constants.emplace_back();
+}
+
+static std::vector<CodeRecord> compile(
+    const std::shared_ptr<SourceView>& source) {
+  const Mod module = Parser(source).parseModule();
+  auto table = SymbolTable::build(module);
+  std::vector<CodeRecord> codes;
+  collect(*table->lookup(module.tree()), codes);
+  return codes;
+}
+
+int main(int argc, char** argv) {
+  std::shared_ptr<SourceView> source;
+  if (argc > 1) {
+    source = std::make_shared<MappedSource>(argv[1]);
+  } else {
+    source = std::make_shared<Source>(closureHeavySource(20000));
+  }
+  const std::string dir = argc > 2 ? argv[2] : "/tmp/minipy_code_cache";
+  CodeCache cache(dir);
+
+  // Load first, so a warm cache is measured before anything else in this
+  // process has touched the module. Reading every name is part of it, since
+  // the mapping is only paged in as it's used.
+  std::unique_ptr<CodeImage> image;
+  size_t numNames = 0;
+  const double loadMs = timeMs([&] {
+    image = cache.load(*source);
+    for (size_t i = 0; image && i < image->size(); i++) {
+      const CodeView code = image->code(i);
+      for (size_t j = 0; j < code.names().size(); j++) {
+        numNames += code.names()[j].size();
+      }
+      for (size_t j = 0; j < code.varnames().size(); j++) {
+        numNames += code.varnames()[j].size();
+      }
+    }
+  });
+  std::vector<CodeRecord> codes;
+  const double compileMs = timeMs([&] { codes = compile(source); });
+
+  if (!image) {
+    bool stored = false;
+    const double storeMs =
+        timeMs([&] { stored = cache.store(*source, codes); });
+    if (!stored) {
+      fmt::print(stderr, "failed to write to {}\n", dir);
+      return 1;
+    }
+    fmt::print(
+        "cache miss, wrote {} in {:.1f}ms; run again to time loading\n",
+        cache.pathFor(*source),
+        storeMs);
+  } else if (image->size() != codes.size() || numNames == 0) {
+    fmt::print(stderr, "cached code doesn't match the module\n");
+    return 1;
+  }
+
+  fmt::print(
+      "{} code objects from {:.1f} MB\n",
+      codes.size(),
+      source->text().size() / 1e6);
+  fmt::print("parse and compile: {:>8.1f}ms\n", compileMs);
+  if (image) {
+    fmt::print("load:              {:>8.1f}ms\n", loadMs);
+  }
+  return 0;
+}
@@ -0,0 +1,144 @@
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "minipy/interpreter/Dispatch.h"
+
+// Measures bytecode dispatch on its own, with the stub opcodes from
+// DispatchTest.cpp:
+//   dispatch_benchmark [iterations] [loop count]
+// dispatch_benchmark uses computed gotos and dispatch_benchmark_switch the
+// switch fallback (MINIPY_USE_COMPUTED_GOTO=0), so running both compares the
+// two. The handlers do almost nothing, so the time per instruction is mostly
+// the dispatch itself.
+//
+// Two loop bodies are timed: one repeating a single opcode, whose next
+// instruction is trivially predictable either way, and a fixed pseudo-random
+// mix of opcodes, where a single switch site has to learn a long history while
+// each computed goto only has to predict its own successors.
+
+#define FORALL_BENCH_OPCODES(_) \
+  _(SET_COUNTER)                \
+  _(ADD_COUNTER)                \
+  _(SUB_COUNTER)                \
+  _(XOR_COUNTER)                \
+  _(LOOP)                       \
+  _(RETURN)
+
+enum class BenchOpCode : uint8_t {
+#define DEFINE_OPCODE(op) op,
+  FORALL_BENCH_OPCODES(DEFINE_OPCODE)
+#undef DEFINE_OPCODE
+};
+
+struct BenchInstruction {
+  BenchOpCode op;
+  int arg1;
+};
+
+// Kept out of line so that the loop is compiled the way Interpreter::run() is,
+// not specialized for one program.
+__attribute__((noinline)) static int64_t run(
+    const std::vector<BenchInstruction>& code) {
+  int64_t counter = 0;
+  int64_t acc = 0;
+  const BenchInstruction* pc = code.data();
+  MINIPY_DISPATCH_TABLE(FORALL_BENCH_OPCODES);
+  MINIPY_DISPATCH() {
+    MINIPY_TARGET(SET_COUNTER) {
+      counter = pc->arg1;
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(ADD_COUNTER) {
+      acc += counter;
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(SUB_COUNTER) {
+      acc -= counter;
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(XOR_COUNTER) {
+      acc ^= counter;
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(LOOP) {
+      if (--counter > 0) {
+        MINIPY_JUMP(code.data() + pc->arg1);
+      }
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(RETURN) {
+      return acc;
+    }
+  }
+  MINIPY_DISPATCH_END();
+}
+
+// SET_COUNTER loops, then `body` closed by LOOP, then RETURN.
+static std::vector<BenchInstruction> loopProgram(
+    int loops,
+    const std::vector<BenchOpCode>& body) {
+  std::vector<BenchInstruction> code = {{BenchOpCode::SET_COUNTER, loops}};
+  for (BenchOpCode op : body) {
+    code.push_back({op, 0});
+  }
+  code.push_back({BenchOpCode::LOOP, 1});
+  code.push_back({BenchOpCode::RETURN, 0});
+  return code;
+}
+
+static int64_t runProgram(
+    const char* name,
+    int iterations,
+    int loops,
+    const std::vector<BenchOpCode>& body) {
+  const std::vector<BenchInstruction> code = loopProgram(loops, body);
+  const double instructions = 2.0 + double(loops) * (body.size() + 1);
+  std::vector<double> rates;
+  int64_t sink = 0;
+  for (int i = 0; i < iterations; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    sink += run(code);
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    rates.push_back(instructions / elapsed.count());
+  }
+  std::sort(rates.begin(), rates.end());
+  fmt::print(
+      "{}, {} body, {:.0f}M instructions: best {:.0f}M/s, median {:.0f}M/s\n",
+      MINIPY_USE_COMPUTED_GOTO ? "computed goto" : "switch",
+      name,
+      instructions / 1e6,
+      rates.back() / 1e6,
+      rates[rates.size() / 2] / 1e6);
+  return sink;
+}
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? std::atoi(argv[1]) : 10;
+  const int loops = argc > 2 ? std::atoi(argv[2]) : 1000000;
+
+  constexpr size_t kBodyLength = 63;
+  const std::vector<BenchOpCode> uniform(
+      kBodyLength, BenchOpCode::ADD_COUNTER);
+  std::vector<BenchOpCode> mixed;
+  uint32_t seed = 12345;
+  for (size_t i = 0; i < kBodyLength; i++) {
+    seed = seed * 1103515245 + 12345;
+    static const BenchOpCode ops[] = {
+        BenchOpCode::ADD_COUNTER,
+        BenchOpCode::SUB_COUNTER,
+        BenchOpCode::XOR_COUNTER};
+    mixed.push_back(ops[(seed >> 16) % 3]);
+  }
+
+  int64_t sink = runProgram("uniform", iterations, loops, uniform);
+  sink += runProgram("mixed", iterations, loops, mixed);
+  // Keep the loops from being optimized away.
+  if (sink == 0) {
+    std::abort();
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include <fmt/format.h>
+#include <chrono>
+#include <cstring>
+#include "minipy/jitparse/lexer.h"
+
+using namespace ::minipy;
+
+// Measures raw lexer throughput:
+//   lexer_benchmark <file.py> [iterations]
+//     lexes a memory-mapped file.
+//   lexer_benchmark --comment-stress
+//     lexes generated files made mostly of comments, blank lines and line
+//     continuations, at increasing sizes. Time per line should stay flat and
+//     the stack shouldn't grow with the number of skipped lines.
+
+struct Result {
+  size_t tokens = 0;
+  double seconds = 0;
+};
+
+static Result lexAll(const std::shared_ptr<SourceView>& source, int iterations) {
+  Result result;
+  const auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; ++i) {
+    Lexer L(source);
+    while (L.next().kind != TK_EOF) {
+      ++result.tokens;
+    }
+  }
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  result.seconds = elapsed.count();
+  return result;
+}
+
+static std::string commentHeavySource(size_t lines) {
+  std::string src;
+  for (size_t i = 0; i < lines; ++i) {
+    switch (i % 4) {
+      case 0:
+        src += "# a comment that the lexer has to skip over\n";
+        break;
+      case 1:
+        src += "\n";
+        break;
+      case 2:
+        src += "    # an indented comment\n";
+        break;
+      case 3:
+        src += i % 400 == 3 ? "x = 1 + \\\n" : "   \n";
+        break;
+    }
+  }
+  return src + "y = 2\n";
+}
+
+static int commentStress() {
+  for (size_t lines = 10000; lines <= 10000000; lines *= 10) {
+    auto source = std::make_shared<Source>(commentHeavySource(lines));
+    const auto r = lexAll(source, 1);
+    fmt::print(
+        "{:>9} lines: {:>8.2f}ms, {:.1f}ns/line\n",
+        lines,
+        r.seconds * 1e3,
+        r.seconds * 1e9 / lines);
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc >= 2 && std::strcmp(argv[1], "--comment-stress") == 0) {
+    return commentStress();
+  }
+  if (argc < 2) {
+    fmt::print(
+        stderr,
+        "usage: {} <file.py> [iterations] | --comment-stress\n",
+        argv[0]);
+    return 1;
+  }
+  const int iterations = argc > 2 ? std::atoi(argv[2]) : 10;
+  auto source = std::make_shared<MappedSource>(argv[1]);
+  const auto r = lexAll(source, iterations);
+
+  fmt::print(
+      "{} tokens in {:.3f}s: {:.2f}M tokens/s, {:.1f} MB/s\n",
+      r.tokens,
+      r.seconds,
+      r.tokens / r.seconds / 1e6,
+      source->text().size() * iterations / r.seconds / 1e6);
+  return 0;
+}
@@ -0,0 +1,142 @@
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "minipy/jitparse/lexer.h"
+#include "minipy/jitparse/parser.h"
+#include "minipy/jitparse/strtod.h"
+
+using namespace ::minipy;
+
+// Measures lexing numeric literals and reading their values:
+//   number_benchmark [lines] [iterations]
+// The generated module is mostly int and float literals of assorted lengths
+// and bases. Three things are timed:
+// - lexing the whole module
+// - finding the end and value of every literal with scanNumber(), against
+//   finding its end with strtod and converting its text again with strtoll
+//   or strtod, as the lexer and Const used to
+// - reading the value of every Const in the parsed module, which the lexer
+//   cached, against converting Const::text() again
+
+static std::string numberHeavySource(size_t lines) {
+  static const char* const literals[] = {
+      "0", "7", "42", "65535", "017", "0x7F3A", "1234567890123", "0.5",
+      "3.14159", "100.0", ".25", "1e10", "1.5e-7", "123456.789",
+      "6.02214076e23", "2.718281828459045"};
+  const size_t num_literals = sizeof(literals) / sizeof(literals[0]);
+  std::string src;
+  for (size_t i = 0; i < lines; i++) {
+    src += "x" + std::to_string(i % 100) + " = f(";
+    for (size_t j = 0; j < 8; j++) {
+      if (j > 0) {
+        src += ", ";
+      }
+      src += literals[(i * 5 + j * 3) % num_literals];
+    }
+    src += ")\n";
+  }
+  return src;
+}
+
+template <typename F>
+static double bestMs(int iterations, F&& f) {
+  std::vector<double> times;
+  for (int i = 0; i < iterations; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+  }
+  return *std::min_element(times.begin(), times.end());
+}
+
+static void collectConsts(const TreeRef& tree, std::vector<Const>& consts) {
+  if (tree->kind() == TK_CONST) {
+    consts.emplace_back(tree);
+    return;
+  }
+  for (const TreeRef& subtree : tree->trees()) {
+    collectConsts(subtree, consts);
+  }
+}
+
+static double valueFromText(const std::string& text) {
+  if (text.find_first_of(".eE") != std::string::npos) {
+    char* dummy;
+    return strtod_c(text.c_str(), &dummy);
+  }
+  return std::stoll(text, /*pos=*/0, /*base=*/0);
+}
+
+int main(int argc, char** argv) {
+  const size_t lines = argc > 1 ? std::atoi(argv[1]) : 200000;
+  const int iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+  const auto source = std::make_shared<Source>(numberHeavySource(lines));
+  const std::string_view text = source->text();
+
+  std::vector<size_t> starts;
+  const double lexMs = bestMs(iterations, [&] {
+    starts.clear();
+    Lexer L(source);
+    for (Token t = L.next(); t.kind != TK_EOF; t = L.next()) {
+      if (t.kind == TK_NUMBER) {
+        starts.push_back(t.range.start());
+      }
+    }
+  });
+  fmt::print(
+      "lex {:.1f} MB, {} literals: best {:.1f}ms\n",
+      text.size() / 1e6,
+      starts.size(),
+      lexMs);
+
+  double sum = 0;
+  const double scanMs = bestMs(iterations, [&] {
+    for (size_t start : starts) {
+      NumberLiteral number;
+      scanNumber(text.substr(start), &number);
+      sum += number.isFloat ? number.floatValue : number.intValue;
+    }
+  });
+  const double strtodMs = bestMs(iterations, [&] {
+    for (size_t start : starts) {
+      const char* begin = text.data() + start;
+      char* end;
+      strtod_c(begin, &end);
+      sum += valueFromText(std::string(begin, end - begin));
+    }
+  });
+  fmt::print(
+      "literal end and value: scanNumber best {:.1f}ms, "
+      "strtod then strtoll/strtod best {:.1f}ms\n",
+      scanMs,
+      strtodMs);
+
+  const Mod module = Parser(source).parseModule();
+  std::vector<Const> consts;
+  collectConsts(module.tree(), consts);
+  const double cachedMs = bestMs(iterations, [&] {
+    for (const Const& c : consts) {
+      sum += c.isFloatingPoint() ? c.asFloatingPoint() : c.asIntegral();
+    }
+  });
+  const double textMs = bestMs(iterations, [&] {
+    for (const Const& c : consts) {
+      sum += valueFromText(c.text());
+    }
+  });
+  fmt::print(
+      "{} Const values: cached best {:.1f}ms, from text best {:.1f}ms\n",
+      consts.size(),
+      cachedMs,
+      textMs);
+  // Keep the conversions from being optimized away.
+  if (sum == 0) {
+    std::abort();
+  }
+  return 0;
+}
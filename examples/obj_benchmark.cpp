@@ -0,0 +1,122 @@
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <vector>
+#include "minipy/interpreter/Obj.h"
+#include "minipy/interpreter/Stack.h"
+
+using namespace ::minipy;
+
+// Measures the interpreter's hottest Obj operations in whichever layout this
+// was built with:
+//   obj_benchmark [iterations]
+// obj_benchmark uses the tagged union and obj_benchmark_nan_boxing the
+// NaN-boxed word (MINIPY_NAN_BOXING), so running both compares the two.
+//
+// Each loop goes over a fixed mix of ints, doubles, None, bools and objects,
+// like the operands of a bytecode loop: pushing them onto a Stack and popping
+// them again, comparing them with == and is(), and richCompare() on ints.
+
+namespace {
+
+class Thing : public Dynamic {
+ public:
+  Thing() : Dynamic("Thing") {}
+};
+
+} // namespace
+
+template <typename F>
+static double bestNsPerOp(int iterations, size_t ops, F&& f) {
+  std::vector<double> times;
+  for (int i = 0; i < iterations; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count() / ops);
+  }
+  return *std::min_element(times.begin(), times.end());
+}
+
+int main(int argc, char** argv) {
+  const int iterations = argc > 1 ? std::atoi(argv[1]) : 10;
+  constexpr size_t kRounds = 200000;
+
+  const auto thing = c10::make_intrusive<Thing>();
+  const std::vector<Obj> operands = {
+      Obj(int64_t(1)),
+      Obj(2.5),
+      Obj(int64_t(-42)),
+      Obj(),
+      Obj(true),
+      Obj(thing),
+      Obj(int64_t(1) << 20),
+      Obj(-0.125),
+  };
+  const size_t ops = kRounds * operands.size();
+  int64_t sink = 0;
+
+  Stack stack;
+  stack.reserve(operands.size());
+  const double pushPop = bestNsPerOp(iterations, ops, [&] {
+    for (size_t r = 0; r < kRounds; r++) {
+      for (const Obj& obj : operands) {
+        push(stack, obj);
+      }
+      while (!stack.empty()) {
+        sink += pop(stack).isInt();
+      }
+    }
+  });
+
+  const double equals = bestNsPerOp(iterations, ops, [&] {
+    for (size_t r = 0; r < kRounds; r++) {
+      const Obj& lhs = operands[r % operands.size()];
+      for (const Obj& rhs : operands) {
+        sink += lhs == rhs;
+      }
+    }
+  });
+
+  const double is = bestNsPerOp(iterations, ops, [&] {
+    for (size_t r = 0; r < kRounds; r++) {
+      const Obj& lhs = operands[r % operands.size()];
+      for (const Obj& rhs : operands) {
+        sink += lhs.is(rhs);
+      }
+    }
+  });
+
+  const std::vector<Obj> ints = {
+      Obj(int64_t(3)),
+      Obj(int64_t(-7)),
+      Obj(int64_t(1) << 40),
+      Obj(int64_t(0)),
+  };
+  const size_t intOps = kRounds * ints.size();
+  const double compare = bestNsPerOp(iterations, intOps, [&] {
+    for (size_t r = 0; r < kRounds; r++) {
+      Obj lhs = ints[r % ints.size()];
+      for (const Obj& rhs : ints) {
+        sink += lhs.richCompare(rhs, /*lt*/ 0).toBool();
+      }
+    }
+  });
+
+  fmt::print(
+      "{}, sizeof(Obj) {}: push+pop {:.2f}ns, == {:.2f}ns, is() {:.2f}ns, "
+      "richCompare(int) {:.2f}ns\n",
+      MINIPY_NAN_BOXING ? "nan-boxed" : "tagged union",
+      sizeof(Obj),
+      pushPop,
+      equals,
+      is,
+      compare);
+  // Keep the loops from being optimized away.
+  if (sink == 0) {
+    std::abort();
+  }
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "minipy/jitparse/parser.h"
+
+using namespace ::minipy;
+
+// Measures parser throughput on expression-heavy code:
+//   parse_benchmark [file.py] [iterations]
+// Without a file, parses a generated module whose statements are mostly long
+// arithmetic, comparison and boolean expressions, so that most of the time
+// goes to precedence parsing rather than to statements or the lexer.
+//
+// Also times copying every TreeRef in the parsed module once, as passes that
+// walk the tree do. parse_benchmark_nonatomic is the same program built with
+// MINIPY_NONATOMIC_REFCOUNT, so comparing the two shows what atomic refcounts
+// cost.
+
+static std::string expressionHeavySource(size_t lines) {
+  static const char* const ops[] = {
+      "+", "-", "*", "/", "//", "%", "**", "<<", ">>", "&", "|", "^",
+      "<", ">", "<=", ">=", "==", "!=", "and", "or", "in", "is", "not in"};
+  const size_t num_ops = sizeof(ops) / sizeof(ops[0]);
+  std::string src;
+  for (size_t i = 0; i < lines; i++) {
+    src += "x" + std::to_string(i % 100) + " = ";
+    for (size_t j = 0; j < 12; j++) {
+      if (j > 0) {
+        src += std::string(" ") + ops[(i * 7 + j * 3) % num_ops] + " ";
+      }
+      src += j % 4 == 1 ? "-a" : j % 4 == 2 ? "not b" : "(c + d[1])";
+    }
+    src += "\n";
+  }
+  return src;
+}
+
+// Returns the number of TreeRefs copied.
+static size_t copyAll(const TreeRef& tree) {
+  size_t copies = 1;
+  for (TreeRef subtree : tree->trees()) {
+    copies += copyAll(subtree);
+  }
+  return copies;
+}
+
+int main(int argc, char** argv) {
+  std::shared_ptr<SourceView> source;
+  if (argc > 1) {
+    source = std::make_shared<MappedSource>(argv[1]);
+  } else {
+    source = std::make_shared<Source>(expressionHeavySource(50000));
+  }
+  const int iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+
+  std::vector<double> times;
+  std::vector<double> copyTimes;
+  size_t copies = 0;
+  for (int i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    Mod module = Parser(source, true).parseModule();
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+
+    start = std::chrono::steady_clock::now();
+    copies = copyAll(module.tree());
+    elapsed = std::chrono::steady_clock::now() - start;
+    copyTimes.push_back(elapsed.count());
+  }
+  std::sort(times.begin(), times.end());
+  std::sort(copyTimes.begin(), copyTimes.end());
+  fmt::print(
+      "{:.1f} MB, {} refcounts: parse best {:.1f}ms, median {:.1f}ms; "
+      "copying every TreeRef best {:.1f}ms\n",
+      source->text().size() / 1e6,
+      MINIPY_NONATOMIC_REFCOUNT ? "non-atomic" : "atomic",
+      times.front(),
+      times[times.size() / 2],
+      copyTimes.front());
+  if (copies == 0) {
+    std::abort();
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#include "minipy/jitparse/parser.h"
+
+using namespace ::minipy;
+
+// Compares parsing an edited module from scratch with reparsing it from the
+// module before the edit:
+//   reparse_benchmark <file.py>
+// The edits insert more and more top-level statements at a line in the
+// middle of the file that starts with `def`, so the statements around them
+// are reused and only the inserted ones are parsed.
+
+template <typename F>
+static double timeMs(F&& f) {
+  // The median of a few runs, since single edits are quick.
+  std::vector<double> times;
+  for (int i = 0; i < 5; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+  }
+  std::sort(times.begin(), times.end());
+  return times[times.size() / 2];
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fmt::print(stderr, "usage: {} <file.py>\n", argv[0]);
+    return 1;
+  }
+  const auto source = std::make_shared<MappedSource>(argv[1]);
+  const std::string text(source->text());
+  const Mod module = Parser(source).parseModule();
+
+  size_t offset = text.find("\ndef ", text.size() / 2);
+  if (offset == std::string::npos) {
+    fmt::print(stderr, "no top-level def in the second half of the file\n");
+    return 1;
+  }
+  offset++;
+
+  fmt::print("{:>12} {:>12} {:>12}\n", "edit bytes", "parse", "reparse");
+  for (size_t count = 1; count <= 100000; count *= 10) {
+    TextEdit edit{offset, 0, ""};
+    for (size_t i = 0; i < count; i++) {
+      edit.inserted += "x = 0\n";
+    }
+    std::string edited = text;
+    edited.insert(offset, edit.inserted);
+    const auto edited_source = std::make_shared<Source>(std::move(edited));
+
+    // Results are kept alive, so that freeing trees isn't measured.
+    std::vector<Mod> results;
+    const double parseMs = timeMs(
+        [&] { results.push_back(Parser(edited_source).parseModule()); });
+    const double reparseMs = timeMs([&] {
+      results.push_back(Parser(edited_source).reparseModule(module, edit));
+    });
+    fmt::print(
+        "{:>12} {:>10.2f}ms {:>10.3f}ms\n",
+        edit.inserted.size(),
+        parseMs,
+        reparseMs);
+  }
+  return 0;
+}
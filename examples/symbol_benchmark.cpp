@@ -0,0 +1,200 @@
+#include <fmt/format.h>
+#include <malloc.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "minipy/common/Symbol.h"
+#include "minipy/interpreter/Obj.h"
+
+using namespace ::minipy;
+
+// Compares keying attributes by std::string with keying them by Symbol on a
+// class-heavy workload:
+//   symbol_benchmark [objects] [iterations]
+// Builds many instances of a few hundred classes, each with a handful of
+// attributes drawn from a common pool of names, as methods storing to `self`
+// would. Reports:
+// - heap bytes held by the instances and by per-class name lists (like
+//   CodeObject::names), with names as strings and as Symbols
+// - getattr() by name for every attribute of every instance
+// - converting names to Objs, which allocates a StringObj per conversion for
+//   strings but reuses the canonical one for Symbols
+
+namespace {
+
+// Names of assorted lengths, some short enough for the small string
+// optimization and some not.
+const char* const kAttrNames[] = {
+    "x",
+    "y",
+    "name",
+    "parent",
+    "children",
+    "value",
+    "_cache",
+    "line_number",
+    "source_range",
+    "is_initialized",
+    "default_factory",
+    "max_retry_count",
+    "connection_timeout_ms",
+    "registered_callbacks",
+    "last_modified_timestamp",
+    "configuration_overrides",
+};
+constexpr size_t kNumAttrNames = sizeof(kAttrNames) / sizeof(kAttrNames[0]);
+constexpr size_t kAttrsPerClass = 8;
+constexpr size_t kNumClasses = 300;
+
+// The i-th attribute name of class `cls`.
+const char* attrName(size_t cls, size_t i) {
+  return kAttrNames[(cls * 5 + i * 3) % kNumAttrNames];
+}
+
+class StringInstance : public Dynamic {
+ public:
+  StringInstance() : Dynamic("StringInstance") {}
+  using Dynamic::getattr;
+  using Dynamic::setattr;
+  bool hasGetattr() const override {
+    return true;
+  }
+  Obj getattr(const std::string& name) const override {
+    return attrs_.at(name);
+  }
+  bool hasSetattr() const override {
+    return true;
+  }
+  void setattr(const std::string& name, Obj value) override {
+    attrs_[name] = std::move(value);
+  }
+
+ private:
+  std::unordered_map<std::string, Obj> attrs_;
+};
+
+class SymbolInstance : public Dynamic {
+ public:
+  SymbolInstance() : Dynamic("SymbolInstance") {}
+  using Dynamic::getattr;
+  using Dynamic::setattr;
+  bool hasGetattr() const override {
+    return true;
+  }
+  Obj getattr(Symbol name) const override {
+    return attrs_.at(name);
+  }
+  bool hasSetattr() const override {
+    return true;
+  }
+  void setattr(Symbol name, Obj value) override {
+    attrs_[name] = std::move(value);
+  }
+
+ private:
+  std::unordered_map<Symbol, Obj> attrs_;
+};
+
+// One class's instances and attribute names.
+template <typename Name>
+struct Class {
+  std::vector<Name> names;
+  std::vector<c10::intrusive_ptr<Dynamic>> instances;
+};
+
+} // namespace
+
+static size_t heapBytesInUse() {
+  return mallinfo2().uordblks;
+}
+
+template <typename Instance, typename Name>
+static std::vector<Class<Name>> buildClasses(size_t objects) {
+  std::vector<Class<Name>> classes(kNumClasses);
+  for (size_t cls = 0; cls < kNumClasses; cls++) {
+    for (size_t i = 0; i < kAttrsPerClass; i++) {
+      classes[cls].names.emplace_back(attrName(cls, i));
+    }
+  }
+  for (size_t n = 0; n < objects; n++) {
+    auto& cls = classes[n % kNumClasses];
+    auto instance = c10::make_intrusive<Instance>();
+    for (size_t i = 0; i < cls.names.size(); i++) {
+      instance->setattr(cls.names[i], Obj(int64_t(n + i)));
+    }
+    cls.instances.push_back(std::move(instance));
+  }
+  return classes;
+}
+
+template <typename F>
+static double bestMs(int iterations, F&& f) {
+  std::vector<double> times;
+  for (int i = 0; i < iterations; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+  }
+  return *std::min_element(times.begin(), times.end());
+}
+
+template <typename Instance, typename Name>
+static void runMode(const char* label, size_t objects, int iterations) {
+  const size_t before = heapBytesInUse();
+  const auto classes = buildClasses<Instance, Name>(objects);
+  const size_t bytes = heapBytesInUse() - before;
+
+  int64_t sink = 0;
+  const double getattrMs = bestMs(iterations, [&] {
+    for (const auto& cls : classes) {
+      for (const auto& instance : cls.instances) {
+        for (const Name& name : cls.names) {
+          sink += instance->getattr(name).toInt();
+        }
+      }
+    }
+  });
+  const size_t lookups = objects * kAttrsPerClass;
+
+  size_t conversions = 0;
+  const double toObjMs = bestMs(iterations, [&] {
+    conversions = 0;
+    for (size_t n = 0; n < objects; n++) {
+      for (const Name& name : classes[n % kNumClasses].names) {
+        sink += Obj(name).isString();
+        conversions++;
+      }
+    }
+  });
+
+  fmt::print(
+      "{:>6}: {} objects, heap {:.1f}MB; getattr best {:.1f}ns; "
+      "name to Obj best {:.1f}ns\n",
+      label,
+      objects,
+      bytes / 1e6,
+      getattrMs * 1e6 / lookups,
+      toObjMs * 1e6 / conversions);
+  // Keep the loops from being optimized away.
+  if (sink == 0) {
+    std::abort();
+  }
+}
+
+int main(int argc, char** argv) {
+  const size_t objects = argc > 1 ? std::atoi(argv[1]) : 200000;
+  const int iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+  // Intern the names up front, as the parser would have, so that both modes
+  // measure only their own instances.
+  for (const char* name : kAttrNames) {
+    Obj(Symbol(name));
+  }
+  runMode<StringInstance, std::string>("string", objects, iterations);
+  runMode<SymbolInstance, Symbol>("Symbol", objects, iterations);
+  return 0;
+}
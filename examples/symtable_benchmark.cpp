@@ -0,0 +1,150 @@
+#include <fmt/format.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "minipy/compiler/SymbolTable.h"
+#include "minipy/jitparse/parser.h"
+
+using namespace ::minipy;
+
+// Measures SymbolTable::build() and lookup() on modules with many defs:
+//   symtable_benchmark [num_defs] [iterations] [threads]
+// One module has flat functions; in the other, every def is a closure factory
+// whose nested functions capture names from one and two levels out, so that
+// most of the scope analysis goes to cell and free variables. Each module is
+// parsed once; only building the table and looking up every top-level def's
+// entry is timed.
+//
+// symtable_benchmark_checked is the same program built with
+// MINIPY_TRUST_STMT_LISTS=0, so that every List<Stmt> view checks its
+// statements (and parses a lazy body to do so) even when the parser built the
+// list. Comparing the two shows what Tree::isStmtList() saves.
+//
+// Last, startup of the closure-heavy module when only every tenth function
+// is ever compiled: parse, build and look up those, eagerly or with
+// ParserOptions::lazyFunctionBodies and SymbolTableOptions::lazyBlocks.
+
+static std::string manyDefsSource(size_t num_defs) {
+  std::string src;
+  for (size_t i = 0; i < num_defs; i++) {
+    const auto n = std::to_string(i);
+    src += "def f" + n + "(a, b, c):\n";
+    src += "    x" + n + " = a + b * c\n";
+    src += "    y = f" + std::to_string(i / 2) + "(x" + n + ", a, b)\n";
+    src += "    if y > c:\n        z = y - x" + n + "\n";
+    src += "    return g(x" + n + ", y, a)\n\n";
+  }
+  return src;
+}
+
+static std::string closureHeavySource(size_t num_defs) {
+  std::string src;
+  for (size_t i = 0; i < num_defs; i++) {
+    const auto n = std::to_string(i);
+    src += "def make" + n + "(a, b, c):\n";
+    src += "    total = a + b\n";
+    src += "    def step(x):\n";
+    src += "        scale = x * c\n";
+    src += "        def apply(y):\n";
+    src += "            return y * scale + total - a\n";
+    src += "        return apply(x) + b\n";
+    src += "    def reset(z):\n        return z - total\n";
+    src += "    return step(total) + reset(c)\n\n";
+  }
+  return src;
+}
+
+static void run(
+    const char* name,
+    const std::string& text,
+    int iterations,
+    size_t threads) {
+  const Mod module = Parser(std::make_shared<Source>(text)).parseModule();
+  std::vector<TreeRef> defs;
+  for (const Stmt& stmt : module.body()) {
+    defs.push_back(stmt.tree());
+  }
+
+  std::vector<double> buildTimes;
+  std::vector<double> lookupTimes;
+  for (int i = 0; i < iterations; i++) {
+    auto start = std::chrono::steady_clock::now();
+    SymbolTableOptions options;
+    options.parallelism = threads;
+    auto table = SymbolTable::build(module, options);
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    buildTimes.push_back(elapsed.count());
+
+    start = std::chrono::steady_clock::now();
+    size_t symbols = 0;
+    for (const TreeRef& def : defs) {
+      symbols += table->lookup(def)->symbols.size();
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    lookupTimes.push_back(elapsed.count());
+    if (symbols == 0) {
+      std::abort();
+    }
+  }
+  std::sort(buildTimes.begin(), buildTimes.end());
+  std::sort(lookupTimes.begin(), lookupTimes.end());
+  fmt::print(
+      "{:>8}, {} defs, {} threads: build best {:.2f}ms, median {:.2f}ms; "
+      "lookup of every def best {:.3f}ms\n",
+      name,
+      defs.size(),
+      threads,
+      buildTimes.front(),
+      buildTimes[buildTimes.size() / 2],
+      lookupTimes.front());
+}
+
+static void runStartup(const std::string& text, int iterations, bool lazy) {
+  const auto source = std::make_shared<Source>(text);
+  ParserOptions parserOptions;
+  parserOptions.lazyFunctionBodies = lazy;
+  SymbolTableOptions tableOptions;
+  tableOptions.lazyBlocks = lazy;
+
+  std::vector<double> times;
+  for (int i = 0; i < iterations; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    const Mod module = Parser(source, parserOptions).parseModule();
+    auto table = SymbolTable::build(module, tableOptions);
+    size_t symbols = 0;
+    const auto body = module.body();
+    for (size_t d = 0; d < body.size(); d += 10) {
+      symbols += table->lookup(body[d].tree())->symbols.size();
+    }
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    times.push_back(elapsed.count());
+    if (symbols == 0) {
+      std::abort();
+    }
+  }
+  std::sort(times.begin(), times.end());
+  fmt::print(
+      "{:>8}, 10% used: parse, build and look up best {:.2f}ms, "
+      "median {:.2f}ms\n",
+      lazy ? "lazy" : "eager",
+      times.front(),
+      times[times.size() / 2]);
+}
+
+int main(int argc, char** argv) {
+  const size_t num_defs = argc > 1 ? std::atoi(argv[1]) : 20000;
+  const int iterations = argc > 2 ? std::atoi(argv[2]) : 10;
+  const size_t threads = argc > 3 ? std::atoi(argv[3]) : 1;
+  fmt::print(
+      "Parsed statement lists {}\n",
+      MINIPY_TRUST_STMT_LISTS ? "trusted" : "checked on every view");
+  run("flat", manyDefsSource(num_defs), iterations, threads);
+  run("closures", closureHeavySource(num_defs), iterations, threads);
+  runStartup(closureHeavySource(num_defs), iterations, false);
+  runStartup(closureHeavySource(num_defs), iterations, true);
+  return 0;
+}
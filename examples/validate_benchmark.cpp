@@ -0,0 +1,103 @@
+#include <fmt/format.h>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include "minipy/jitparse/parser.h"
+
+using namespace ::minipy;
+
+// Compares ways of checking a corpus of small modules for syntax errors:
+//   validate_benchmark [num_files] [defs_per_file]
+// Every other module has a syntax error somewhere, like an editor or a linter
+// would see. Each file is checked a few times and the best time is kept.
+
+static std::string generateModule(size_t index, size_t num_defs) {
+  std::string src;
+  for (size_t i = 0; i < num_defs; i++) {
+    const auto n = std::to_string(index * num_defs + i);
+    src += "def f" + n + "(a, b):\n";
+    src += "    x = [a + " + n + ", b * 2]\n";
+    src += "    if x[0] > b:\n        return x\n";
+    src += "    return {'a': a, 'b': (b,)}\n\n";
+  }
+  if (index % 2 == 1) {
+    // Break a statement at a different place in each invalid file.
+    static const char* const errors[] = {"(", ")", ":", "$", " = =", "\n  x"};
+    size_t offset = src.find("\n", (index * 7919) % src.size());
+    if (offset == std::string::npos) {
+      offset = src.size() - 1;
+    }
+    src.insert(offset, errors[index / 2 % 6]);
+  }
+  return src;
+}
+
+template <typename F>
+static double timeMs(F&& f) {
+  double best = 0;
+  for (int i = 0; i < 5; i++) {
+    const auto start = std::chrono::steady_clock::now();
+    f();
+    const std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if (i == 0 || elapsed.count() < best) {
+      best = elapsed.count();
+    }
+  }
+  return best;
+}
+
+int main(int argc, char** argv) {
+  const size_t num_files = argc > 1 ? std::atoi(argv[1]) : 2000;
+  const size_t num_defs = argc > 2 ? std::atoi(argv[2]) : 5;
+  std::vector<std::shared_ptr<SourceView>> corpus;
+  for (size_t i = 0; i < num_files; i++) {
+    corpus.push_back(std::make_shared<Source>(generateModule(i, num_defs)));
+  }
+
+  size_t invalid = 0;
+  const double throwMs = timeMs([&] {
+    invalid = 0;
+    for (const auto& source : corpus) {
+      try {
+        Parser(source).parseModule();
+      } catch (const std::runtime_error&) {
+        invalid++;
+      }
+    }
+  });
+  const double throwMessageMs = timeMs([&] {
+    for (const auto& source : corpus) {
+      try {
+        Parser(source).parseModule();
+      } catch (const std::runtime_error& e) {
+        // As if the message was shown.
+        std::string message = e.what();
+      }
+    }
+  });
+  size_t tryInvalid = 0;
+  const double tryMs = timeMs([&] {
+    tryInvalid = 0;
+    for (const auto& source : corpus) {
+      if (!Parser(source).tryParseModule()) {
+        tryInvalid++;
+      }
+    }
+  });
+  if (invalid != tryInvalid) {
+    fmt::print(
+        stderr,
+        "parseModule() found {} invalid files but tryParseModule() {}\n",
+        invalid,
+        tryInvalid);
+    return 1;
+  }
+
+  fmt::print("{} files, {} invalid\n", num_files, invalid);
+  fmt::print("parseModule, catch:         {:>8.1f}ms\n", throwMs);
+  fmt::print("parseModule, catch, what(): {:>8.1f}ms\n", throwMessageMs);
+  fmt::print("tryParseModule:             {:>8.1f}ms\n", tryMs);
+  return 0;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "minipy/common/intrusive_ptr.h"
+
+namespace minipy {
+
+/**
+ * class Symbol
+ *
+ * An interned string, used for identifiers and attribute names. Interning the
+ * same text twice yields the same Symbol, so comparing and hashing Symbols are
+ * integer operations and each distinct name is stored exactly once.
+ *
+ * Each Symbol has a small, dense, stable id (assigned in interning order) and
+ * an optional canonical runtime object (e.g. the interpreter's StringObj for
+ * this name), so repeated `Obj(Symbol)` conversions don't allocate.
+ *
+ * Interned strings live for the rest of the process. Only intern names, not
+ * arbitrary data like string literals.
+ */
+class Symbol {
+ public:
+  // The empty string, whose id is always 0. Doesn't take the table's lock.
+  Symbol() : entry_(table().empty) {}
+  explicit Symbol(std::string_view str) : entry_(intern(str)) {}
+
+  uint32_t id() const {
+    return entry_->id;
+  }
+  const std::string& str() const {
+    return entry_->str;
+  }
+
+  // The canonical object for this name, or nullptr if none was set yet.
+  c10::intrusive_ptr_target* object() const {
+    return entry_->object.load(std::memory_order_acquire);
+  }
+  // Install `object` as this symbol's canonical object, taking over the
+  // caller's reference. If another thread got there first, its object is kept
+  // and returned, and `object` is released. `object` must already be
+  // share()d, since every thread will use it.
+  c10::intrusive_ptr_target* setObjectIfAbsent(
+      c10::intrusive_ptr_target* object) const {
+    c10::intrusive_ptr_target* expected = nullptr;
+    if (entry_->object.compare_exchange_strong(
+            expected, object, std::memory_order_acq_rel)) {
+      return object;
+    }
+    c10::raw::intrusive_ptr::decref(object);
+    return expected;
+  }
+
+  static Symbol fromId(uint32_t id) {
+    auto& t = table();
+    std::lock_guard<std::mutex> guard(t.mutex);
+    return Symbol(&t.entries.at(id));
+  }
+  // Number of distinct symbols interned so far.
+  static size_t numSymbols() {
+    auto& t = table();
+    std::lock_guard<std::mutex> guard(t.mutex);
+    return t.entries.size();
+  }
+
+  bool operator==(const Symbol& rhs) const {
+    return entry_ == rhs.entry_;
+  }
+  bool operator!=(const Symbol& rhs) const {
+    return entry_ != rhs.entry_;
+  }
+  // Orders by id, i.e. interning order, not alphabetically.
+  bool operator<(const Symbol& rhs) const {
+    return id() < rhs.id();
+  }
+
+ private:
+  struct Entry {
+    Entry(uint32_t id, std::string str) : id(id), str(std::move(str)) {}
+    const uint32_t id;
+    const std::string str;
+    mutable std::atomic<c10::intrusive_ptr_target*> object{nullptr};
+  };
+  struct Table {
+    Table() {
+      entries.emplace_back(0, std::string());
+      empty = &entries.back();
+      lookup.emplace(empty->str, &entries.back());
+    }
+    std::mutex mutex;
+    // std::deque never moves its elements on push_back, so Entry pointers
+    // (and the string_view keys into them) stay valid.
+    std::deque<Entry> entries;
+    std::unordered_map<std::string_view, Entry*> lookup;
+    // Interned first, and never changes after.
+    const Entry* empty;
+  };
+
+  explicit Symbol(const Entry* entry) : entry_(entry) {}
+
+  static Table& table() {
+    // Leaked on purpose: Symbols may be used during static destruction.
+    static Table* t = new Table();
+    return *t;
+  }
+
+  static const Entry* intern(std::string_view str) {
+    auto& t = table();
+    std::lock_guard<std::mutex> guard(t.mutex);
+    auto it = t.lookup.find(str);
+    if (it != t.lookup.end()) {
+      return it->second;
+    }
+    t.entries.emplace_back(
+        static_cast<uint32_t>(t.entries.size()), std::string(str));
+    Entry* entry = &t.entries.back();
+    t.lookup.emplace(entry->str, entry);
+    return entry;
+  }
+
+  const Entry* entry_;
+};
+
+} // namespace minipy
+
+namespace std {
+template <>
+struct hash<minipy::Symbol> {
+  size_t operator()(const minipy::Symbol& s) const {
+    return std::hash<uint32_t>()(s.id());
+  }
+};
+} // namespace std
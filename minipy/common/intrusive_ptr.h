@@ -5,6 +5,28 @@
 #include <cassert> // TODO delet
 #include <stdexcept>
 
+// Note [Non-atomic refcounting]
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// By default refcounts are updated with atomic read-modify-write operations,
+// so intrusive_ptrs can be freely copied across threads. Our interpreters each
+// run on a single thread though, so that is a locked instruction per Obj copy,
+// Stack push and TreeRef copy that buys us nothing.
+//
+// When built with MINIPY_NONATOMIC_REFCOUNT, every intrusive_ptr_target starts
+// out *owned* by the thread that created it, and its counts are updated with
+// plain (relaxed load + store) arithmetic. Before an object, or anything
+// reachable from it, is handed to another thread it must be explicitly
+// promoted with share(), after which its counts go back to atomic RMWs.
+// Sharing is one-way and must happen-before the object is published to the
+// other thread (e.g. before it is pushed onto a queue or into a mutex
+// protected structure).
+//
+// Without MINIPY_NONATOMIC_REFCOUNT every object is born shared and share()
+// is a no-op.
+#ifndef MINIPY_NONATOMIC_REFCOUNT
+#define MINIPY_NONATOMIC_REFCOUNT 0
+#endif
+
 namespace c10 {
 class intrusive_ptr_target;
 namespace raw {
@@ -65,6 +87,10 @@ class intrusive_ptr_target {
   //
   mutable std::atomic<size_t> refcount_;
   mutable std::atomic<size_t> weakcount_;
+#if MINIPY_NONATOMIC_REFCOUNT
+  // See Note [Non-atomic refcounting]
+  mutable bool shared_;
+#endif
 
   template <typename T, typename NullType>
   friend class intrusive_ptr;
@@ -108,7 +134,12 @@ class intrusive_ptr_target {
 #endif
   }
 
+#if MINIPY_NONATOMIC_REFCOUNT
+  constexpr intrusive_ptr_target() noexcept
+      : refcount_(0), weakcount_(0), shared_(false) {}
+#else
   constexpr intrusive_ptr_target() noexcept : refcount_(0), weakcount_(0) {}
+#endif
 
   // intrusive_ptr_target supports copy and move: but refcount and weakcount
   // don't participate (since they are intrinsic properties of the memory
@@ -124,7 +155,70 @@ class intrusive_ptr_target {
     return *this;
   }
 
+ public:
+  /**
+   * Promote this object to atomic refcounting so that intrusive_ptrs to it can
+   * be copied and destroyed on other threads. Objects that own other
+   * intrusive_ptr_targets must override share_referents() so that everything
+   * reachable from a shared object is shared too.
+   * See Note [Non-atomic refcounting]
+   */
+  void share() const {
+#if MINIPY_NONATOMIC_REFCOUNT
+    if (shared_) {
+      return;
+    }
+    shared_ = true;
+    const_cast<intrusive_ptr_target*>(this)->share_referents();
+#endif
+  }
+
+  bool is_shared() const noexcept {
+#if MINIPY_NONATOMIC_REFCOUNT
+    return shared_;
+#else
+    return true;
+#endif
+  }
+
+ protected:
+  /**
+   * Called the first time this object is share()d. Override this to share()
+   * any intrusive_ptr_targets owned by this object.
+   */
+  virtual void share_referents() {}
+
  private:
+  static size_t increment_(std::atomic<size_t>& count, bool shared) noexcept {
+    if (shared) {
+      return ++count;
+    }
+    // Only the owning thread can touch this count, so skip the locked RMW.
+    const size_t result = count.load(std::memory_order_relaxed) + 1;
+    count.store(result, std::memory_order_relaxed);
+    return result;
+  }
+  static size_t decrement_(std::atomic<size_t>& count, bool shared) noexcept {
+    if (shared) {
+      return --count;
+    }
+    const size_t result = count.load(std::memory_order_relaxed) - 1;
+    count.store(result, std::memory_order_relaxed);
+    return result;
+  }
+  size_t refcount_increment_() const noexcept {
+    return increment_(refcount_, is_shared());
+  }
+  size_t refcount_decrement_() const noexcept {
+    return decrement_(refcount_, is_shared());
+  }
+  size_t weakcount_increment_() const noexcept {
+    return increment_(weakcount_, is_shared());
+  }
+  size_t weakcount_decrement_() const noexcept {
+    return decrement_(weakcount_, is_shared());
+  }
+
   /**
    * This is called when refcount reaches zero.
    * You can override this to release expensive resources.
@@ -140,6 +234,20 @@ class intrusive_ptr_target {
    * not be called.
    */
   virtual void release_resources() {}
+
+  /**
+   * This is called when both counts reach zero, to destroy the object and
+   * free its memory. The default is `delete this`; override it for objects
+   * whose memory is managed some other way (e.g. Trees in a TreeArena).
+   */
+  virtual void delete_self() {
+    delete this;
+  }
+  // Calls delete_self() through the base class, where intrusive_ptr has
+  // access to it however subclasses declare it.
+  static void delete_(const intrusive_ptr_target* self) {
+    const_cast<intrusive_ptr_target*>(self)->delete_self();
+  }
 };
 
 namespace detail {
@@ -194,14 +302,15 @@ class intrusive_ptr final {
 
   void retain_() {
     if (target_ != NullType::singleton()) {
-      size_t new_refcount = ++target_->refcount_;
+      size_t new_refcount = target_->refcount_increment_();
       assert(new_refcount != 1);
       //   "intrusive_ptr: Cannot increase refcount after it reached zero.");
     }
   }
 
   void reset_() noexcept {
-    if (target_ != NullType::singleton() && --target_->refcount_ == 0) {
+    if (target_ != NullType::singleton() &&
+        target_->refcount_decrement_() == 0) {
       // justification for const_cast: release_resources is basically a
       // destructor and a destructor always mutates the object, even for const
       // objects.
@@ -210,8 +319,8 @@ class intrusive_ptr final {
       // See comment above about weakcount. As long as refcount>0,
       // weakcount is one larger than the actual number of weak references.
       // So we need to decrement it here.
-      if (--target_->weakcount_ == 0) {
-        delete target_;
+      if (target_->weakcount_decrement_() == 0) {
+        intrusive_ptr_target::delete_(target_);
       }
     }
     target_ = NullType::singleton();
@@ -366,8 +475,8 @@ class intrusive_ptr final {
     // We can't use retain_(), because we also have to increase weakcount
     // and because we allow raising these values from 0, which retain_()
     // has an assertion against.
-    ++result.target_->refcount_;
-    ++result.target_->weakcount_;
+    result.target_->refcount_increment_();
+    result.target_->weakcount_increment_();
 
     return result;
   }
@@ -450,7 +559,7 @@ class weak_intrusive_ptr final {
 
   void retain_() {
     if (target_ != NullType::singleton()) {
-      size_t new_weakcount = ++target_->weakcount_;
+      size_t new_weakcount = target_->weakcount_increment_();
       assert(new_weakcount != 1);
       //   "weak_intrusive_ptr: Cannot increase weakcount after it reached
       //   zero.");
@@ -458,8 +567,9 @@ class weak_intrusive_ptr final {
   }
 
   void reset_() noexcept {
-    if (target_ != NullType::singleton() && --target_->weakcount_ == 0) {
-      delete target_;
+    if (target_ != NullType::singleton() &&
+        target_->weakcount_decrement_() == 0) {
+      intrusive_ptr_target::delete_(target_);
     }
     target_ = NullType::singleton();
   }
@@ -702,7 +812,7 @@ namespace intrusive_ptr {
 // NullType::singleton to this function
 inline void incref(intrusive_ptr_target* self) {
   if (self) {
-    ++self->refcount_;
+    self->refcount_increment_();
   }
 }
 
@@ -736,7 +846,7 @@ inline uint32_t use_count(intrusive_ptr_target* self) {
 namespace weak_intrusive_ptr {
 
 inline void incref(weak_intrusive_ptr_target* self) {
-  ++self->weakcount_;
+  self->weakcount_increment_();
 }
 
 inline void decref(weak_intrusive_ptr_target* self) {
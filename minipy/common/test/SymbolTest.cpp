@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "minipy/common/Symbol.h"
+
+namespace minipy {
+
+TEST(Symbol, Interning) {
+  const std::string text = "symbol_test_interning";
+  const Symbol a(text);
+  // Interned from a different buffer, and from a substring.
+  const Symbol b(std::string("symbol_test_") + "interning");
+  const Symbol c(std::string_view("xsymbol_test_interningx").substr(1, 21));
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(a, c);
+  EXPECT_EQ(&a.str(), &b.str());
+  EXPECT_EQ(a.str(), text);
+  EXPECT_EQ(a.id(), b.id());
+
+  const Symbol other("symbol_test_other");
+  EXPECT_NE(a, other);
+  EXPECT_NE(a.id(), other.id());
+  EXPECT_EQ(std::hash<Symbol>()(a), std::hash<Symbol>()(Symbol(text)));
+}
+
+TEST(Symbol, Empty) {
+  EXPECT_EQ(Symbol(), Symbol(""));
+  EXPECT_EQ(Symbol().id(), 0u);
+  EXPECT_EQ(Symbol().str(), "");
+  EXPECT_EQ(Symbol::fromId(0), Symbol());
+}
+
+TEST(Symbol, StableIds) {
+  const Symbol first("symbol_test_first");
+  const uint32_t id = first.id();
+  const size_t before = Symbol::numSymbols();
+  // Interning more names doesn't move or renumber existing ones.
+  std::vector<Symbol> more;
+  for (int i = 0; i < 1000; i++) {
+    more.emplace_back("symbol_test_stable_" + std::to_string(i));
+  }
+  EXPECT_EQ(Symbol::numSymbols(), before + 1000);
+  EXPECT_EQ(Symbol("symbol_test_first").id(), id);
+  EXPECT_EQ(Symbol::fromId(id), first);
+  EXPECT_EQ(Symbol::fromId(id).str(), "symbol_test_first");
+  // Ids are dense and in interning order.
+  for (size_t i = 0; i < more.size(); i++) {
+    EXPECT_EQ(more[i].id(), before + i);
+    EXPECT_LT(first, more[i]);
+  }
+}
+
+TEST(Symbol, ConcurrentInterning) {
+  constexpr int kThreads = 8;
+  constexpr int kNames = 500;
+  auto name = [](int n) {
+    return "symbol_test_concurrent_" + std::to_string(n);
+  };
+  const size_t before = Symbol::numSymbols();
+  std::vector<std::vector<Symbol>> symbols(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.emplace_back([&, t] {
+      // Every thread interns all the names, each starting somewhere else,
+      // along with empty Symbols, which don't take the lock.
+      for (int i = 0; i < kNames; i++) {
+        symbols[t].emplace_back(name((i + t * 61) % kNames));
+        symbols[t].emplace_back();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  // Each name was interned exactly once.
+  EXPECT_EQ(Symbol::numSymbols(), before + kNames);
+  std::unordered_set<uint32_t> ids;
+  for (int t = 0; t < kThreads; t++) {
+    for (int i = 0; i < kNames; i++) {
+      const Symbol& s = symbols[t][2 * i];
+      EXPECT_EQ(s, Symbol(name((i + t * 61) % kNames)));
+      EXPECT_EQ(symbols[t][2 * i + 1], Symbol());
+      ids.insert(s.id());
+    }
+  }
+  EXPECT_EQ(ids.size(), kNames);
+}
+
+} // namespace minipy
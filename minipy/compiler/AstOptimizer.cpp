@@ -0,0 +1,205 @@
+#include "AstOptimizer.h"
+
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <sstream>
+
+namespace minipy {
+namespace {
+
+// Ints above this can't be converted to double exactly.
+constexpr int64_t kMaxExactDouble = int64_t(1) << 53;
+
+bool isFoldable(const Const& c) {
+  // Complex literals like `2j` aren't representable as a Const value yet.
+  if (c.text().back() == 'j') {
+    return false;
+  }
+  // Ints that don't fit in an int64_t are arbitrary precision at runtime.
+  const NumberLiteral* number = c.tree()->trees()[0]->number();
+  return !(number && number->overflow);
+}
+
+std::string doubleToText(double v) {
+  std::ostringstream ss;
+  ss.precision(17);
+  ss << v;
+  auto text = ss.str();
+  // Make sure the result still lexes as a float, see Const::isFloatingPoint().
+  if (text.find_first_of(".eE") == std::string::npos) {
+    text += ".0";
+  }
+  return text;
+}
+
+std::optional<int64_t> foldIntegral(int kind, int64_t lhs, int64_t rhs) {
+  int64_t result;
+  switch (kind) {
+    case '+':
+      if (__builtin_add_overflow(lhs, rhs, &result)) {
+        return std::nullopt;
+      }
+      return result;
+    case '-':
+      if (__builtin_sub_overflow(lhs, rhs, &result)) {
+        return std::nullopt;
+      }
+      return result;
+    case '*':
+      if (__builtin_mul_overflow(lhs, rhs, &result)) {
+        return std::nullopt;
+      }
+      return result;
+    case TK_FLOOR_DIV:
+    case '%': {
+      if (rhs == 0 || (lhs == INT64_MIN && rhs == -1)) {
+        return std::nullopt;
+      }
+      // C++ truncates towards zero, Python rounds towards negative infinity.
+      int64_t quot = lhs / rhs;
+      int64_t rem = lhs % rhs;
+      if (rem != 0 && ((rem < 0) != (rhs < 0))) {
+        quot -= 1;
+        rem += rhs;
+      }
+      return kind == '%' ? rem : quot;
+    }
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<double> foldFloatingPoint(int kind, double lhs, double rhs) {
+  double result;
+  switch (kind) {
+    case '+':
+      result = lhs + rhs;
+      break;
+    case '-':
+      result = lhs - rhs;
+      break;
+    case '*':
+      result = lhs * rhs;
+      break;
+    case '/':
+      if (rhs == 0) {
+        return std::nullopt;
+      }
+      result = lhs / rhs;
+      break;
+    default:
+      return std::nullopt;
+  }
+  if (!std::isfinite(result)) {
+    return std::nullopt;
+  }
+  return result;
+}
+
+// Returns the folded Const, or nullopt if `lhs <kind> rhs` can't be folded.
+std::optional<TreeRef> foldBinOp(
+    const SourceRange& range,
+    int kind,
+    const Const& lhs,
+    const Const& rhs) {
+  if (!isFoldable(lhs) || !isFoldable(rhs)) {
+    return std::nullopt;
+  }
+  if (lhs.isIntegral() && rhs.isIntegral()) {
+    const auto l = lhs.asIntegral();
+    const auto r = rhs.asIntegral();
+    if (kind != '/') {
+      if (auto result = foldIntegral(kind, l, r)) {
+        return Const::create(range, std::to_string(*result));
+      }
+      return std::nullopt;
+    }
+    // True division of ints produces a float.
+    if (l < -kMaxExactDouble || l > kMaxExactDouble || r < -kMaxExactDouble ||
+        r > kMaxExactDouble) {
+      return std::nullopt;
+    }
+  }
+  const auto l = lhs.isIntegral() ? static_cast<double>(lhs.asIntegral())
+                                  : lhs.asFloatingPoint();
+  const auto r = rhs.isIntegral() ? static_cast<double>(rhs.asIntegral())
+                                  : rhs.asFloatingPoint();
+  if (auto result = foldFloatingPoint(kind, l, r)) {
+    return Const::create(range, doubleToText(*result));
+  }
+  return std::nullopt;
+}
+
+std::optional<TreeRef> foldUnaryMinus(
+    const SourceRange& range,
+    const Const& operand) {
+  if (!isFoldable(operand)) {
+    return std::nullopt;
+  }
+  if (operand.isIntegral()) {
+    const auto v = operand.asIntegral();
+    if (v == INT64_MIN) {
+      return std::nullopt;
+    }
+    return Const::create(range, std::to_string(-v));
+  }
+  return Const::create(range, doubleToText(-operand.asFloatingPoint()));
+}
+
+TreeRef fold(const TreeRef& tree) {
+  if (tree->isAtom()) {
+    return tree;
+  }
+  bool changed = false;
+  TreeList trees;
+  trees.reserve(tree->trees().size());
+  for (const auto& t : tree->trees()) {
+    trees.push_back(fold(t));
+    changed |= trees.back() != t;
+  }
+
+  switch (tree->kind()) {
+    case '+':
+    case '-':
+    case '*':
+    case '/':
+    case '%':
+    case TK_FLOOR_DIV:
+      if (trees.size() == 2 && trees[0]->kind() == TK_CONST &&
+          trees[1]->kind() == TK_CONST) {
+        const auto folded = foldBinOp(
+            tree->range(), tree->kind(), Const(trees[0]), Const(trees[1]));
+        if (folded) {
+          return *folded;
+        }
+      }
+      break;
+    case TK_UNARY_MINUS:
+      if (trees[0]->kind() == TK_CONST) {
+        if (auto folded = foldUnaryMinus(tree->range(), Const(trees[0]))) {
+          return *folded;
+        }
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (!changed) {
+    return tree;
+  }
+  return Compound::create(tree->kind(), tree->range(), std::move(trees));
+}
+
+} // namespace
+
+Mod foldConstants(const Mod& module) {
+  return Mod(fold(module.tree()));
+}
+
+Def foldConstants(const Def& def) {
+  return Def(fold(def.tree()));
+}
+
+} // namespace minipy
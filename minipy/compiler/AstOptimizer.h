@@ -0,0 +1,22 @@
+#pragma once
+
+#include "minipy/jitparse/tree_views.h"
+
+namespace minipy {
+
+/**
+ * AST-level optimizations, run on the parser output before
+ * SymbolTable::build() and emit().
+ *
+ * Rewritten subtrees are fresh Compound nodes and untouched subtrees are
+ * shared with the input, so these must run before anything that keys on
+ * TreeRef identity (e.g. SymbolTable::lookup()).
+ */
+
+// Fold arithmetic over numeric literals, e.g. `(2 + 3) * 4` becomes `20`.
+// Anything whose result would differ from Python's at runtime (overflow,
+// division by zero, non-finite floats) is left alone.
+Mod foldConstants(const Mod& module);
+Def foldConstants(const Def& def);
+
+} // namespace minipy
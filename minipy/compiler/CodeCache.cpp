@@ -0,0 +1,516 @@
+#include "minipy/compiler/CodeCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#include "minipy/jitparse/ast_cache.h"
+
+namespace minipy {
+
+namespace {
+
+constexpr char kMagic[8] = {'M', 'P', 'Y', 'C', 'O', 'D', 'E', '\0'};
+// Bump whenever the encoding changes. Changes to what the compiler emits
+// bump kCompilerVersion instead.
+constexpr uint32_t kVersion = 1;
+
+// A file is the header followed by these sections, in order:
+//   CodeEntry[numCodes]
+//   ConstantRecord[numConstants]  the constants of every code object
+//   uint32_t[numNameRefs]         string ids of every names and varnames list
+//   uint32_t[numStrings + 1]      string offsets, then the string bytes
+//   padding to a multiple of 8
+//   instructionBytes              every instruction array, 8-byte aligned
+// All sizes up to the string offsets are multiples of 8, so the fixed-size
+// records are naturally aligned too, but they're still read with memcpy.
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t compilerVersion;
+  uint64_t sourceHash;
+  uint64_t sourceSize;
+  uint32_t numCodes;
+  uint32_t numConstants;
+  uint32_t numNameRefs;
+  uint32_t numStrings;
+  uint64_t stringBytes;
+  uint64_t instructionBytes;
+  // hashSourceText() of everything after the header, to catch corruption.
+  uint64_t bodyHash;
+};
+
+struct CodeEntry {
+  uint32_t name;
+  uint32_t instructionSize;
+  // Relative to the start of the instruction section.
+  uint64_t instructionOffset;
+  uint64_t numInstructions;
+  uint32_t firstConstant;
+  uint32_t numConstants;
+  // Both lists are in the name refs.
+  uint32_t firstName;
+  uint32_t numNames;
+  uint32_t firstVarname;
+  uint32_t numVarnames;
+};
+
+struct ConstantRecord {
+  uint8_t kind;
+  uint8_t padding[3];
+  // A string id for STRING, a code index for CODE.
+  uint32_t index;
+  // intValue or the bits of doubleValue, depending on kind.
+  uint64_t bits;
+};
+
+static_assert(sizeof(Header) % 8 == 0, "");
+static_assert(sizeof(CodeEntry) % 8 == 0, "");
+static_assert(sizeof(ConstantRecord) % 8 == 0, "");
+
+size_t paddingTo8(size_t offset) {
+  return (8 - offset % 8) % 8;
+}
+
+template <typename T>
+void append(std::string& out, const T& value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T>
+T at(const char* base, size_t i) {
+  T result;
+  std::memcpy(&result, base + i * sizeof(T), sizeof(T));
+  return result;
+}
+
+[[noreturn]] void malformed(const char* what) {
+  throw std::runtime_error(std::string(what) + " in code cache data");
+}
+
+class Encoder {
+ public:
+  explicit Encoder(const std::vector<CodeRecord>& codes) : codes_(codes) {
+    if (codes.empty()) {
+      throw std::runtime_error("can't serialize a module without code");
+    }
+    for (size_t i = 0; i < codes.size(); i++) {
+      encode(i, codes[i]);
+    }
+  }
+
+  std::string finish(
+      size_t sourceSize,
+      uint64_t sourceHash,
+      uint32_t compilerVersion) {
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.compilerVersion = compilerVersion;
+    header.sourceHash = sourceHash;
+    header.sourceSize = sourceSize;
+    header.numCodes = entries_.size();
+    header.numConstants = constants_.size();
+    header.numNameRefs = nameRefs_.size();
+    header.numStrings = stringOffsets_.size();
+    header.stringBytes = strings_.size();
+    header.instructionBytes = instructions_.size();
+    header.bodyHash = 0;
+
+    std::string out;
+    out.reserve(
+        sizeof(Header) + entries_.size() * sizeof(CodeEntry) +
+        constants_.size() * sizeof(ConstantRecord) +
+        (nameRefs_.size() + stringOffsets_.size() + 1) * sizeof(uint32_t) +
+        strings_.size() + 8 + instructions_.size());
+    append(out, header);
+    for (const auto& entry : entries_) {
+      append(out, entry);
+    }
+    for (const auto& constant : constants_) {
+      append(out, constant);
+    }
+    for (uint32_t ref : nameRefs_) {
+      append(out, ref);
+    }
+    for (uint32_t offset : stringOffsets_) {
+      append(out, offset);
+    }
+    append(out, static_cast<uint32_t>(strings_.size()));
+    out += strings_;
+    out.append(paddingTo8(out.size()), '\0');
+    out += instructions_;
+    header.bodyHash =
+        hashSourceText(std::string_view(out).substr(sizeof(Header)));
+    std::memcpy(&out[0], &header, sizeof(Header));
+    return out;
+  }
+
+ private:
+  void encode(size_t index, const CodeRecord& code) {
+    CodeEntry entry;
+    std::memset(&entry, 0, sizeof(entry));
+    entry.name = addString(code.name);
+
+    if (!code.instructions.empty() &&
+        (code.instructionSize == 0 ||
+         code.instructions.size() % code.instructionSize != 0)) {
+      throw std::runtime_error("instructions aren't a whole number of records");
+    }
+    instructions_.append(paddingTo8(instructions_.size()), '\0');
+    entry.instructionSize = code.instructionSize;
+    entry.instructionOffset = instructions_.size();
+    entry.numInstructions = code.instructions.empty()
+        ? 0
+        : code.instructions.size() / code.instructionSize;
+    instructions_ += code.instructions;
+
+    entry.firstConstant = constants_.size();
+    entry.numConstants = code.constants.size();
+    for (const CodeConstant& constant : code.constants) {
+      ConstantRecord record;
+      std::memset(&record, 0, sizeof(record));
+      record.kind = static_cast<uint8_t>(constant.kind);
+      switch (constant.kind) {
+        case CodeConstant::Kind::NONE:
+          break;
+        case CodeConstant::Kind::BOOL:
+        case CodeConstant::Kind::INT:
+          record.bits = static_cast<uint64_t>(constant.intValue);
+          break;
+        case CodeConstant::Kind::DOUBLE:
+          std::memcpy(&record.bits, &constant.doubleValue, sizeof(record.bits));
+          break;
+        case CodeConstant::Kind::STRING:
+          record.index = addString(constant.stringValue);
+          break;
+        case CodeConstant::Kind::CODE:
+          if (constant.code <= index || constant.code >= codes_.size()) {
+            throw std::runtime_error(
+                "nested code objects must come after their parent");
+          }
+          record.index = constant.code;
+          break;
+      }
+      constants_.push_back(record);
+    }
+
+    entry.firstName = nameRefs_.size();
+    entry.numNames = code.names.size();
+    for (const auto& name : code.names) {
+      nameRefs_.push_back(addString(name));
+    }
+    entry.firstVarname = nameRefs_.size();
+    entry.numVarnames = code.varnames.size();
+    for (const auto& name : code.varnames) {
+      nameRefs_.push_back(addString(name));
+    }
+    entries_.push_back(entry);
+  }
+
+  uint32_t addString(std::string_view str) {
+    auto it = stringIds_.find(str);
+    if (it != stringIds_.end()) {
+      return it->second;
+    }
+    const uint32_t id = stringOffsets_.size();
+    stringOffsets_.push_back(strings_.size());
+    strings_ += str;
+    stringIds_.emplace(str, id);
+    return id;
+  }
+
+  const std::vector<CodeRecord>& codes_;
+  std::vector<CodeEntry> entries_;
+  std::vector<ConstantRecord> constants_;
+  std::vector<uint32_t> nameRefs_;
+  std::vector<uint32_t> stringOffsets_;
+  std::string strings_;
+  std::string instructions_;
+  // Keys point into `codes_`, which outlives the encoder.
+  std::unordered_map<std::string_view, uint32_t> stringIds_;
+};
+
+// Bounds-checked walk over the sections of a file.
+class Reader {
+ public:
+  explicit Reader(std::string_view data) : data_(data) {}
+
+  template <typename T>
+  const char* take(uint64_t count) {
+    if (count > (data_.size() - pos_) / sizeof(T)) {
+      malformed("truncated section");
+    }
+    const char* result = data_.data() + pos_;
+    pos_ += count * sizeof(T);
+    return result;
+  }
+
+  size_t pos() const {
+    return pos_;
+  }
+  bool done() const {
+    return pos_ == data_.size();
+  }
+
+ private:
+  std::string_view data_;
+  size_t pos_ = 0;
+};
+
+std::string cacheFileName(uint64_t sourceHash, uint32_t compilerVersion) {
+  char name[48];
+  std::snprintf(
+      name,
+      sizeof(name),
+      "%016llx-%u.mpyc",
+      static_cast<unsigned long long>(sourceHash),
+      compilerVersion);
+  return name;
+}
+
+} // namespace
+
+std::string_view CodeNames::operator[](size_t i) const {
+  return image_->string(at<uint32_t>(refs_, i));
+}
+
+std::string_view CodeView::name() const {
+  return image_->string(at<CodeEntry>(image_->codes_, index_).name);
+}
+
+size_t CodeView::numInstructions() const {
+  return at<CodeEntry>(image_->codes_, index_).numInstructions;
+}
+
+uint32_t CodeView::instructionSize() const {
+  return at<CodeEntry>(image_->codes_, index_).instructionSize;
+}
+
+const char* CodeView::instructionData() const {
+  return image_->instructions_ +
+      at<CodeEntry>(image_->codes_, index_).instructionOffset;
+}
+
+size_t CodeView::numConstants() const {
+  return at<CodeEntry>(image_->codes_, index_).numConstants;
+}
+
+CodeConstant CodeView::constant(size_t i) const {
+  const auto entry = at<CodeEntry>(image_->codes_, index_);
+  const auto record =
+      at<ConstantRecord>(image_->constants_, entry.firstConstant + i);
+  CodeConstant constant;
+  constant.kind = static_cast<CodeConstant::Kind>(record.kind);
+  switch (constant.kind) {
+    case CodeConstant::Kind::NONE:
+      break;
+    case CodeConstant::Kind::BOOL:
+    case CodeConstant::Kind::INT:
+      constant.intValue = static_cast<int64_t>(record.bits);
+      break;
+    case CodeConstant::Kind::DOUBLE:
+      std::memcpy(&constant.doubleValue, &record.bits, sizeof(record.bits));
+      break;
+    case CodeConstant::Kind::STRING:
+      constant.stringValue = image_->string(record.index);
+      break;
+    case CodeConstant::Kind::CODE:
+      constant.code = record.index;
+      break;
+  }
+  return constant;
+}
+
+CodeNames CodeView::names() const {
+  const auto entry = at<CodeEntry>(image_->codes_, index_);
+  return CodeNames(
+      *image_,
+      image_->nameRefs_ + entry.firstName * sizeof(uint32_t),
+      entry.numNames);
+}
+
+CodeNames CodeView::varnames() const {
+  const auto entry = at<CodeEntry>(image_->codes_, index_);
+  return CodeNames(
+      *image_,
+      image_->nameRefs_ + entry.firstVarname * sizeof(uint32_t),
+      entry.numVarnames);
+}
+
+std::string_view CodeImage::string(uint32_t id) const {
+  const uint32_t begin = at<uint32_t>(stringOffsets_, id);
+  const uint32_t end = at<uint32_t>(stringOffsets_, id + 1);
+  return std::string_view(strings_ + begin, end - begin);
+}
+
+std::unique_ptr<CodeImage> CodeImage::fromBytes(
+    std::string_view data,
+    std::string_view sourceText,
+    uint32_t compilerVersion) {
+  std::unique_ptr<CodeImage> image(new CodeImage());
+  // Copied into 8-byte words so that instructions are aligned, like they are
+  // in a mapping.
+  image->copy_.resize((data.size() + 7) / 8);
+  if (!data.empty()) {
+    std::memcpy(image->copy_.data(), data.data(), data.size());
+  }
+  image->data_ = std::string_view(
+      reinterpret_cast<const char*>(image->copy_.data()), data.size());
+  image->open(sourceText.size(), hashSourceText(sourceText), compilerVersion);
+  return image;
+}
+
+std::unique_ptr<CodeImage> CodeImage::map(
+    const std::string& path,
+    std::string_view sourceText,
+    uint32_t compilerVersion) {
+  return map(
+      path, sourceText.size(), hashSourceText(sourceText), compilerVersion);
+}
+
+std::unique_ptr<CodeImage> CodeImage::map(
+    const std::string& path,
+    size_t sourceSize,
+    uint64_t sourceHash,
+    uint32_t compilerVersion) {
+  std::unique_ptr<CodeImage> image(new CodeImage());
+  // Mappings start on a page boundary.
+  image->mapping_ = std::make_unique<MappedSource>(path);
+  image->data_ = image->mapping_->text();
+  image->open(sourceSize, sourceHash, compilerVersion);
+  return image;
+}
+
+void CodeImage::open(
+    size_t sourceSize,
+    uint64_t sourceHash,
+    uint32_t compilerVersion) {
+  Reader reader(data_);
+  const auto header = at<Header>(reader.take<Header>(1), 0);
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion) {
+    throw std::runtime_error("not a code cache file for this version");
+  }
+  if (header.compilerVersion != compilerVersion) {
+    throw std::runtime_error("code cache data is for a different compiler");
+  }
+  if (header.sourceSize != sourceSize || header.sourceHash != sourceHash) {
+    throw std::runtime_error("code cache data is for a different source");
+  }
+  if (header.bodyHash != hashSourceText(data_.substr(sizeof(Header)))) {
+    malformed("checksum mismatch");
+  }
+  if (header.numCodes == 0) {
+    malformed("no code");
+  }
+  codes_ = reader.take<CodeEntry>(header.numCodes);
+  constants_ = reader.take<ConstantRecord>(header.numConstants);
+  nameRefs_ = reader.take<uint32_t>(header.numNameRefs);
+  stringOffsets_ = reader.take<uint32_t>(header.numStrings + 1ull);
+  strings_ = reader.take<char>(header.stringBytes);
+  reader.take<char>(paddingTo8(reader.pos()));
+  instructions_ = reader.take<char>(header.instructionBytes);
+  if (!reader.done()) {
+    malformed("trailing bytes");
+  }
+  numCodes_ = header.numCodes;
+  numStrings_ = header.numStrings;
+
+  // Check every index once, so that the accessors don't have to.
+  uint32_t prevOffset = 0;
+  for (size_t i = 0; i <= numStrings_; i++) {
+    const uint32_t offset = at<uint32_t>(stringOffsets_, i);
+    if (offset < prevOffset || offset > header.stringBytes ||
+        (i == numStrings_ && offset != header.stringBytes)) {
+      malformed("bad string offset");
+    }
+    prevOffset = offset;
+  }
+  for (size_t i = 0; i < header.numNameRefs; i++) {
+    if (at<uint32_t>(nameRefs_, i) >= numStrings_) {
+      malformed("bad name");
+    }
+  }
+  for (size_t i = 0; i < numCodes_; i++) {
+    const auto entry = at<CodeEntry>(codes_, i);
+    if (entry.name >= numStrings_) {
+      malformed("bad code name");
+    }
+    if (entry.instructionOffset % 8 != 0 ||
+        entry.instructionOffset > header.instructionBytes ||
+        (entry.numInstructions != 0 &&
+         (entry.instructionSize == 0 ||
+          entry.numInstructions >
+              (header.instructionBytes - entry.instructionOffset) /
+                  entry.instructionSize))) {
+      malformed("bad instructions");
+    }
+    if (uint64_t(entry.firstName) + entry.numNames > header.numNameRefs ||
+        uint64_t(entry.firstVarname) + entry.numVarnames >
+            header.numNameRefs) {
+      malformed("bad names");
+    }
+    if (uint64_t(entry.firstConstant) + entry.numConstants >
+        header.numConstants) {
+      malformed("bad constants");
+    }
+    for (size_t j = 0; j < entry.numConstants; j++) {
+      const auto record =
+          at<ConstantRecord>(constants_, entry.firstConstant + j);
+      if (record.kind > static_cast<uint8_t>(CodeConstant::Kind::CODE) ||
+          (record.kind == static_cast<uint8_t>(CodeConstant::Kind::STRING) &&
+           record.index >= numStrings_) ||
+          // Nested code must come later, so there are no cycles.
+          (record.kind == static_cast<uint8_t>(CodeConstant::Kind::CODE) &&
+           (record.index <= i || record.index >= numCodes_))) {
+        malformed("bad constant");
+      }
+    }
+  }
+}
+
+std::string serializeCode(
+    const std::vector<CodeRecord>& codes,
+    std::string_view sourceText,
+    uint32_t compilerVersion) {
+  return Encoder(codes).finish(
+      sourceText.size(), hashSourceText(sourceText), compilerVersion);
+}
+
+CodeCache::CodeCache(std::string directory, uint32_t compilerVersion)
+    : directory_(std::move(directory)), compilerVersion_(compilerVersion) {}
+
+std::string CodeCache::pathFor(const SourceView& source) const {
+  return directory_ + "/" +
+      cacheFileName(hashSourceText(source.text()), compilerVersion_);
+}
+
+std::unique_ptr<CodeImage> CodeCache::load(const SourceView& source) const {
+  const std::string_view text = source.text();
+  const uint64_t hash = hashSourceText(text);
+  try {
+    return CodeImage::map(
+        directory_ + "/" + cacheFileName(hash, compilerVersion_),
+        text.size(),
+        hash,
+        compilerVersion_);
+  } catch (const std::runtime_error&) {
+    // Missing, stale or corrupt; the next store() replaces it.
+    return nullptr;
+  }
+}
+
+bool CodeCache::store(
+    const SourceView& source,
+    const std::vector<CodeRecord>& codes) const {
+  std::string data;
+  try {
+    data = serializeCode(codes, source.text(), compilerVersion_);
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+  return writeCacheFile(directory_, pathFor(source), data);
+}
+
+} // namespace minipy
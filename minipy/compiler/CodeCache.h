@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "minipy/jitparse/source_range.h"
+
+namespace minipy {
+
+// Compiled code objects in a versioned binary format (.mpyc), so that a
+// process whose scripts haven't changed can skip both parsing and compiling.
+//
+// A file holds every code object of one module: its instructions, constants,
+// names and varnames. Nested code objects (functions) are constants that
+// refer to another code object in the same file by index. Everything is laid
+// out so that a memory-mapped file can be used in place: instruction arrays
+// start at 8-byte aligned offsets and strings are views into the mapping. See
+// CodeCache.cpp for the details; integers are in native byte order.
+
+// Bump whenever the compiler's output changes for the same source, so that
+// cache files written by an older compiler are ignored.
+constexpr uint32_t kCompilerVersion = 1;
+
+struct CodeConstant {
+  enum class Kind : uint8_t { NONE, BOOL, INT, DOUBLE, STRING, CODE };
+  Kind kind = Kind::NONE;
+  // BOOL and INT.
+  int64_t intValue = 0;
+  double doubleValue = 0;
+  std::string_view stringValue;
+  // For CODE, the index of the nested code object.
+  uint32_t code = 0;
+};
+
+// One code object, as it is written to a cache file. Strings and instructions
+// are only referenced, so they must outlive serializeCode().
+struct CodeRecord {
+  std::string name;
+  // The raw bytes of the instruction array, and the size of one instruction.
+  std::string_view instructions;
+  uint32_t instructionSize = 0;
+  std::vector<CodeConstant> constants;
+  std::vector<std::string> names;
+  std::vector<std::string> varnames;
+
+  template <typename T>
+  void setInstructions(const std::vector<T>& insts) {
+    static_assert(std::is_trivially_copyable<T>::value, "");
+    instructions = std::string_view(
+        reinterpret_cast<const char*>(insts.data()), insts.size() * sizeof(T));
+    instructionSize = sizeof(T);
+  }
+};
+
+// A read-only array in a CodeImage.
+template <typename T>
+class CodeArray {
+ public:
+  CodeArray(const T* data, size_t size) : data_(data), size_(size) {}
+  const T* begin() const {
+    return data_;
+  }
+  const T* end() const {
+    return data_ + size_;
+  }
+  const T* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+  const T& operator[](size_t i) const {
+    return data_[i];
+  }
+
+ private:
+  const T* data_;
+  size_t size_;
+};
+
+class CodeImage;
+
+// A list of names or varnames in a CodeImage.
+class CodeNames {
+ public:
+  CodeNames(const CodeImage& image, const char* refs, size_t size)
+      : image_(&image), refs_(refs), size_(size) {}
+  size_t size() const {
+    return size_;
+  }
+  std::string_view operator[](size_t i) const;
+
+ private:
+  const CodeImage* image_;
+  const char* refs_;
+  size_t size_;
+};
+
+// One code object in a CodeImage. Only valid as long as the image is.
+class CodeView {
+ public:
+  std::string_view name() const;
+  size_t numInstructions() const;
+  // The instructions, in place. T must be the type they were written as;
+  // throws std::runtime_error if its size is different.
+  template <typename T>
+  CodeArray<T> instructions() const {
+    static_assert(std::is_trivially_copyable<T>::value, "");
+    static_assert(alignof(T) <= 8, "instructions are only 8-byte aligned");
+    if (sizeof(T) != instructionSize()) {
+      throw std::runtime_error("cached instructions have a different size");
+    }
+    return CodeArray<T>(
+        reinterpret_cast<const T*>(instructionData()), numInstructions());
+  }
+  size_t numConstants() const;
+  CodeConstant constant(size_t i) const;
+  CodeNames names() const;
+  CodeNames varnames() const;
+
+ private:
+  friend class CodeImage;
+  CodeView(const CodeImage& image, size_t index)
+      : image_(&image), index_(index) {}
+  uint32_t instructionSize() const;
+  const char* instructionData() const;
+
+  const CodeImage* image_;
+  size_t index_;
+};
+
+/**
+ * class CodeImage
+ *
+ * The code objects of one module, read from serializeCode()'s output. The
+ * whole image is validated once when it's opened, so accessors don't check
+ * anything; code(0) is the module's code object.
+ */
+class CodeImage {
+ public:
+  // Copies `data`. Throws std::runtime_error if it's malformed, or was
+  // written for different source text or by a different compiler version.
+  static std::unique_ptr<CodeImage> fromBytes(
+      std::string_view data,
+      std::string_view sourceText,
+      uint32_t compilerVersion = kCompilerVersion);
+  // Maps the file at `path` instead of copying it.
+  static std::unique_ptr<CodeImage> map(
+      const std::string& path,
+      std::string_view sourceText,
+      uint32_t compilerVersion = kCompilerVersion);
+
+  size_t size() const {
+    return numCodes_;
+  }
+  CodeView code(size_t i) const {
+    return CodeView(*this, i);
+  }
+
+ private:
+  friend class CodeView;
+  friend class CodeNames;
+  friend class CodeCache;
+  CodeImage() {}
+  static std::unique_ptr<CodeImage> map(
+      const std::string& path,
+      size_t sourceSize,
+      uint64_t sourceHash,
+      uint32_t compilerVersion);
+  void open(size_t sourceSize, uint64_t sourceHash, uint32_t compilerVersion);
+  std::string_view string(uint32_t id) const;
+
+  std::vector<uint64_t> copy_;
+  std::unique_ptr<MappedSource> mapping_;
+  std::string_view data_;
+  size_t numCodes_ = 0;
+  size_t numStrings_ = 0;
+  const char* codes_ = nullptr;
+  const char* constants_ = nullptr;
+  const char* nameRefs_ = nullptr;
+  const char* stringOffsets_ = nullptr;
+  const char* strings_ = nullptr;
+  const char* instructions_ = nullptr;
+};
+
+// Encodes `codes`, the code objects compiled from `sourceText`. codes[0] is
+// the module; a CODE constant must refer to a code object after its own.
+std::string serializeCode(
+    const std::vector<CodeRecord>& codes,
+    std::string_view sourceText,
+    uint32_t compilerVersion = kCompilerVersion);
+
+/**
+ * class CodeCache
+ *
+ * A directory of .mpyc files, one per distinct source text and compiler
+ * version. Like AstCache, files are written to a temporary name and renamed
+ * into place, so any number of processes can share the directory.
+ */
+class CodeCache {
+ public:
+  explicit CodeCache(
+      std::string directory,
+      uint32_t compilerVersion = kCompilerVersion);
+
+  // The cached code for `source`, mapped in place, or nullptr if there is no
+  // usable entry (missing, stale, or corrupt).
+  std::unique_ptr<CodeImage> load(const SourceView& source) const;
+
+  // Writes the code compiled from `source`. Returns false if it couldn't be
+  // written; the cache is only an optimization.
+  bool store(const SourceView& source, const std::vector<CodeRecord>& codes)
+      const;
+
+  // The file `source` is cached in.
+  std::string pathFor(const SourceView& source) const;
+
+ private:
+  std::string directory_;
+  uint32_t compilerVersion_;
+};
+
+} // namespace minipy
@@ -1,20 +1,129 @@
 #include "SymbolTable.h"
 
 #include "minipy/jitparse/lexer.h"
+#include "minipy/jitparse/parser.h"
 #include "minipy/jitparse/tree_views.h"
 
 #include <fmt/format.h>
 #include <fmt/ostream.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
-#include <unordered_set>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 namespace minipy {
-SymbolScope SymbolInfo::getScope() const {
-  if (*this & SymbolFlag::DEF_LOCAL || *this & SymbolFlag::DEF_PARAM) {
-    return SymbolScope::LOCAL;
-  } else {
-    // TODO this is wrong, we can have stuff besides local and global
-    return SymbolScope::GLOBAL;
+namespace {
+// A set of names, for scope analysis. The names bound in the functions
+// around a block are rarely more than a few dozen, so a vector does.
+class SymbolSet {
+ public:
+  bool contains(Symbol name) const {
+    return std::find(names_.begin(), names_.end(), name) != names_.end();
+  }
+  void insert(Symbol name) {
+    if (!contains(name)) {
+      names_.push_back(name);
+    }
+  }
+  void insertAll(const SymbolSet& other) {
+    for (Symbol name : other) {
+      insert(name);
+    }
+  }
+  void erase(Symbol name) {
+    auto it = std::find(names_.begin(), names_.end(), name);
+    if (it != names_.end()) {
+      names_.erase(it);
+    }
+  }
+  bool empty() const {
+    return names_.empty();
+  }
+  std::vector<Symbol>::const_iterator begin() const {
+    return names_.begin();
+  }
+  std::vector<Symbol>::const_iterator end() const {
+    return names_.end();
+  }
+
+ private:
+  std::vector<Symbol> names_;
+};
+} // namespace
+
+// Whether the block binds the name itself.
+static bool isBound(const SymbolInfo& info) {
+  return info & SymbolFlag::DEF_LOCAL || info & SymbolFlag::DEF_PARAM ||
+      info & SymbolFlag::DEF_IMPORT;
+}
+
+static size_t slotFor(Symbol name, size_t mask) {
+  // Ids are dense, so spread them out before masking.
+  return (name.id() * 0x9e3779b1u) & mask;
+}
+
+int SymbolMap::indexOf(Symbol name) const {
+  if (index_.empty()) {
+    for (size_t i = 0; i < entries_.size(); i++) {
+      if (entries_[i].first == name) {
+        return static_cast<int>(i);
+      }
+    }
+    return -1;
+  }
+  const size_t mask = index_.size() - 1;
+  for (size_t slot = slotFor(name, mask);; slot = (slot + 1) & mask) {
+    const uint32_t i = index_[slot];
+    if (i == 0) {
+      return -1;
+    }
+    if (entries_[i - 1].first == name) {
+      return static_cast<int>(i - 1);
+    }
+  }
+}
+
+SymbolInfo& SymbolMap::operator[](Symbol name) {
+  const int i = indexOf(name);
+  if (i >= 0) {
+    return entries_[i].second;
+  }
+  if (entries_.empty()) {
+    // Rather than growing through 1, 2 and 4 first.
+    entries_.reserve(kMaxUnindexed);
+  }
+  entries_.emplace_back(name, SymbolInfo());
+  if (entries_.size() > kMaxUnindexed) {
+    if (entries_.size() * 2 > index_.size()) {
+      rebuildIndex();
+    } else {
+      const size_t mask = index_.size() - 1;
+      size_t slot = slotFor(name, mask);
+      while (index_[slot] != 0) {
+        slot = (slot + 1) & mask;
+      }
+      index_[slot] = entries_.size();
+    }
+  }
+  return entries_.back().second;
+}
+
+void SymbolMap::rebuildIndex() {
+  size_t slots = 4 * kMaxUnindexed;
+  while (slots < entries_.size() * 4) {
+    slots *= 2;
+  }
+  index_.assign(slots, 0);
+  const size_t mask = slots - 1;
+  for (size_t i = 0; i < entries_.size(); i++) {
+    size_t slot = slotFor(entries_[i].first, mask);
+    while (index_[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+    index_[slot] = i + 1;
   }
 }
 
@@ -22,23 +131,95 @@ class SymbolTable::SymbolTableBuilder {
  public:
   explicit SymbolTableBuilder() {}
 
-  std::unique_ptr<SymbolTable> build(Mod module) {
+  std::unique_ptr<SymbolTable> build(
+      Mod module,
+      const SymbolTableOptions& options) {
     // Can't use make_unique because SymbolTable's constructor is private
-    table_ = std::unique_ptr<SymbolTable>(new SymbolTable());
+    auto table = std::unique_ptr<SymbolTable>(new SymbolTable());
+    table_ = table.get();
+    table->lazy_ = options.lazyBlocks;
+    if (options.lazyBlocks) {
+      // Any thread may build the rest, copying TreeRefs into the module.
+      module.tree()->share();
+    }
     push(module);
-    visit(module.body());
+    if (options.parallelism > 1 && !options.lazyBlocks) {
+      buildConcurrently(module, options.parallelism);
+    } else {
+      visit(module.body());
+    }
+    analyzeRoot();
     pop();
-    return std::move(table_);
+    return table;
   }
 
   std::unique_ptr<SymbolTable> build(Def def) {
     // Can't use make_unique because SymbolTable's constructor is private
-    table_ = std::unique_ptr<SymbolTable>(new SymbolTable());
+    auto table = std::unique_ptr<SymbolTable>(new SymbolTable());
+    table_ = table.get();
     push(def);
     visit(def.decl().params());
     visit(def.statements());
+    analyzeRoot();
+    pop();
+    return table;
+  }
+
+  void update(SymbolTable* table, Mod module) {
+    table_ = table;
+    auto& entries = table->entries_;
+    // The module itself is always new, so its old entry can go right away,
+    // and the new one takes its place. New entries don't take the place of
+    // any other old ones until it's known whether they are reused.
+    numPrevious_ = entries.size();
+    live_.assign(numPrevious_, false);
+    if (!entries.empty()) {
+      entries.front() = SymbolTableEntry();
+      table->freeIds_.push_back(0);
+    }
+    push(module);
+    visit(module.body());
+    analyzeRoot();
     pop();
-    return std::move(table_);
+    for (size_t id = 1; id < numPrevious_; id++) {
+      if (!live_[id] && entries[id].ref) {
+        entries[id] = SymbolTableEntry();
+        table->freeIds_.push_back(id);
+      }
+    }
+  }
+
+  // Builds the lazy block `entry` in a table of its own, and moves the
+  // result into `entry` and its Lazy::nested.
+  static void buildLazy(SymbolTableEntry& entry) {
+    SymbolTable block;
+    SymbolTableBuilder builder;
+    builder.table_ = &block;
+    builder.buildBlock(entry.ref);
+    auto& nested = entry.lazy->nested;
+    for (size_t id = 1; id < block.entries_.size(); id++) {
+      nested.push_back(
+          std::make_unique<SymbolTableEntry>(std::move(block.entries_[id])));
+    }
+    // Children still point into `block`, whose entries keep their ids.
+    auto relink = [&](SymbolTableEntry& parent) {
+      for (SymbolTableEntry*& child : parent.children) {
+        child = nested[child->id - 1].get();
+      }
+    };
+    for (auto& child : nested) {
+      relink(*child);
+      child->id = entry.id;
+      child->ref->setBlockId(entry.id);
+    }
+    SymbolTableEntry& root = block.entries_.front();
+    entry.symbols = std::move(root.symbols);
+    entry.args = std::move(root.args);
+    entry.cellvars = std::move(root.cellvars);
+    entry.freevars = std::move(root.freevars);
+    entry.children = std::move(root.children);
+    relink(entry);
+    entry.ref->setBlockId(entry.id);
   }
 
  private:
@@ -51,27 +232,38 @@ class SymbolTable::SymbolTableBuilder {
 
   void visit(Def def) {
     // Add a symbol to the outer block representing this def
-    addSymbol(def.name().name(), SymbolFlag::DEF_LOCAL);
+    addSymbol(def.name().symbol(), SymbolFlag::DEF_LOCAL);
+    if (reuse(def.tree()) || defer(def.tree())) {
+      return;
+    }
+    populate(def);
+  }
 
-    // Then construct a new block and populate it.
+  // Constructs a new block for `def` and populates it.
+  void populate(Def def) {
     push(def);
     visit(def.decl().params());
     visit(def.statements());
-    pop();
+    popBlock();
   }
 
   void visit(ClassDef classDef) {
     // Add a symbol to the outer scope representing this def
-    addSymbol(classDef.name().name(), SymbolFlag::DEF_LOCAL);
+    addSymbol(classDef.name().symbol(), SymbolFlag::DEF_LOCAL);
+    if (reuse(classDef.tree()) || defer(classDef.tree())) {
+      return;
+    }
+    populate(classDef);
+  }
 
-    // Then construct a new block and populate it.
+  void populate(ClassDef classDef) {
     push(classDef);
     visit(classDef.body());
-    pop();
+    popBlock();
   }
 
   void visit(Param param) {
-    addSymbol(param.ident().name(), SymbolFlag::DEF_PARAM);
+    addSymbol(param.ident().symbol(), SymbolFlag::DEF_PARAM);
   }
 
   void visit(BinOp binOp) {
@@ -119,9 +311,9 @@ class SymbolTable::SymbolTableBuilder {
       case TK_VAR: {
         Var var(expr);
         if (isAssignmentContext_) {
-          addSymbol(var.name().name(), SymbolFlag::DEF_LOCAL);
+          addSymbol(var.name().symbol(), SymbolFlag::DEF_LOCAL);
         } else {
-          addSymbol(var.name().name(), SymbolFlag::USE);
+          addSymbol(var.name().symbol(), SymbolFlag::USE);
         }
       } break;
       case TK_UNARY_MINUS:
@@ -209,9 +401,24 @@ class SymbolTable::SymbolTableBuilder {
           visit(assert_.msg().get());
         }
       } break;
+      case TK_GLOBAL: {
+        for (Ident ident : Global(stmt).names()) {
+          const SymbolInfo* info = cur()->symbols.find(ident.symbol());
+          if (info && *info & SymbolFlag::DEF_PARAM) {
+            throw ErrorReport(ident.range())
+                << "symtable: name '" << ident.name()
+                << "' is parameter and global";
+          }
+          if (info &&
+              (*info & SymbolFlag::DEF_LOCAL || *info & SymbolFlag::USE)) {
+            throw ErrorReport(ident.range())
+                << "symtable: name '" << ident.name()
+                << "' is used prior to global declaration";
+          }
+          addSymbol(ident.symbol(), SymbolFlag::DEF_GLOBAL);
+        }
+      } break;
       case TK_WHILE:
-      case TK_GLOBAL:
-
       case TK_PASS:
       case TK_BREAK:
       case TK_DELETE:
@@ -221,11 +428,10 @@ class SymbolTable::SymbolTableBuilder {
     }
   }
 
-  void addSymbol(const std::string& name, SymbolFlag flag) {
+  void addSymbol(Symbol name, SymbolFlag flag) {
     auto& symbols = cur()->symbols;
-    auto it = symbols.find(name);
     if (flag == SymbolFlag::DEF_PARAM) {
-      if (it != symbols.end()) {
+      if (symbols.count(name)) {
         // TODO better error message
         throw std::runtime_error(
             "symtable: duplicate parameter name not supported:");
@@ -238,34 +444,360 @@ class SymbolTable::SymbolTableBuilder {
   // TODO derive kind from ref kind, this is because we have no module today
   void push(TreeRef ref) {
     auto prev = curEntry_;
-    table_->entries_.push_back(std::make_unique<SymbolTableEntry>());
-    curEntry_ = table_->entries_.back().get();
+    curEntry_ = allocate(ref);
+    stack_.push_back(curEntry_);
+    if (prev) {
+      prev->children.push_back(curEntry_);
+    }
+  }
+
+  // During update(), takes over the entry `ref` had in the old table, and
+  // the entries nested in it, if there is one. Trees are immutable, so what
+  // was found in them still holds. That includes a statement that
+  // Parser::reparseModule() reused: it's a copy of the old one in another
+  // source, so the entries are pointed at the copy.
+  //
+  // Only blocks directly in the module are reused: how the names in a nested
+  // block resolve depends on the blocks around it, which may have changed.
+  bool reuse(const TreeRef& ref) {
+    const uint32_t id = ref->blockId();
+    if (stack_.size() != 1 || id == 0 || id >= numPrevious_) {
+      return false;
+    }
+    SymbolTableEntry* entry = &table_->entries_[id];
+    if (entry->ref.get() != ref.get() &&
+        (entry->ref.get() != reusedFrom(ref) || !rebind(entry, ref))) {
+      return false;
+    }
+    adopt(entry);
+    cur()->children.push_back(entry);
+    return true;
+  }
+
+  // Points `entry` and the entries nested in it at the blocks of `copy`, a
+  // copy of entry->ref, if they all have one.
+  static bool rebind(SymbolTableEntry* entry, const TreeRef& copy) {
+    std::unordered_map<const Tree*, TreeRef> copies;
+    findCopies(entry->ref, copy, copies);
+    std::vector<SymbolTableEntry*> entries = {entry};
+    for (size_t i = 0; i < entries.size(); i++) {
+      if (!copies.count(entries[i]->ref.get())) {
+        return false;
+      }
+      entries.insert(
+          entries.end(),
+          entries[i]->children.begin(),
+          entries[i]->children.end());
+    }
+    for (SymbolTableEntry* e : entries) {
+      e->ref = copies[e->ref.get()];
+      e->ref->setBlockId(e->id);
+    }
+    return true;
+  }
+
+  // Maps each block in `tree` (whatever has a block id) to the same node in
+  // `copy`. Function bodies that weren't parsed yet have no blocks.
+  static void findCopies(
+      const TreeRef& tree,
+      const TreeRef& copy,
+      std::unordered_map<const Tree*, TreeRef>& copies) {
+    if (tree->isAtom()) {
+      return;
+    }
+    if (tree->blockId() != 0) {
+      copies.emplace(tree.get(), copy);
+    }
+    const auto* lazy = dynamic_cast<const LazyCompound*>(tree.get());
+    if (lazy && !lazy->materialized()) {
+      return;
+    }
+    const TreeList& trees = tree->trees();
+    const TreeList& copied = copy->trees();
+    for (size_t i = 0; i < trees.size() && i < copied.size(); i++) {
+      findCopies(trees[i], copied[i], copies);
+    }
+  }
+
+  void adopt(SymbolTableEntry* entry) {
+    live_[entry->id] = true;
+    for (SymbolTableEntry* child : entry->children) {
+      adopt(child);
+    }
+  }
+
+  // A new entry for the block `ref`, with nothing in it yet.
+  SymbolTableEntry* allocate(const TreeRef& ref) {
+    auto& entries = table_->entries_;
+    uint32_t id;
+    if (!table_->freeIds_.empty()) {
+      id = table_->freeIds_.back();
+      table_->freeIds_.pop_back();
+    } else {
+      id = entries.size();
+      entries.emplace_back();
+    }
+    if (id < live_.size()) {
+      live_[id] = true;
+    }
+    SymbolTableEntry* entry = &entries[id];
+    entry->id = id;
     switch (ref->kind()) {
       case TK_MODULE:
-        curEntry_->kind = SymbolTableEntry::BlockKind::Module;
-        curEntry_->name = "Module";
+        entry->kind = SymbolTableEntry::BlockKind::Module;
+        entry->name = "Module";
         break;
       case TK_CLASS_DEF:
-        curEntry_->kind = SymbolTableEntry::BlockKind::Class;
-        curEntry_->name = ClassDef(ref).name().name();
+        entry->kind = SymbolTableEntry::BlockKind::Class;
+        entry->name = ClassDef(ref).name().name();
         break;
       case TK_DEF:
-        curEntry_->kind = SymbolTableEntry::BlockKind::Function;
-        curEntry_->name = Def(ref).name().name();
+        entry->kind = SymbolTableEntry::BlockKind::Function;
+        entry->name = Def(ref).name().name();
         break;
       default:
         assert(false);
     }
+    entry->ref = ref;
+    ref->setBlockId(id);
+    return entry;
+  }
 
-    curEntry_->ref = ref;
-    assert(!table_->lookupTable_.count(ref));
-    table_->lookupTable_[ref] = curEntry_;
-    stack_.push_back(curEntry_);
-    if (prev) {
-      prev->children.push_back(curEntry_);
+  // Like visit(module.body()), except that the blocks directly in the module
+  // are built on up to `parallelism` threads. These don't depend on each
+  // other or on the module (see popBlock()), and are spliced in as if they
+  // had been built in order, so the table is the same as a serial build's,
+  // down to the block ids. Errors are the same too: the first one in the
+  // module is thrown.
+  void buildConcurrently(Mod module, size_t parallelism) {
+    // The other threads copy TreeRefs into the module.
+    module.tree()->share();
+    std::exception_ptr moduleError;
+    defer_ = true;
+    try {
+      visit(module.body());
+    } catch (...) {
+      // Only thrown once the blocks before this point turn out fine.
+      moduleError = std::current_exception();
+    }
+    defer_ = false;
+
+    // Runs of blocks share a table, so that small blocks don't each cost a
+    // table and a trip through `next`.
+    const size_t numBlocks = deferred_.size();
+    const size_t batchSize =
+        std::max<size_t>(1, numBlocks / (parallelism * 8));
+    const size_t numBatches = (numBlocks + batchSize - 1) / batchSize;
+    std::vector<std::unique_ptr<SymbolTable>> batches(numBatches);
+    std::vector<std::vector<uint32_t>> roots(numBatches);
+    std::vector<std::exception_ptr> errors(numBatches);
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+      size_t i;
+      while ((i = next++) < numBatches) {
+        batches[i] = std::unique_ptr<SymbolTable>(new SymbolTable());
+        SymbolTableBuilder builder;
+        builder.table_ = batches[i].get();
+        const size_t end = std::min(numBlocks, (i + 1) * batchSize);
+        try {
+          for (size_t b = i * batchSize; b < end; b++) {
+            roots[i].push_back(builder.buildBlock(deferred_[b]));
+          }
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(parallelism, numBatches); t++) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (const auto& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+    if (moduleError) {
+      std::rethrow_exception(moduleError);
+    }
+
+    auto& entries = table_->entries_;
+    for (size_t i = 0; i < numBatches; i++) {
+      const size_t offset = entries.size();
+      for (auto& entry : batches[i]->entries_) {
+        entries.push_back(std::move(entry));
+      }
+      // Children still point into the batch, whose entries keep their ids.
+      for (size_t id = offset; id < entries.size(); id++) {
+        SymbolTableEntry& entry = entries[id];
+        entry.id = id;
+        entry.ref->setBlockId(id);
+        for (SymbolTableEntry*& child : entry.children) {
+          child = &entries[offset + child->id];
+        }
+      }
+      for (uint32_t root : roots[i]) {
+        cur()->children.push_back(&entries[offset + root]);
+      }
+    }
+    deferred_.clear();
+  }
+
+  // Puts off building a block directly in the module: in a lazy table until
+  // lookup() asks for it, and while building concurrently, until
+  // buildConcurrently() hands it to a thread.
+  bool defer(const TreeRef& ref) {
+    if (stack_.size() != 1) {
+      return false;
+    }
+    if (table_->lazy_) {
+      SymbolTableEntry* entry = allocate(ref);
+      entry->lazy = std::make_unique<SymbolTableEntry::Lazy>();
+      cur()->children.push_back(entry);
+      return true;
+    }
+    if (defer_) {
+      deferred_.push_back(ref);
+      return true;
+    }
+    return false;
+  }
+
+  // Builds and analyzes the entries of a block that was deferred, as a root
+  // of table_. Returns the block's id.
+  uint32_t buildBlock(const TreeRef& ref) {
+    const auto id = static_cast<uint32_t>(table_->entries_.size());
+    if (ref->kind() == TK_DEF) {
+      populate(Def(ref));
+    } else {
+      populate(ClassDef(ref));
+    }
+    SymbolSet free;
+    analyze(&table_->entries_[id], SymbolSet(), SymbolSet(), free);
+    return id;
+  }
+
+  // Ends a block nested in the root. Nothing but the module encloses the
+  // blocks directly in it, and the module's names are globals to them, so
+  // these are analyzed right away (and update() can keep their results).
+  void popBlock() {
+    SymbolTableEntry* entry = cur();
+    pop();
+    if (stack_.size() == 1 &&
+        cur()->kind == SymbolTableEntry::BlockKind::Module) {
+      SymbolSet free;
+      analyze(entry, SymbolSet(), SymbolSet(), free);
+      assert(free.empty());
     }
   }
 
+  void analyzeRoot() {
+    assert(stack_.size() == 1);
+    SymbolSet free;
+    analyze(cur(), SymbolSet(), SymbolSet(), free);
+  }
+
+  // Resolves the scope of every name in `entry` and in the blocks nested in
+  // it, like CPython's analyze_block(). `bound` holds the names bound in the
+  // enclosing functions, and `global` the names declared global around
+  // `entry`. Adds the names that are free in `entry` to `free`.
+  void analyze(
+      SymbolTableEntry* entry,
+      SymbolSet bound,
+      SymbolSet global,
+      SymbolSet& free) {
+    using Kind = SymbolTableEntry::BlockKind;
+    const bool isFunction = entry->kind == Kind::Function;
+    const bool isClass = entry->kind == Kind::Class;
+    const bool hasChildren =
+        !entry->children.empty() && entry->kind != Kind::Module;
+    // What's bound in a class body isn't visible in the methods.
+    SymbolSet childBound;
+    SymbolSet childGlobal;
+    if (isClass && hasChildren) {
+      childBound = bound;
+      childGlobal = global;
+    }
+
+    // Only needed to pass on to nested blocks. A module can bind thousands of
+    // names, which are globals to the blocks in it anyway.
+    const bool trackLocals = isFunction && hasChildren;
+    SymbolSet local;
+    SymbolSet newFree;
+    for (auto& pr : entry->symbols) {
+      const Symbol name = pr.first;
+      SymbolInfo& info = pr.second;
+      if (info & SymbolFlag::DEF_GLOBAL) {
+        info.setScope(SymbolScope::GLOBAL_EXPLICIT);
+        global.insert(name);
+        bound.erase(name);
+      } else if (isBound(info)) {
+        info.setScope(SymbolScope::LOCAL);
+        if (trackLocals) {
+          local.insert(name);
+        }
+        global.erase(name);
+      } else if (bound.contains(name)) {
+        info.setScope(SymbolScope::FREE);
+        newFree.insert(name);
+      } else {
+        info.setScope(SymbolScope::GLOBAL_IMPLICIT);
+      }
+    }
+
+    // The blocks directly in a module were analyzed already, see popBlock().
+    if (hasChildren) {
+      if (!isClass) {
+        if (isFunction) {
+          childBound = local;
+        }
+        childBound.insertAll(bound);
+        childGlobal = global;
+      }
+      for (SymbolTableEntry* child : entry->children) {
+        analyze(child, childBound, childGlobal, newFree);
+      }
+    }
+
+    // Names bound here that a nested block uses live in cells.
+    if (isFunction) {
+      for (auto& pr : entry->symbols) {
+        if (pr.second.getScope() == SymbolScope::LOCAL &&
+            newFree.contains(pr.first)) {
+          pr.second.setScope(SymbolScope::CELL);
+          newFree.erase(pr.first);
+          entry->cellvars.push_back(pr.first);
+        }
+      }
+    }
+    // The free names of nested blocks that come from further out pass
+    // through this block, which needs them to make the nested closures.
+    for (Symbol name : newFree) {
+      if (SymbolInfo* info = entry->symbols.find(name)) {
+        if (isClass && (isBound(*info) || *info & SymbolFlag::DEF_GLOBAL)) {
+          *info |= SymbolFlag::DEF_FREE_CLASS;
+        }
+        continue;
+      }
+      if (bound.contains(name)) {
+        SymbolInfo& info = entry->symbols[name];
+        info |= SymbolFlag::DEF_FREE;
+        info.setScope(SymbolScope::FREE);
+      }
+    }
+    for (const auto& pr : entry->symbols) {
+      if (pr.second.getScope() == SymbolScope::FREE ||
+          (isClass && pr.second & SymbolFlag::DEF_FREE_CLASS)) {
+        entry->freevars.push_back(pr.first);
+      }
+    }
+    free.insertAll(newFree);
+  }
+
   void pop() {
     assert(!stack_.empty());
     stack_.pop_back();
@@ -280,9 +812,17 @@ class SymbolTable::SymbolTableBuilder {
     return curEntry_;
   }
 
-  std::unique_ptr<SymbolTable> table_;
+  SymbolTable* table_ = nullptr;
   std::vector<SymbolTableEntry*> stack_;
   SymbolTableEntry* curEntry_ = nullptr;
+  // Only used by update(): how many entries the old table had, and which of
+  // those ids are still in use, by a reused entry or by a new one.
+  size_t numPrevious_ = 0;
+  std::vector<bool> live_;
+  // Only used by buildConcurrently(): the blocks directly in the module, in
+  // order.
+  bool defer_ = false;
+  std::vector<TreeRef> deferred_;
 
   // Used to determine whether we should add symbols in the context of an
   // assignment (e.g. as a STORE and not a LOAD).
@@ -317,8 +857,12 @@ void SymbolTableEntry::dump(size_t indent) const {
       break;
   }
   fmt::print("Symbol table for '{}' ({})\n", name, kind_);
+  if (lazy && !lazy->built.load(std::memory_order_acquire)) {
+    fmt::print("Not built yet\n");
+    return;
+  }
   for (const auto& pr : symbols) {
-    fmt::print("Name: {}\n", pr.first);
+    fmt::print("Name: {}\n", pr.first.str());
     SymbolInfo info = pr.second;
     if (info & SymbolFlag::USE) {
       fmt::print("\tUSE\n");
@@ -329,23 +873,47 @@ void SymbolTableEntry::dump(size_t indent) const {
     if (info & SymbolFlag::DEF_LOCAL) {
       fmt::print("\tDEF_LOCAL\n");
     }
+    if (info & SymbolFlag::DEF_GLOBAL) {
+      fmt::print("\tDEF_GLOBAL\n");
+    }
+    if (info.getScope() == SymbolScope::CELL) {
+      fmt::print("\tCELL\n");
+    } else if (info.getScope() == SymbolScope::FREE) {
+      fmt::print("\tFREE\n");
+    }
   }
   for (const auto& child : children) {
     child->dump();
   }
 }
+int SymbolTableEntry::derefIndex(Symbol name) const {
+  for (size_t i = 0; i < cellvars.size(); i++) {
+    if (cellvars[i] == name) {
+      return static_cast<int>(i);
+    }
+  }
+  for (size_t i = 0; i < freevars.size(); i++) {
+    if (freevars[i] == name) {
+      return static_cast<int>(cellvars.size() + i);
+    }
+  }
+  return -1;
+}
+
 void SymbolTable::dump() const {
   if (entries_.empty()) {
     fmt::print("Empty symtable\n");
+    return;
   }
-  auto root = entries_.begin()->get();
   fmt::print("{:*^30}\n", "ROOT");
-  root->dump();
+  entries_.front().dump();
 }
 
-std::unique_ptr<SymbolTable> SymbolTable::build(Mod module) {
+std::unique_ptr<SymbolTable> SymbolTable::build(
+    Mod module,
+    const SymbolTableOptions& options) {
   SymbolTableBuilder builder;
-  auto st = builder.build(module);
+  auto st = builder.build(module, options);
   // st->dump();
   return st;
 }
@@ -357,7 +925,72 @@ std::unique_ptr<SymbolTable> SymbolTable::build(Def def) {
   return st;
 }
 
-SymbolTableEntry* SymbolTable::lookup(TreeRef astNode) {
-  return lookupTable_.at(astNode);
+void SymbolTable::update(Mod module) {
+  SymbolTableBuilder builder;
+  builder.update(this, module);
+}
+
+SymbolTableEntry* SymbolTable::ensureBuilt(SymbolTableEntry& entry) {
+  // Like LazyCompound::trees(): not std::call_once, so that an error is
+  // thrown again by the next lookup() rather than leaving a half-built entry.
+  if (entry.lazy && !entry.lazy->built.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> guard(entry.lazy->mutex);
+    if (!entry.lazy->built.load(std::memory_order_relaxed)) {
+      SymbolTableBuilder::buildLazy(entry);
+      entry.lazy->built.store(true, std::memory_order_release);
+    }
+  }
+  return &entry;
+}
+
+SymbolTableEntry* SymbolTable::findNested(
+    SymbolTableEntry& entry,
+    const TreeRef& astNode) {
+  if (!entry.lazy) {
+    return nullptr;
+  }
+  // Don't build blocks that can't contain it.
+  const SourceRange& outer = entry.ref->range();
+  const SourceRange& inner = astNode->range();
+  if (outer.source_id() != inner.source_id() ||
+      inner.start() < outer.start() || outer.end() < inner.end()) {
+    return nullptr;
+  }
+  ensureBuilt(entry);
+  for (const auto& nested : entry.lazy->nested) {
+    if (nested->ref.get() == astNode.get()) {
+      return nested.get();
+    }
+  }
+  return nullptr;
+}
+
+SymbolTableEntry* SymbolTable::lookup(const TreeRef& astNode) {
+  const uint32_t id = astNode->blockId();
+  if (id < entries_.size()) {
+    SymbolTableEntry& entry = entries_[id];
+    if (entry.ref.get() == astNode.get()) {
+      return ensureBuilt(entry);
+    }
+    if (lazy_) {
+      if (SymbolTableEntry* nested = findNested(entry, astNode)) {
+        return nested;
+      }
+    }
+  }
+  // The tree is in more than one table, and another one was built over it
+  // last, or it's nested in a lazy block that wasn't built yet. Take the id
+  // back, on the assumption that this table is used next.
+  for (auto& entry : entries_) {
+    if (entry.ref.get() == astNode.get()) {
+      astNode->setBlockId(entry.id);
+      return ensureBuilt(entry);
+    }
+    if (SymbolTableEntry* nested = findNested(entry, astNode)) {
+      astNode->setBlockId(entry.id);
+      return nested;
+    }
+  }
+  throw std::out_of_range("symtable: no entry for this node");
 }
 } // namespace minipy
@@ -2,9 +2,12 @@
 
 #include "minipy/jitparse/tree_views.h"
 
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace minipy {
@@ -31,7 +34,21 @@ enum class SymbolFlag : int {
   DEF_COMP_ITER = 2 << 8
 };
 
-enum class SymbolScope { LOCAL, GLOBAL };
+// Where a name lives at runtime, as CPython's symtable resolves it.
+enum class SymbolScope {
+  // Bound in this block, and only used here.
+  LOCAL,
+  // Not bound in this block or any enclosing function.
+  GLOBAL_IMPLICIT,
+  // Declared `global` in this block.
+  GLOBAL_EXPLICIT,
+  // Bound in an enclosing function, and read from its cell.
+  FREE,
+  // Bound in this block and used by a nested block, so kept in a cell.
+  CELL,
+  // Older name for GLOBAL_IMPLICIT.
+  GLOBAL = GLOBAL_IMPLICIT,
+};
 
 struct SymbolInfo {
   SymbolInfo() {}
@@ -47,10 +64,77 @@ struct SymbolInfo {
     return flags & static_cast<int>(flag);
   }
 
-  SymbolScope getScope() const;
+  // Only meaningful once SymbolTable::build() is done.
+  SymbolScope getScope() const {
+    return scope;
+  }
+  void setScope(SymbolScope newScope) {
+    scope = newScope;
+  }
 
  private:
   int flags = 0;
+  SymbolScope scope = SymbolScope::GLOBAL_IMPLICIT;
+};
+
+/**
+ * class SymbolMap
+ *
+ * The symbols of one block, in the order they were first seen. Most blocks
+ * only have a handful, so they're kept in a flat array and found by comparing
+ * Symbols, which is a pointer comparison. Blocks with many symbols (e.g. a
+ * module with thousands of defs) also get an open-addressed index keyed by
+ * Symbol id.
+ */
+class SymbolMap {
+ public:
+  using value_type = std::pair<Symbol, SymbolInfo>;
+  using iterator = std::vector<value_type>::iterator;
+  using const_iterator = std::vector<value_type>::const_iterator;
+
+  // Adds `name` with no flags if it's not there yet.
+  SymbolInfo& operator[](Symbol name);
+  SymbolInfo* find(Symbol name) {
+    const int i = indexOf(name);
+    return i < 0 ? nullptr : &entries_[i].second;
+  }
+  const SymbolInfo* find(Symbol name) const {
+    const int i = indexOf(name);
+    return i < 0 ? nullptr : &entries_[i].second;
+  }
+  size_t count(Symbol name) const {
+    return indexOf(name) < 0 ? 0 : 1;
+  }
+  size_t size() const {
+    return entries_.size();
+  }
+  bool empty() const {
+    return entries_.empty();
+  }
+  // Don't change the Symbols.
+  iterator begin() {
+    return entries_.begin();
+  }
+  iterator end() {
+    return entries_.end();
+  }
+  const_iterator begin() const {
+    return entries_.begin();
+  }
+  const_iterator end() const {
+    return entries_.end();
+  }
+
+ private:
+  // Up to this many symbols, a linear scan beats hashing.
+  static constexpr size_t kMaxUnindexed = 8;
+  int indexOf(Symbol name) const;
+  void rebuildIndex();
+
+  std::vector<value_type> entries_;
+  // Empty, or a power-of-two number of slots holding 1 + an index into
+  // entries_, or 0 if the slot is free. Kept at most half full.
+  std::vector<uint32_t> index_;
 };
 
 /**
@@ -65,22 +149,73 @@ struct SymbolTableEntry {
   BlockKind kind;
   // Name of this entry
   std::string name;
+  // Index of this entry in its table, and the block id of `ref`. For a block
+  // nested in a lazily built one (see SymbolTableOptions::lazyBlocks), the id
+  // of that block.
+  uint32_t id = 0;
   // Mapping of identifier to symbol metadata.
-  std::unordered_map<std::string, SymbolInfo> symbols;
+  SymbolMap symbols;
   // If this is a function, the name of all the function arguments.
-  std::vector<std::string> args;
+  std::vector<Symbol> args;
+  // Names with scope CELL, and names with scope FREE (plus, for a class,
+  // names it binds itself that a method uses from an enclosing function), in
+  // the order they were first seen. Together they number the slots of
+  // LOAD_DEREF and friends: cells first, then free variables.
+  std::vector<Symbol> cellvars;
+  std::vector<Symbol> freevars;
   // For all blocks contained in this block (e.g. a method inside a class def).
   std::vector<SymbolTableEntry*> children;
-  // Which AST node this SymbolTableEntry corresponds to.
+  // Which AST node this SymbolTableEntry corresponds to. Null if the entry
+  // is unused.
   TreeRef ref;
+
+  // Only set for the blocks directly in a module whose table was built with
+  // SymbolTableOptions::lazyBlocks. Until SymbolTable::lookup() first returns
+  // such an entry, only its kind, name, id and ref are filled in.
+  struct Lazy {
+    std::mutex mutex;
+    std::atomic<bool> built{false};
+    // The blocks nested in this one, which `children` point to.
+    std::vector<std::unique_ptr<SymbolTableEntry>> nested;
+  };
+  std::unique_ptr<Lazy> lazy;
+
+  // The slot of `name` among cellvars and freevars, or -1 if it has neither
+  // scope.
+  int derefIndex(Symbol name) const;
+};
+
+struct SymbolTableOptions {
+  // How many threads build() may use. Above 1, the defs and classes directly
+  // in the module are built concurrently. The table is the same either way.
+  size_t parallelism = 1;
+  // Only enter the defs and classes directly in the module, and build the
+  // rest of their entries the first time lookup() asks for them or for
+  // anything nested in them. With ParserOptions::lazyFunctionBodies as well,
+  // functions that are never compiled are never parsed or analyzed either.
+  // Block ids then differ from an eager build's.
+  bool lazyBlocks = false;
 };
 
 class SymbolTable {
  public:
-  static std::unique_ptr<SymbolTable> build(Mod module);
+  static std::unique_ptr<SymbolTable> build(
+      Mod module,
+      const SymbolTableOptions& options = SymbolTableOptions());
   static std::unique_ptr<SymbolTable> build(Def def);
 
-  SymbolTableEntry* lookup(TreeRef astNode);
+  // Rebuilds a module's table for `module`, e.g. the result of
+  // Parser::reparseModule() on the module the table was built for. Defs and
+  // classes that are still the very same trees keep their entries as they
+  // are, so only the module's own scope and the statements that changed are
+  // visited again.
+  void update(Mod module);
+
+  // The entry for a module, def or class def in this table. Throws
+  // std::out_of_range if there is none. Safe to call from several threads at
+  // once, including on a lazy table, where the first lookup() of a block
+  // builds it.
+  SymbolTableEntry* lookup(const TreeRef& astNode);
 
   void dump() const;
 
@@ -88,7 +223,20 @@ class SymbolTable {
   // Private, use build()
   SymbolTable() {}
   class SymbolTableBuilder;
-  std::vector<std::unique_ptr<SymbolTableEntry>> entries_;
-  std::unordered_map<TreeRef, SymbolTableEntry*> lookupTable_;
+  // Finishes `entry` if it's a lazy block that wasn't built yet.
+  static SymbolTableEntry* ensureBuilt(SymbolTableEntry& entry);
+  // The entry for `astNode` if it's nested in the lazy block `entry`.
+  static SymbolTableEntry* findNested(
+      SymbolTableEntry& entry,
+      const TreeRef& astNode);
+  bool lazy_ = false;
+  // Indexed by block id, which build() also stores on the tree itself, so
+  // lookup() is an index and a check that the entry is still for that tree.
+  // The entry of the root (the module, or the def for build(Def)) is first.
+  // A deque so that entries never move: the table hands out pointers to
+  // them, and update() keeps the ones it reuses.
+  std::deque<SymbolTableEntry> entries_;
+  // Ids of entries that update() found unused, to be filled again first.
+  std::vector<uint32_t> freeIds_;
 };
 } // namespace minipy
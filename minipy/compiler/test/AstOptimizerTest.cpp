@@ -0,0 +1,81 @@
+#include <gtest/gtest.h>
+
+#include "minipy/compiler/AstOptimizer.h"
+#include "minipy/jitparse/parser.h"
+
+namespace minipy {
+
+static Expr foldExpr(const std::string& src) {
+  Parser p(std::make_shared<Source>("x = " + src + "\n"));
+  auto moduleAst = foldConstants(p.parseModule());
+  return Assign(moduleAst.body()[0]).rhs().get();
+}
+
+static std::string foldedText(const std::string& src) {
+  auto expr = foldExpr(src);
+  EXPECT_EQ(expr.kind(), TK_CONST) << src;
+  return expr.kind() == TK_CONST ? Const(expr).text() : "";
+}
+
+TEST(AstOptimizer, FoldIntegral) {
+  EXPECT_EQ(foldedText("(2 + 3) * 4"), "20");
+  EXPECT_EQ(foldedText("1 - -2"), "3");
+  EXPECT_EQ(foldedText("-(2 + 3)"), "-5");
+  // Python floor division and modulo semantics
+  EXPECT_EQ(foldedText("-7 // 2"), "-4");
+  EXPECT_EQ(foldedText("-7 % 2"), "1");
+  EXPECT_EQ(foldedText("7 % -2"), "-1");
+}
+
+TEST(AstOptimizer, FoldFloatingPoint) {
+  EXPECT_EQ(Const(foldExpr("1.5 * 2")).asFloatingPoint(), 3.0);
+  EXPECT_TRUE(Const(foldExpr("1.5 * 2")).isFloatingPoint());
+  // True division of ints is a float
+  EXPECT_TRUE(Const(foldExpr("4 / 2")).isFloatingPoint());
+  EXPECT_EQ(Const(foldExpr("1 / 4")).asFloatingPoint(), 0.25);
+}
+
+TEST(AstOptimizer, NoFold) {
+  EXPECT_EQ(foldExpr("1 // 0").kind(), TK_FLOOR_DIV);
+  EXPECT_EQ(foldExpr("1.0 / 0").kind(), '/');
+  EXPECT_EQ(foldExpr("9223372036854775807 + 1").kind(), '+');
+  EXPECT_EQ(foldExpr("y + 1").kind(), '+');
+  // Literals that don't fit in 64 bits are left alone, not rejected
+  EXPECT_EQ(foldExpr("99999999999999999999 + 1").kind(), '+');
+  EXPECT_EQ(foldExpr("1 - 99999999999999999999").kind(), '-');
+  EXPECT_EQ(foldExpr("99999999999999999999 * 1.5").kind(), '*');
+  // Partially constant expressions still fold their constant subtrees
+  auto expr = BinOp(foldExpr("y * (2 + 3)"));
+  EXPECT_EQ(expr.rhs().kind(), TK_CONST);
+  EXPECT_EQ(Const(expr.rhs()).text(), "5");
+}
+
+TEST(AstOptimizer, NoFoldOverflowingUnaryMinus) {
+  // The parser already turns `-<literal>` into a Const, so build the unary
+  // minus by hand.
+  Parser p(std::make_shared<Source>("x = 1\n"));
+  const Assign assign(p.parseModule().body()[0]);
+  const auto range = assign.range();
+  const auto negated = UnaryOp::create(
+      range, TK_UNARY_MINUS, Const::create(range, "99999999999999999999"));
+  const auto module = Mod::create(
+      range,
+      List<Stmt>::create(
+          range,
+          {Assign::create(
+              range,
+              assign.lhs_list(),
+              Maybe<Expr>::create(range, negated),
+              assign.type())}));
+  const auto folded = foldConstants(module);
+  EXPECT_EQ(Assign(folded.body()[0]).rhs().get().kind(), TK_UNARY_MINUS);
+}
+
+TEST(AstOptimizer, SharesUnchangedSubtrees) {
+  Parser p(std::make_shared<Source>("def foo(x):\n    return x + 1\n"));
+  auto moduleAst = p.parseModule();
+  auto folded = foldConstants(moduleAst);
+  EXPECT_EQ(folded.tree(), moduleAst.tree());
+}
+
+} // namespace minipy
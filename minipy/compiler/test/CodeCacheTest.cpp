@@ -0,0 +1,169 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <cstdint>
+#include <fstream>
+
+#include "minipy/compiler/CodeCache.h"
+
+namespace minipy {
+
+static constexpr auto moduleSource = R"SCRIPT(
+def foo(x, y):
+    def bar():
+        return x + 1.5
+    return bar() + y
+
+foo(1, 'a')
+)SCRIPT";
+
+// Stands in for the interpreter's Instruction.
+struct TestInstruction {
+  uint16_t op;
+  int32_t arg1;
+};
+
+struct TestModule {
+  TestModule() {
+    moduleInstructions = {{1, 0}, {2, 0}, {3, 1}, {4, 2}};
+    fooInstructions = {{5, 0}, {6, 1}};
+    codes.resize(3);
+    codes[0].name = "<module>";
+    codes[0].setInstructions(moduleInstructions);
+    codes[0].constants.resize(4);
+    codes[0].constants[0].kind = CodeConstant::Kind::CODE;
+    codes[0].constants[0].code = 1;
+    codes[0].constants[1].kind = CodeConstant::Kind::INT;
+    codes[0].constants[1].intValue = -1;
+    codes[0].constants[2].kind = CodeConstant::Kind::STRING;
+    codes[0].constants[2].stringValue = "a";
+    codes[0].names = {"foo"};
+
+    codes[1].name = "foo";
+    codes[1].setInstructions(fooInstructions);
+    codes[1].constants.resize(1);
+    codes[1].constants[0].kind = CodeConstant::Kind::CODE;
+    codes[1].constants[0].code = 2;
+    codes[1].varnames = {"x", "y", "bar"};
+
+    codes[2].name = "bar";
+    codes[2].constants.resize(2);
+    codes[2].constants[0].kind = CodeConstant::Kind::DOUBLE;
+    codes[2].constants[0].doubleValue = 1.5;
+    codes[2].constants[1].kind = CodeConstant::Kind::BOOL;
+    codes[2].constants[1].intValue = 1;
+  }
+
+  std::vector<TestInstruction> moduleInstructions;
+  std::vector<TestInstruction> fooInstructions;
+  std::vector<CodeRecord> codes;
+};
+
+static void expectSameCode(const TestModule& module, const CodeImage& image) {
+  ASSERT_EQ(image.size(), 3);
+  const CodeView main = image.code(0);
+  EXPECT_EQ(main.name(), "<module>");
+  const auto insts = main.instructions<TestInstruction>();
+  ASSERT_EQ(insts.size(), 4);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(insts.data()) % 8, 0);
+  EXPECT_EQ(insts[3].op, 4);
+  EXPECT_EQ(insts[3].arg1, 2);
+  ASSERT_EQ(main.numConstants(), 4);
+  EXPECT_EQ(main.constant(0).kind, CodeConstant::Kind::CODE);
+  EXPECT_EQ(main.constant(0).code, 1);
+  EXPECT_EQ(main.constant(1).intValue, -1);
+  EXPECT_EQ(main.constant(2).stringValue, "a");
+  EXPECT_EQ(main.constant(3).kind, CodeConstant::Kind::NONE);
+  ASSERT_EQ(main.names().size(), 1);
+  EXPECT_EQ(main.names()[0], "foo");
+  EXPECT_EQ(main.varnames().size(), 0);
+
+  const CodeView foo = image.code(main.constant(0).code);
+  EXPECT_EQ(foo.name(), "foo");
+  const auto fooInsts = foo.instructions<TestInstruction>();
+  ASSERT_EQ(fooInsts.size(), module.fooInstructions.size());
+  EXPECT_EQ(fooInsts[1].op, 6);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(fooInsts.data()) % 8, 0);
+  ASSERT_EQ(foo.varnames().size(), 3);
+  EXPECT_EQ(foo.varnames()[2], "bar");
+
+  const CodeView bar = image.code(foo.constant(0).code);
+  EXPECT_EQ(bar.name(), "bar");
+  EXPECT_EQ(bar.numInstructions(), 0);
+  EXPECT_EQ(bar.constant(0).doubleValue, 1.5);
+  EXPECT_EQ(bar.constant(1).kind, CodeConstant::Kind::BOOL);
+  EXPECT_EQ(bar.constant(1).intValue, 1);
+}
+
+struct TempDir {
+  TempDir() {
+    char name[] = "/tmp/minipy_code_cache_test_XXXXXX";
+    EXPECT_NE(mkdtemp(name), nullptr);
+    path = name;
+  }
+  ~TempDir() {
+    // Only cache files are ever written here.
+    std::system(("rm -rf " + path).c_str());
+  }
+  std::string path;
+};
+
+TEST(CodeCache, RoundTrip) {
+  TestModule module;
+  const std::string data = serializeCode(module.codes, moduleSource);
+  expectSameCode(module, *CodeImage::fromBytes(data, moduleSource));
+  EXPECT_THROW(
+      CodeImage::fromBytes(data, moduleSource)
+          ->code(0)
+          .instructions<uint32_t>(),
+      std::runtime_error);
+}
+
+TEST(CodeCache, RejectsBadData) {
+  TestModule module;
+  const std::string data = serializeCode(module.codes, moduleSource);
+  const std::string changed = std::string(moduleSource) + "\n";
+  EXPECT_THROW(CodeImage::fromBytes(data, changed), std::runtime_error);
+  EXPECT_THROW(
+      CodeImage::fromBytes(data, moduleSource, kCompilerVersion + 1),
+      std::runtime_error);
+  for (size_t size : {size_t(0), size_t(8), data.size() / 2, data.size() - 1}) {
+    EXPECT_THROW(
+        CodeImage::fromBytes(data.substr(0, size), moduleSource),
+        std::runtime_error);
+  }
+  std::string flipped = data;
+  flipped[data.size() / 2] ^= 1;
+  EXPECT_THROW(CodeImage::fromBytes(flipped, moduleSource), std::runtime_error);
+
+  // Code objects can't contain themselves or their parents.
+  module.codes[2].constants[0].kind = CodeConstant::Kind::CODE;
+  module.codes[2].constants[0].code = 1;
+  EXPECT_THROW(serializeCode(module.codes, moduleSource), std::runtime_error);
+}
+
+TEST(CodeCache, LoadAndStore) {
+  TempDir dir;
+  CodeCache cache(dir.path + "/cache");
+  const Source source(moduleSource);
+  EXPECT_EQ(cache.load(source), nullptr);
+
+  TestModule module;
+  ASSERT_TRUE(cache.store(source, module.codes));
+  auto image = cache.load(source);
+  ASSERT_NE(image, nullptr);
+  expectSameCode(module, *image);
+
+  // Entries are per compiler version.
+  CodeCache newer(dir.path + "/cache", kCompilerVersion + 1);
+  EXPECT_NE(newer.pathFor(source), cache.pathFor(source));
+  EXPECT_EQ(newer.load(source), nullptr);
+
+  // Corrupt entries are misses, and get replaced.
+  std::ofstream(cache.pathFor(source), std::ios::binary) << "garbage";
+  EXPECT_EQ(cache.load(source), nullptr);
+  ASSERT_TRUE(cache.store(source, module.codes));
+  EXPECT_NE(cache.load(source), nullptr);
+}
+
+} // namespace minipy
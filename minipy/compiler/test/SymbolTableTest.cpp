@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 
+#include <thread>
+
 #include "minipy/compiler/SymbolTable.h"
 #include "minipy/jitparse/parser.h"
 
@@ -32,20 +34,20 @@ foo(9)
 
   // In the module scope, there should be `foo` symbol defined locally
   SymbolTableEntry* ste = st->lookup(moduleAst.tree());
-  EXPECT_TRUE(ste->symbols["foo"] & SymbolFlag::DEF_LOCAL);
-  EXPECT_TRUE(ste->symbols["foo"] & SymbolFlag::USE);
+  EXPECT_TRUE(ste->symbols[Symbol("foo")] & SymbolFlag::DEF_LOCAL);
+  EXPECT_TRUE(ste->symbols[Symbol("foo")] & SymbolFlag::USE);
 
   ste = st->lookup(moduleAst.body()[0].tree());
-  EXPECT_TRUE(ste->symbols.count("x"));
-  EXPECT_TRUE(ste->symbols["x"] & SymbolFlag::DEF_PARAM);
-  EXPECT_TRUE(ste->symbols["x"] & SymbolFlag::USE);
+  EXPECT_TRUE(ste->symbols.count(Symbol("x")));
+  EXPECT_TRUE(ste->symbols[Symbol("x")] & SymbolFlag::DEF_PARAM);
+  EXPECT_TRUE(ste->symbols[Symbol("x")] & SymbolFlag::USE);
 
-  EXPECT_TRUE(ste->symbols.count("torch"));
-  EXPECT_TRUE(ste->symbols["torch"] & SymbolFlag::USE);
+  EXPECT_TRUE(ste->symbols.count(Symbol("torch")));
+  EXPECT_TRUE(ste->symbols[Symbol("torch")] & SymbolFlag::USE);
 
-  EXPECT_TRUE(ste->symbols.count("y"));
-  EXPECT_TRUE(ste->symbols["y"] & SymbolFlag::USE);
-  EXPECT_TRUE(ste->symbols["y"] & SymbolFlag::DEF_LOCAL);
+  EXPECT_TRUE(ste->symbols.count(Symbol("y")));
+  EXPECT_TRUE(ste->symbols[Symbol("y")] & SymbolFlag::USE);
+  EXPECT_TRUE(ste->symbols[Symbol("y")] & SymbolFlag::DEF_LOCAL);
 }
 
 // SymbolTable should work on function defs only
@@ -61,15 +63,305 @@ def foo(x):
   const auto st = SymbolTable::build(defAst);
 
   SymbolTableEntry* ste = st->lookup(defAst.tree());
-  EXPECT_TRUE(ste->symbols.count("x"));
-  EXPECT_TRUE(ste->symbols["x"] & SymbolFlag::DEF_PARAM);
-  EXPECT_TRUE(ste->symbols["x"] & SymbolFlag::USE);
+  EXPECT_TRUE(ste->symbols.count(Symbol("x")));
+  EXPECT_TRUE(ste->symbols[Symbol("x")] & SymbolFlag::DEF_PARAM);
+  EXPECT_TRUE(ste->symbols[Symbol("x")] & SymbolFlag::USE);
+
+  EXPECT_TRUE(ste->symbols.count(Symbol("torch")));
+  EXPECT_TRUE(ste->symbols[Symbol("torch")] & SymbolFlag::USE);
+
+  EXPECT_TRUE(ste->symbols.count(Symbol("y")));
+  EXPECT_TRUE(ste->symbols[Symbol("y")] & SymbolFlag::USE);
+  EXPECT_TRUE(ste->symbols[Symbol("y")] & SymbolFlag::DEF_LOCAL);
+}
+TEST(SymbolTable, Closures) {
+  static constexpr auto moduleSource = R"SCRIPT(
+def outer(a, b):
+    c = a + b
+    def middle(d):
+        def inner():
+            return a + d + e
+        return inner
+    return middle(c) + b
+
+def setter(x):
+    global g
+    g = x
+    return len(x)
+)SCRIPT";
+  Parser p(std::make_shared<Source>(moduleSource));
+  const auto moduleAst = p.parseModule();
+  auto st = SymbolTable::build(moduleAst);
+  const Symbol a("a"), b("b"), d("d"), e("e"), g("g");
+
+  SymbolTableEntry* ste = st->lookup(moduleAst.tree());
+  EXPECT_EQ(ste->symbols[Symbol("outer")].getScope(), SymbolScope::LOCAL);
+  EXPECT_TRUE(ste->cellvars.empty());
+  EXPECT_TRUE(ste->freevars.empty());
+
+  const auto outer = Def(moduleAst.body()[0]);
+  ste = st->lookup(outer.tree());
+  EXPECT_EQ(ste->symbols[a].getScope(), SymbolScope::CELL);
+  EXPECT_EQ(ste->symbols[b].getScope(), SymbolScope::LOCAL);
+  EXPECT_EQ(ste->cellvars, std::vector<Symbol>{a});
+  EXPECT_TRUE(ste->freevars.empty());
+
+  // middle() doesn't use `a` itself, but has to pass it on to inner().
+  const auto middle = Def(outer.statements()[1]);
+  ste = st->lookup(middle.tree());
+  EXPECT_EQ(ste->symbols[d].getScope(), SymbolScope::CELL);
+  EXPECT_EQ(ste->symbols[a].getScope(), SymbolScope::FREE);
+  EXPECT_TRUE(ste->symbols[a] & SymbolFlag::DEF_FREE);
+  EXPECT_EQ(ste->cellvars, std::vector<Symbol>{d});
+  EXPECT_EQ(ste->freevars, std::vector<Symbol>{a});
+  EXPECT_EQ(ste->derefIndex(d), 0);
+  EXPECT_EQ(ste->derefIndex(a), 1);
+  EXPECT_EQ(ste->derefIndex(b), -1);
+
+  ste = st->lookup(middle.statements()[0].tree());
+  EXPECT_EQ(ste->symbols[a].getScope(), SymbolScope::FREE);
+  EXPECT_EQ(ste->symbols[d].getScope(), SymbolScope::FREE);
+  EXPECT_EQ(ste->symbols[e].getScope(), SymbolScope::GLOBAL_IMPLICIT);
+  EXPECT_TRUE(ste->cellvars.empty());
+  EXPECT_EQ(ste->freevars, (std::vector<Symbol>{a, d}));
+
+  ste = st->lookup(moduleAst.body()[1].tree());
+  EXPECT_EQ(ste->symbols[g].getScope(), SymbolScope::GLOBAL_EXPLICIT);
+  EXPECT_EQ(ste->symbols[Symbol("x")].getScope(), SymbolScope::LOCAL);
+  EXPECT_EQ(
+      ste->symbols[Symbol("len")].getScope(), SymbolScope::GLOBAL_IMPLICIT);
+}
+
+TEST(SymbolTable, GlobalAfterUse) {
+  static constexpr auto moduleSource = R"SCRIPT(
+def foo(x):
+    y = x
+    global y
+    return y
+)SCRIPT";
+  Parser p(std::make_shared<Source>(moduleSource));
+  auto moduleAst = p.parseModule();
+  EXPECT_THROW(SymbolTable::build(moduleAst), std::exception);
+}
+
+// Lazy tables number their blocks differently, so ids are only compared if
+// `sameIds` is set.
+static void expectSameEntries(
+    const SymbolTableEntry* expected,
+    const SymbolTableEntry* actual,
+    bool sameIds = true) {
+  if (sameIds) {
+    EXPECT_EQ(actual->id, expected->id);
+  }
+  EXPECT_EQ(actual->name, expected->name);
+  EXPECT_EQ(actual->args, expected->args);
+  EXPECT_EQ(actual->cellvars, expected->cellvars);
+  EXPECT_EQ(actual->freevars, expected->freevars);
+  EXPECT_EQ(actual->ref.get(), expected->ref.get());
+  ASSERT_EQ(actual->symbols.size(), expected->symbols.size());
+  auto it = actual->symbols.begin();
+  for (const auto& pr : expected->symbols) {
+    EXPECT_EQ(it->first, pr.first);
+    EXPECT_EQ(it->second.getScope(), pr.second.getScope());
+    EXPECT_EQ(
+        it->second & SymbolFlag::DEF_LOCAL, pr.second & SymbolFlag::DEF_LOCAL);
+    EXPECT_EQ(it->second & SymbolFlag::USE, pr.second & SymbolFlag::USE);
+    ++it;
+  }
+  ASSERT_EQ(actual->children.size(), expected->children.size());
+  for (size_t i = 0; i < expected->children.size(); i++) {
+    expectSameEntries(expected->children[i], actual->children[i], sameIds);
+  }
+}
+
+TEST(SymbolTable, ParallelBuild) {
+  std::string text;
+  for (int i = 0; i < 300; i++) {
+    const auto n = std::to_string(i);
+    text += "def f" + n + "(a):\n    def g(b):\n        return a + b + " +
+        n + "\n    return g\n\n";
+    text += "x" + n + " = f" + n + "(1)\n";
+  }
+  const auto module = Parser(std::make_shared<Source>(text)).parseModule();
+  SymbolTableOptions options;
+  options.parallelism = 4;
+  auto serial = SymbolTable::build(module);
+  auto parallel = SymbolTable::build(module, options);
+  expectSameEntries(
+      serial->lookup(module.tree()), parallel->lookup(module.tree()));
+  const auto def = Def(module.body()[20]);
+  EXPECT_EQ(parallel->lookup(def.tree())->name, "f10");
+  EXPECT_EQ(parallel->lookup(def.statements()[0].tree())->name, "g");
+
+  // The first error in the module is the one reported.
+  std::string invalid = text;
+  invalid.insert(invalid.find("def f250(a):") + 13, "    global a\n");
+  invalid.insert(invalid.find("def f12(a)") + 9, ", a");
+  const auto invalidModule =
+      Parser(std::make_shared<Source>(invalid)).parseModule();
+  std::string serialError, parallelError;
+  try {
+    SymbolTable::build(invalidModule);
+  } catch (const std::exception& e) {
+    serialError = e.what();
+  }
+  try {
+    SymbolTable::build(invalidModule, options);
+  } catch (const std::exception& e) {
+    parallelError = e.what();
+  }
+  EXPECT_NE(serialError.find("duplicate parameter"), std::string::npos);
+  EXPECT_EQ(parallelError, serialError);
+}
+
+TEST(SymbolTable, LazyBlocks) {
+  std::string text;
+  for (int i = 0; i < 50; i++) {
+    const auto n = std::to_string(i);
+    text += "def f" + n + "(a):\n    def g(b):\n        return a + b + " +
+        n + "\n    return g\n\n";
+  }
+  text += "def broken(x, x):\n    return x\n";
+  ParserOptions parserOptions;
+  parserOptions.lazyFunctionBodies = true;
+  const auto module =
+      Parser(std::make_shared<Source>(text), parserOptions).parseModule();
+  SymbolTableOptions options;
+  options.lazyBlocks = true;
+  // The error in broken() only shows once it's looked up.
+  auto lazy = SymbolTable::build(module, options);
+  EXPECT_THROW(SymbolTable::build(module), std::exception);
+  const auto eager = SymbolTable::build(Def(module.body()[7]));
+
+  SymbolTableEntry* ste = lazy->lookup(module.tree());
+  EXPECT_EQ(ste->children.size(), 51);
+  EXPECT_TRUE(ste->symbols[Symbol("f7")] & SymbolFlag::DEF_LOCAL);
+  EXPECT_FALSE(ste->children[7]->lazy->built);
+
+  // A nested block can be looked up before the block around it.
+  const auto f7 = Def(module.body()[7]);
+  ste = lazy->lookup(f7.statements()[0].tree());
+  EXPECT_EQ(ste->name, "g");
+  EXPECT_EQ(ste->freevars, std::vector<Symbol>{Symbol("a")});
+  expectSameEntries(eager->lookup(f7.statements()[0].tree()), ste, false);
+  EXPECT_EQ(
+      lazy->lookup(f7.tree())->cellvars, std::vector<Symbol>{Symbol("a")});
+
+  // Concurrent first lookups build each block once.
+  std::vector<SymbolTableEntry*> found(4 * 50);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 50; i++) {
+        found[t * 50 + i] = lazy->lookup(module.body()[i].tree());
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (int i = 0; i < 50; i++) {
+    EXPECT_EQ(found[i]->name, "f" + std::to_string(i));
+    EXPECT_EQ(found[i]->children.size(), 1);
+    for (int t = 1; t < 4; t++) {
+      EXPECT_EQ(found[t * 50 + i], found[i]);
+    }
+  }
+  EXPECT_THROW(lazy->lookup(module.body()[50].tree()), std::exception);
+  EXPECT_THROW(lazy->lookup(module.body()[50].tree()), std::exception);
+}
+
+TEST(SymbolTable, UpdateAfterReparse) {
+  const std::string text = R"SCRIPT(
+def foo(x):
+    def inner():
+        return x
+    y = inner() + 1
+    return y
+
+def bar(a):
+    return foo(a)
+
+z = bar(2)
+)SCRIPT";
+  const auto before = Parser(std::make_shared<Source>(text)).parseModule();
+  auto st = SymbolTable::build(before);
+  SymbolTableEntry* foo = st->lookup(before.body()[0].tree());
+  SymbolTableEntry* inner =
+      st->lookup(Def(before.body()[0].tree()).statements()[0].tree());
+
+  auto apply = [](const std::string& text, const TextEdit& edit) {
+    return text.substr(0, edit.offset) + edit.inserted +
+        text.substr(edit.offset + edit.removed);
+  };
+
+  TextEdit edit{text.find("foo(a)"), 6, "foo(a) + w"};
+  const std::string edited = apply(text, edit);
+  const auto after = Parser(std::make_shared<Source>(edited))
+                         .reparseModule(before, edit);
+  st->update(after);
+
+  // foo() wasn't touched, so it keeps its entry, and so do the blocks in it.
+  EXPECT_EQ(st->lookup(after.body()[0].tree()), foo);
+  EXPECT_EQ(
+      st->lookup(Def(after.body()[0].tree()).statements()[0].tree()), inner);
+  EXPECT_EQ(inner->freevars.size(), 1);
+  SymbolTableEntry* ste = st->lookup(after.body()[1].tree());
+  EXPECT_EQ(ste->name, "bar");
+  EXPECT_TRUE(ste->symbols[Symbol("w")] & SymbolFlag::USE);
+  EXPECT_THROW(st->lookup(before.body()[1].tree()), std::exception);
+
+  ste = st->lookup(after.tree());
+  EXPECT_EQ(ste->children.size(), 2);
+  EXPECT_TRUE(ste->symbols[Symbol("foo")] & SymbolFlag::DEF_LOCAL);
+  EXPECT_TRUE(ste->symbols[Symbol("z")] & SymbolFlag::DEF_LOCAL);
+
+  // Without foo() the module no longer defines it.
+  edit = TextEdit{1, edited.find("def bar") - 1, ""};
+  const auto removed = Parser(std::make_shared<Source>(apply(edited, edit)))
+                           .reparseModule(after, edit);
+  st->update(removed);
+  EXPECT_EQ(st->lookup(removed.body()[0].tree())->name, "bar");
+  ste = st->lookup(removed.tree());
+  EXPECT_FALSE(ste->symbols.count(Symbol("foo")));
+  EXPECT_EQ(ste->children.size(), 1);
+  EXPECT_THROW(st->lookup(after.body()[0].tree()), std::exception);
+}
+
+TEST(SymbolTable, ManyBlocks) {
+  std::string text;
+  for (int i = 0; i < 1000; i++) {
+    const auto n = std::to_string(i);
+    text += "def f" + n + "(a):\n    b" + n + " = a\n    return b" + n +
+        "\n\n";
+  }
+  text += "def outer(x):\n    def inner(y):\n        return y\n    return x\n";
+  const auto module = Parser(std::make_shared<Source>(text)).parseModule();
+  auto st = SymbolTable::build(module);
 
-  EXPECT_TRUE(ste->symbols.count("torch"));
-  EXPECT_TRUE(ste->symbols["torch"] & SymbolFlag::USE);
+  SymbolTableEntry* ste = st->lookup(module.tree());
+  EXPECT_EQ(ste->symbols.size(), 1001);
+  EXPECT_EQ(ste->children.size(), 1001);
+  for (int i = 0; i < 1000; i += 99) {
+    const auto n = std::to_string(i);
+    EXPECT_TRUE(ste->symbols[Symbol("f" + n)] & SymbolFlag::DEF_LOCAL);
+    SymbolTableEntry* f = st->lookup(module.body()[i].tree());
+    EXPECT_EQ(f->name, "f" + n);
+    EXPECT_EQ(f->symbols.size(), 2);
+    EXPECT_TRUE(f->symbols[Symbol("b" + n)] & SymbolFlag::DEF_LOCAL);
+  }
+  EXPECT_FALSE(ste->symbols.count(Symbol("b0")));
+  const auto outer = Def(module.body()[1000]);
+  EXPECT_EQ(st->lookup(outer.statements()[0].tree())->name, "inner");
+  EXPECT_THROW(
+      st->lookup(Def(module.body()[0]).name().tree()), std::exception);
 
-  EXPECT_TRUE(ste->symbols.count("y"));
-  EXPECT_TRUE(ste->symbols["y"] & SymbolFlag::USE);
-  EXPECT_TRUE(ste->symbols["y"] & SymbolFlag::DEF_LOCAL);
+  // A second table over some of the same trees.
+  const auto def = Def(module.body()[5]);
+  auto defTable = SymbolTable::build(def);
+  EXPECT_EQ(defTable->lookup(def.tree())->name, "f5");
+  EXPECT_EQ(st->lookup(def.tree())->name, "f5");
+  EXPECT_EQ(defTable->lookup(def.tree())->name, "f5");
+  EXPECT_THROW(defTable->lookup(module.tree()), std::exception);
 }
 } // namespace dynamic
@@ -0,0 +1,79 @@
+#include "Obj.h"
+
+#include "minipy/interpreter/InlineCache.h"
+
+namespace minipy {
+
+bool Dynamic::hasHasattr() const {
+  return false;
+}
+bool Dynamic::hasattr(const std::string& name) const {
+  throw std::runtime_error("'hasattr' not implemented on type:  " + typeName_);
+}
+bool Dynamic::hasGetattr() const {
+  return false;
+}
+Obj Dynamic::getattr(const std::string& name) const {
+  throw std::runtime_error("'getattr' not implemented on type:  " + typeName_);
+}
+bool Dynamic::hasSetattr() const {
+  return false;
+}
+void Dynamic::setattr(const std::string& name, Obj value) {
+  throw std::runtime_error("'setattr' not implemented on type:  " + typeName_);
+}
+bool Dynamic::hasattr(Symbol name) const {
+  return hasattr(name.str());
+}
+Obj Dynamic::getattr(Symbol name) const {
+  return getattr(name.str());
+}
+void Dynamic::setattr(Symbol name, Obj value) {
+  setattr(name.str(), std::move(value));
+}
+bool Dynamic::hasCall() const {
+  return false;
+}
+Obj Dynamic::call(Obj args) {
+  throw std::runtime_error("'call' not implemented on type:  " + typeName_);
+}
+bool Dynamic::hasRichCompare() const {
+  return false;
+}
+Obj Dynamic::richCompare(Obj other, int opid) {
+  throw std::runtime_error(
+      "'richCompare' not implemented on type:  " + typeName_);
+}
+bool Dynamic::isNumber() const {
+  return false;
+}
+Obj Dynamic::add(Obj other) {
+  throw std::runtime_error("'add' not implemented on type:  " + typeName_);
+}
+Obj Dynamic::str() const {
+  throw std::runtime_error("'str' not implemented on type:  " + typeName_);
+}
+int Dynamic::attrSlot(const std::string& name) const {
+  return -1;
+}
+Obj Dynamic::attrSlotValue(int slot) const {
+  throw std::runtime_error(
+      "'attrSlotValue' not implemented on type:  " + typeName_);
+}
+uint64_t Dynamic::attrVersion() const {
+  uint64_t version = attrVersion_.load(std::memory_order_acquire);
+  if (version == 0) {
+    // Threads racing on the first call must all end up with the same tag.
+    const uint64_t tag = nextVersionTag();
+    if (attrVersion_.compare_exchange_strong(
+            version, tag, std::memory_order_acq_rel)) {
+      return tag;
+    }
+  }
+  return version;
+}
+void Dynamic::invalidateAttrs() {
+  attrVersion_.store(nextVersionTag(), std::memory_order_release);
+}
+
+} // namespace minipy
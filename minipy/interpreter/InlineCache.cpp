@@ -0,0 +1,17 @@
+#include "InlineCache.h"
+
+#include <atomic>
+
+namespace minipy {
+
+uint64_t nextVersionTag() {
+  static std::atomic<uint64_t> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+InlineCacheStats& inlineCacheStats() {
+  thread_local InlineCacheStats stats;
+  return stats;
+}
+
+} // namespace minipy
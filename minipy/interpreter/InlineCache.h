@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "minipy/interpreter/Obj.h"
+
+namespace minipy {
+
+// Per-instruction inline caches for LOAD_GLOBAL, LOAD_ATTR and LOAD_METHOD.
+//
+// Every cache is keyed on a version tag. Tags come from a single process-wide
+// counter, so a tag identifies both *which* dict/object layout was looked up
+// and *what state* it was in. A cache entry is valid exactly when the tag it
+// recorded equals the current tag of the dict/object being accessed. That
+// makes a hit one integer compare, with no string hashing.
+
+// Returns a fresh, non-zero version tag. 0 is reserved for "empty cache".
+uint64_t nextVersionTag();
+
+// Hit/miss counters for the inline caches used on the current thread, for
+// profiling.
+struct InlineCacheStats {
+  uint64_t globalHits = 0;
+  uint64_t globalMisses = 0;
+  uint64_t attrHits = 0;
+  uint64_t attrMisses = 0;
+};
+InlineCacheStats& inlineCacheStats();
+
+/**
+ * class VersionedDict
+ *
+ * A name -> Obj mapping (e.g. a frame's globals) that takes a new version tag
+ * on every mutation. Values are only reachable through const accessors so that
+ * every write goes through set()/emplace()/erase().
+ */
+class VersionedDict {
+ public:
+  using Map = std::unordered_map<std::string, Obj>;
+
+  VersionedDict() : version_(nextVersionTag()) {}
+
+  uint64_t version() const {
+    return version_;
+  }
+
+  const Obj* find(const std::string& name) const {
+    auto it = map_.find(name);
+    return it == map_.end() ? nullptr : &it->second;
+  }
+  const Obj& at(const std::string& name) const {
+    return map_.at(name);
+  }
+  size_t count(const std::string& name) const {
+    return map_.count(name);
+  }
+  size_t size() const {
+    return map_.size();
+  }
+  Map::const_iterator begin() const {
+    return map_.begin();
+  }
+  Map::const_iterator end() const {
+    return map_.end();
+  }
+
+  // Insert `value` under `name` if `name` is not present yet.
+  bool emplace(std::string name, Obj value) {
+    const bool inserted =
+        map_.emplace(std::move(name), std::move(value)).second;
+    if (inserted) {
+      version_ = nextVersionTag();
+    }
+    return inserted;
+  }
+  void set(const std::string& name, Obj value) {
+    map_[name] = std::move(value);
+    version_ = nextVersionTag();
+  }
+  size_t erase(const std::string& name) {
+    const size_t erased = map_.erase(name);
+    if (erased) {
+      version_ = nextVersionTag();
+    }
+    return erased;
+  }
+
+ private:
+  Map map_;
+  uint64_t version_;
+};
+
+// Inline cache for one LOAD_GLOBAL instruction.
+class GlobalCache {
+ public:
+  // Equivalent to globals.find(name), but skips the lookup entirely when
+  // `globals` hasn't changed since the last call.
+  const Obj* lookup(const VersionedDict& globals, const std::string& name) {
+    if (version_ == globals.version()) {
+      ++inlineCacheStats().globalHits;
+      return slot_;
+    }
+    ++inlineCacheStats().globalMisses;
+    // Unordered map nodes are stable, and any insertion or erasure changes
+    // the version, so the slot stays valid for as long as the version does.
+    slot_ = globals.find(name);
+    version_ = globals.version();
+    return slot_;
+  }
+
+ private:
+  uint64_t version_ = 0;
+  const Obj* slot_ = nullptr;
+};
+
+// Inline cache for one LOAD_ATTR or LOAD_METHOD instruction. Caches the slot
+// an attribute is stored in for a given attribute layout (see
+// Dynamic::attrSlot()), and reads the slot on every hit, so values are
+// always current and nothing is kept alive by the cache.
+class AttrCache {
+ public:
+  // Equivalent to obj.getattr(name).
+  Obj load(const Obj& obj, const std::string& name) {
+    const Dynamic& dynamic = obj.toDynamicRef();
+    const auto version = dynamic.attrVersion();
+    if (version_ == version) {
+      ++inlineCacheStats().attrHits;
+      return dynamic.attrSlotValue(slot_);
+    }
+    ++inlineCacheStats().attrMisses;
+    const int slot = dynamic.attrSlot(name);
+    if (slot < 0) {
+      return dynamic.getattr(name);
+    }
+    version_ = version;
+    slot_ = slot;
+    return dynamic.attrSlotValue(slot);
+  }
+
+ private:
+  uint64_t version_ = 0;
+  int slot_ = -1;
+};
+
+} // namespace minipy
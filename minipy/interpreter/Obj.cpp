@@ -4,47 +4,6 @@
 
 namespace minipy {
 
-bool Dynamic::hasHasattr() const {
-  return false;
-}
-bool Dynamic::hasattr(const std::string& name) const {
-  throw std::runtime_error("'hasattr' not implemented on type:  " + typeName_);
-}
-bool Dynamic::hasGetattr() const {
-  return false;
-}
-Obj Dynamic::getattr(const std::string& name) const {
-  throw std::runtime_error("'getattr' not implemented on type:  " + typeName_);
-}
-bool Dynamic::hasSetattr() const {
-  return false;
-}
-void Dynamic::setattr(const std::string& name, Obj value) {
-  throw std::runtime_error("'setattr' not implemented on type:  " + typeName_);
-}
-bool Dynamic::hasCall() const {
-  return false;
-}
-Obj Dynamic::call(Obj args) {
-  throw std::runtime_error("'call' not implemented on type:  " + typeName_);
-}
-bool Dynamic::hasRichCompare() const {
-  return false;
-}
-Obj Dynamic::richCompare(Obj other, int opid) {
-  throw std::runtime_error(
-      "'richCompare' not implemented on type:  " + typeName_);
-}
-bool Dynamic::isNumber() const {
-  return false;
-}
-Obj Dynamic::add(Obj other) {
-  throw std::runtime_error("'add' not implemented on type:  " + typeName_);
-}
-Obj Dynamic::str() const {
-  throw std::runtime_error("'str' not implemented on type:  " + typeName_);
-}
-
 Obj Obj::call(Obj args) {
   if (!isDynamic()) {
     throw std::runtime_error("no getattr");
@@ -53,7 +12,7 @@ Obj Obj::call(Obj args) {
 }
 
 Obj Obj::richCompare(Obj other, int opId) {
-  switch (tag_) {
+  switch (tag()) {
     case Tag::OBJECT:
       return toDynamicRef().richCompare(other, opId);
     case Tag::INT: {
@@ -104,7 +63,7 @@ Obj Obj::richCompare(Obj other, int opId) {
 
 // TODO figure out a better way of checking the numeric protocol
 bool Obj::isNumber() const {
-  switch (tag_) {
+  switch (tag()) {
     case Tag::OBJECT:
       return toDynamicRef().isNumber();
     case Tag::INT:
@@ -117,7 +76,7 @@ bool Obj::isNumber() const {
 
 // TODO this is not correct, use the correct binary protocol
 Obj Obj::add(Obj other) {
-  switch (tag_) {
+  switch (tag()) {
     case Tag::INT:
       return toInt() + other.toInt();
     default:
@@ -127,9 +86,9 @@ Obj Obj::add(Obj other) {
 
 bool Obj::is(const Obj& rhs) const {
   const Obj& lhs = *this;
-  if (lhs.isPtr()) {
-    return rhs.isPtr() && lhs.tag_ == rhs.tag_ &&
-        lhs.payload_.as_intrusive_ptr == rhs.payload_.as_intrusive_ptr;
+  // Ints may be refcounted when NaN-boxed, but they still compare by value.
+  if (lhs.isPtr() && !lhs.isInt()) {
+    return rhs.isPtr() && lhs.tag() == rhs.tag() && lhs.ptr() == rhs.ptr();
   }
   return lhs == rhs;
 }
@@ -139,7 +98,7 @@ bool operator!=(const Obj& lhs, const Obj& rhs) {
 }
 
 const std::string& Obj::typeName() const {
-  switch (tag_) {
+  switch (tag()) {
     case Tag::NONE: {
       static const std::string ret = "None";
       return ret;
@@ -167,7 +126,7 @@ const std::string& Obj::typeName() const {
 }
 
 bool operator==(const Obj& lhs, const Obj& rhs) {
-  switch (lhs.tag_) {
+  switch (lhs.tag()) {
     case Obj::Tag::DOUBLE:
       return rhs.isDouble() && lhs.toDouble() == rhs.toDouble();
     case Obj::Tag::INT:
@@ -183,22 +142,40 @@ bool operator==(const Obj& lhs, const Obj& rhs) {
   }
 }
 
-Obj::Obj(std::string s) : tag_(Tag::STRING) {
+Obj::Obj(std::string s) {
   auto ret = c10::make_intrusive<StringObj>(std::move(s));
-  payload_.as_intrusive_ptr = ret.release();
+  setPtr(ret.release(), Tag::STRING);
+}
+
+Obj::Obj(Symbol s) {
+  auto* object = s.object();
+  if (!object) {
+    // The symbol table keeps this reference for the rest of the process, and
+    // every interpreter thread will copy it.
+    auto str = c10::make_intrusive<StringObj>(s.str());
+    str->share();
+    object = s.setObjectIfAbsent(str.release());
+  }
+  c10::raw::intrusive_ptr::incref(object);
+  setPtr(object, Tag::STRING);
 }
 
 const std::string& Obj::toStringRef() const {
-  if (tag_ != Tag::STRING) {
+  if (!isString()) {
     throw std::runtime_error("Expected string, got " + typeName());
   }
-  return static_cast<StringObj*>(payload_.as_intrusive_ptr)->value();
+  return static_cast<StringObj*>(ptr())->value();
 }
 
 Obj Obj::str() const {
-  switch (tag_) {
+  switch (tag()) {
     case Tag::NONE: {
-      static const Obj ret = "None";
+      // Shared so that every interpreter thread can copy it.
+      static const Obj ret = [] {
+        Obj none = std::string("None");
+        none.share();
+        return none;
+      }();
       return ret;
     }
     case Tag::INT:
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <cstring>
 #include <string>
 #include <string_view>
+#include "minipy/common/Symbol.h"
 #include "minipy/common/intrusive_ptr.h"
 
 namespace minipy {
@@ -24,6 +27,14 @@ class Obj;
 class Dynamic : public c10::intrusive_ptr_target {
  public:
   Dynamic(std::string typeName) : typeName_(std::move(typeName)) {}
+  // A copy is a different object, so it gets its own attribute version.
+  Dynamic(const Dynamic& other)
+      : c10::intrusive_ptr_target(other), typeName_(other.typeName_) {}
+  Dynamic& operator=(const Dynamic& other) {
+    typeName_ = other.typeName_;
+    invalidateAttrs();
+    return *this;
+  }
   virtual ~Dynamic() {}
 
   virtual bool hasHasattr() const;
@@ -35,6 +46,13 @@ class Dynamic : public c10::intrusive_ptr_target {
   virtual bool hasSetattr() const;
   virtual void setattr(const std::string& name, Obj value);
 
+  // Symbol-keyed attribute protocol. The defaults forward to the string
+  // versions above; types that key their attributes by Symbol should override
+  // these so that lookups are integer compares.
+  virtual bool hasattr(Symbol name) const;
+  virtual Obj getattr(Symbol name) const;
+  virtual void setattr(Symbol name, Obj value);
+
   virtual bool hasCall() const;
   virtual Obj call(Obj args);
 
@@ -46,27 +64,97 @@ class Dynamic : public c10::intrusive_ptr_target {
 
   virtual Obj str() const;
 
+  // Attribute inline caches (see InlineCache.h) remember where getattr()
+  // finds an attribute, never its value. Objects that keep attributes in
+  // numbered slots opt in by overriding both of these:
+  // - attrSlot(name) returns the slot that getattr(name) reads, or -1 if
+  //   getattr(name) computes its result (a fresh object, a side effect, ...).
+  //   Lookups that return -1 always call getattr().
+  // - attrSlotValue(slot) returns the slot's current value, exactly what
+  //   getattr() returns for the slot's name.
+  // Such objects must call invalidateAttrs() whenever the mapping from names
+  // to slots may change, e.g. when an attribute is added or removed, but not
+  // when a slot's value changes.
+  virtual int attrSlot(const std::string& name) const;
+  virtual Obj attrSlotValue(int slot) const;
+  // A process-wide unique tag for the current layout of this object's
+  // attribute slots, assigned on first use. Thread-safe. Types whose
+  // instances all share one layout may return a tag of their own instead, so
+  // that one cache entry serves every instance.
+  virtual uint64_t attrVersion() const;
+
   std::string typeName_;
+
+ protected:
+  void invalidateAttrs();
+
+ private:
+  mutable std::atomic<uint64_t> attrVersion_{0};
 };
 
+// Obj has two storage layouts, selected at compile time:
+//  - the default "tagged union" layout: a 16-byte Payload union plus a Tag.
+//  - MINIPY_NAN_BOXING: a single 64-bit word. Doubles are stored as their raw
+//    IEEE-754 bits, and every other kind lives in the payload of a negative
+//    quiet NaN (see Note [NaN-boxed Obj layout]).
+// Both layouts expose the same interface; only the private accessors below
+// know the difference.
+#ifndef MINIPY_NAN_BOXING
+#define MINIPY_NAN_BOXING 0
+#endif
+
+// Note [NaN-boxed Obj layout]
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// A 64-bit word w is interpreted as:
+//
+//   w >> 48 in [0xFFF9, 0xFFFF]  boxed value, tag = (w >> 48) & 0x7,
+//                                payload = low 48 bits
+//   anything else                a double
+//
+// Constructing a double canonicalizes every NaN to 0x7FF8000000000000, so no
+// real double ever lands in the boxed range. Pointers use the low 48 bits,
+// which is all of user space on x86-64 and aarch64. Ints are stored inline as
+// 48-bit two's complement; ints that don't fit are spilled to a heap-allocated
+// BoxedInt and carry the BIG_INT box tag, which is refcounted like any other
+// pointer but otherwise behaves exactly like an inline int.
+#if MINIPY_NAN_BOXING
+// Heap storage for ints that don't fit into the 48-bit NaN-boxed payload.
+class BoxedInt final : public c10::intrusive_ptr_target {
+ public:
+  explicit BoxedInt(int64_t value) : value_(value) {}
+  int64_t value() const {
+    return value_;
+  }
+
+ private:
+  int64_t value_;
+};
+#endif
+
 class Obj final {
  private:
   enum class Tag : uint32_t { NONE, INT, DOUBLE, BOOL, STRING, OBJECT };
 
  public:
   Obj() : Obj(nullptr) {}
-  Obj(std::nullptr_t) : tag_(Tag::NONE) {}
+  Obj(std::nullptr_t) {
+    setNone();
+  }
 
   ~Obj() {
     if (isPtr()) {
-      c10::raw::intrusive_ptr::decref(payload_.as_intrusive_ptr);
+      c10::raw::intrusive_ptr::decref(ptr());
     }
   }
-  Obj(const Obj& other) : Obj(other.payload_, other.tag_) {
+  Obj(const Obj& other) : Obj(other, RawCopy{}) {
     if (isPtr()) {
-      c10::raw::intrusive_ptr::incref(payload_.as_intrusive_ptr);
+      c10::raw::intrusive_ptr::incref(ptr());
     }
   }
+  Obj(Obj&& other) noexcept : Obj(other, RawCopy{}) {
+    // We stole other's reference, so it must not drop it.
+    other.setNone();
+  }
   Obj& operator=(Obj&& rhs) noexcept {
     Obj(std::move(rhs)).swap(*this); // this also sets rhs to None
     return *this;
@@ -77,8 +165,12 @@ class Obj final {
   }
 
   void swap(Obj& rhs) noexcept {
+#if MINIPY_NAN_BOXING
+    std::swap(bits_, rhs.bits_);
+#else
     std::swap(payload_, rhs.payload_);
     std::swap(tag_, rhs.tag_);
+#endif
   }
 
   /// String support
@@ -87,11 +179,14 @@ class Obj final {
   // deserve first-class support in Obj
 
   /*implicit*/ Obj(std::string v);
+  // The canonical string object for an interned name. Doesn't allocate after
+  // the first conversion of each Symbol.
+  /*implicit*/ Obj(Symbol v);
   // /*implicit*/ Obj(std::string_view v) : Obj(std::string(v)) {}
   // /*implicit*/ Obj(const char* v) : Obj(std::string(v)) {}
 
   bool isString() const {
-    return tag_ == Tag::STRING;
+    return tag() == Tag::STRING;
   }
   const std::string& toStringRef() const;
 
@@ -133,46 +228,82 @@ class Obj final {
 
   /// None
   bool isNone() const {
-    return tag_ == Tag::NONE;
+    return tag() == Tag::NONE;
   }
 
   /// Double
-  /*implicit*/ Obj(double v) : tag_(Tag::DOUBLE) {
+  /*implicit*/ Obj(double v) {
+#if MINIPY_NAN_BOXING
+    // Canonicalize NaNs so they can't be mistaken for a boxed value.
+    bits_ = v != v ? kCanonicalNaN : doubleToBits(v);
+#else
+    tag_ = Tag::DOUBLE;
     payload_.as_double = v;
+#endif
   }
   bool isDouble() const {
-    return tag_ == Tag::DOUBLE;
+    return tag() == Tag::DOUBLE;
   }
-  bool toDouble() const {
-    if (tag_ != Tag::DOUBLE) {
-      throw std::runtime_error("toDouble() called on non-int Obj");
+  double toDouble() const {
+    if (!isDouble()) {
+      throw std::runtime_error("toDouble() called on non-double Obj");
     }
+#if MINIPY_NAN_BOXING
+    return bitsToDouble(bits_);
+#else
     return payload_.as_double;
+#endif
   }
 
   /// Int
-  /*implicit*/ Obj(int64_t v) : tag_(Tag::INT) {
+  /*implicit*/ Obj(int64_t v) {
+#if MINIPY_NAN_BOXING
+    if (v >= kMinSmallInt && v <= kMaxSmallInt) {
+      bits_ = box(kIntBox, static_cast<uint64_t>(v));
+    } else {
+      bits_ = box(kBigIntBox, toPayload(c10::make_intrusive<BoxedInt>(v)));
+    }
+#else
+    tag_ = Tag::INT;
     payload_.as_int = v;
+#endif
   }
   bool isInt() const {
-    return tag_ == Tag::INT;
+    return tag() == Tag::INT;
   }
   int64_t toInt() const {
-    if (tag_ != Tag::INT) {
+    if (!isInt()) {
       throw std::runtime_error("toInt() called on non-int Obj");
     }
+#if MINIPY_NAN_BOXING
+    if (boxTag() == kBigIntBox) {
+      return static_cast<const BoxedInt*>(ptr())->value();
+    }
+    // Sign-extend the 48-bit payload.
+    return static_cast<int64_t>(bits_ << 16) >> 16;
+#else
     return payload_.as_int;
+#endif
   }
 
   /// Bool support
-  /*implicit*/ Obj(bool v) : tag_(Tag::BOOL) {
+  /*implicit*/ Obj(bool v) {
+#if MINIPY_NAN_BOXING
+    bits_ = box(kBoolBox, v);
+#else
+    tag_ = Tag::BOOL;
     payload_.as_bool = v;
+#endif
   }
   bool isBool() const {
-    return tag_ == Tag::BOOL;
+    return tag() == Tag::BOOL;
   }
   bool toBool() const {
+#if MINIPY_NAN_BOXING
+    return bits_ & 1;
+#else
     return payload_.as_bool;
+#endif
   }
 
   template <
@@ -184,12 +315,11 @@ class Obj final {
   /*implicit*/ Obj(c10::intrusive_ptr<Dynamic> v);
 
   bool isDynamic() const {
-    return tag_ == Tag::OBJECT;
+    return tag() == Tag::OBJECT;
   }
   void clearToNone() {
     // TODO distinguish null and none, but I forgot why
-    payload_.nul = nullptr;
-    tag_ = Tag::NONE;
+    setNone();
   }
 
   c10::intrusive_ptr<Dynamic> toDynamic() && {
@@ -208,16 +338,14 @@ class Obj final {
 
   template <class T>
   c10::intrusive_ptr<T> moveToIntrusivePtr() {
-    auto t = c10::intrusive_ptr<T>::reclaim(
-        static_cast<T*>(payload_.as_intrusive_ptr));
+    auto t = c10::intrusive_ptr<T>::reclaim(static_cast<T*>(ptr()));
     clearToNone();
     return t;
   }
 
   template <typename T>
   c10::intrusive_ptr<T> toIntrusivePtr() const {
-    auto r = c10::intrusive_ptr<T>::reclaim(
-        static_cast<T*>(payload_.as_intrusive_ptr));
+    auto r = c10::intrusive_ptr<T>::reclaim(static_cast<T*>(ptr()));
     auto p = r;
     r.release();
     return p;
@@ -228,7 +356,7 @@ class Obj final {
       throw std::runtime_error("toDynamicRef() called on non-dynamic Obj");
     }
     // AT_ASSERT(isDynamic(), "Expected Dynamic but got ", tagKind());
-    return *static_cast<const Dynamic*>(payload_.as_intrusive_ptr);
+    return *static_cast<const Dynamic*>(ptr());
   }
 
   Dynamic& toDynamicRef() {
@@ -236,7 +364,15 @@ class Obj final {
     if (!isDynamic()) {
       throw std::runtime_error("toDynamicRef() called on non-dynamic Obj");
     }
-    return *static_cast<Dynamic*>(payload_.as_intrusive_ptr);
+    return *static_cast<Dynamic*>(ptr());
+  }
+
+  // Promote the referenced object (if any) to atomic refcounting before
+  // handing this Obj to another thread. See Note [Non-atomic refcounting]
+  void share() const {
+    if (isPtr()) {
+      ptr()->share();
+    }
   }
 
   // Object protocol
@@ -256,6 +392,18 @@ class Obj final {
 
     toDynamic()->setattr(name, std::move(v));
   }
+  Obj getattr(Symbol name) const {
+    if (!isDynamic()) {
+      throw std::runtime_error("no getattr");
+    }
+    return toDynamicRef().getattr(name);
+  }
+  void setattr(Symbol name, Obj v) {
+    if (!isDynamic()) {
+      throw std::runtime_error("no setattr");
+    }
+    toDynamicRef().setattr(name, std::move(v));
+  }
 
   // calling protocol
   // TODO implement iscallable
@@ -267,9 +415,111 @@ class Obj final {
   Obj add(Obj other);
 
  private:
+  // Tag for a constructor that copies the raw representation of an Obj
+  // without touching refcounts.
+  struct RawCopy {};
+
+#if MINIPY_NAN_BOXING
+  static_assert(sizeof(void*) == 8, "NaN-boxing requires 64-bit pointers");
+
+  // Box tags, stored in bits 48-50 of a boxed value. 0 is reserved: 0xFFF8 is
+  // the prefix of a plain (negative, quiet) NaN double.
+  static constexpr uint64_t kNoneBox = 1;
+  static constexpr uint64_t kIntBox = 2;
+  static constexpr uint64_t kBoolBox = 3;
+  static constexpr uint64_t kStringBox = 4;
+  static constexpr uint64_t kObjectBox = 5;
+  static constexpr uint64_t kBigIntBox = 6;
+
+  static constexpr uint64_t kBoxPrefix = 0xFFF8ULL << 48;
+  static constexpr uint64_t kPayloadMask = (1ULL << 48) - 1;
+  static constexpr uint64_t kCanonicalNaN = 0x7FF8ULL << 48;
+  static constexpr int64_t kMaxSmallInt = (1LL << 47) - 1;
+  static constexpr int64_t kMinSmallInt = -(1LL << 47);
+
+  static uint64_t box(uint64_t boxTag, uint64_t payload) {
+    return kBoxPrefix | (boxTag << 48) | (payload & kPayloadMask);
+  }
+  template <typename T>
+  static uint64_t toPayload(c10::intrusive_ptr<T> p) {
+    auto raw = reinterpret_cast<uint64_t>(
+        static_cast<c10::intrusive_ptr_target*>(p.release()));
+    assert((raw & ~kPayloadMask) == 0);
+    return raw;
+  }
+  static uint64_t doubleToBits(double v) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    return bits;
+  }
+  static double bitsToDouble(uint64_t bits) {
+    double v;
+    std::memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  bool isBoxed() const {
+    return (bits_ >> 48) > 0xFFF8;
+  }
+  uint64_t boxTag() const {
+    return (bits_ >> 48) & 0x7;
+  }
+
+  Tag tag() const {
+    if (!isBoxed()) {
+      return Tag::DOUBLE;
+    }
+    switch (boxTag()) {
+      case kIntBox:
+      case kBigIntBox:
+        return Tag::INT;
+      case kBoolBox:
+        return Tag::BOOL;
+      case kStringBox:
+        return Tag::STRING;
+      case kObjectBox:
+        return Tag::OBJECT;
+      default:
+        return Tag::NONE;
+    }
+  }
+  bool isPtr() const {
+    const auto t = bits_ >> 48;
+    return t == (0xFFF8 | kStringBox) || t == (0xFFF8 | kObjectBox) ||
+        t == (0xFFF8 | kBigIntBox);
+  }
+  c10::intrusive_ptr_target* ptr() const {
+    return reinterpret_cast<c10::intrusive_ptr_target*>(bits_ & kPayloadMask);
+  }
+  void setNone() {
+    bits_ = box(kNoneBox, 0);
+  }
+  void setPtr(c10::intrusive_ptr_target* p, Tag t) {
+    bits_ = box(
+        t == Tag::STRING ? kStringBox : kObjectBox,
+        reinterpret_cast<uint64_t>(p));
+  }
+
+  Obj(const Obj& other, RawCopy) : bits_(other.bits_) {}
+  uint64_t bits_;
+#else
+  Tag tag() const {
+    return tag_;
+  }
   bool isPtr() const {
     return tag_ == Tag::OBJECT || tag_ == Tag::STRING;
   }
+  c10::intrusive_ptr_target* ptr() const {
+    return payload_.as_intrusive_ptr;
+  }
+  void setNone() {
+    payload_.nul = nullptr;
+    tag_ = Tag::NONE;
+  }
+  void setPtr(c10::intrusive_ptr_target* p, Tag t) {
+    payload_.as_intrusive_ptr = p;
+    tag_ = t;
+  }
 
   union Payload {
     std::nullptr_t nul;
@@ -279,13 +529,19 @@ class Obj final {
     c10::intrusive_ptr_target* as_intrusive_ptr;
   };
 
-  Obj(Payload p, Tag t) : payload_(p), tag_(t) {}
+  Obj(const Obj& other, RawCopy)
+      : payload_(other.payload_), tag_(other.tag_) {}
   Payload payload_;
   Tag tag_;
+#endif
 };
 
-inline Obj::Obj(c10::intrusive_ptr<Dynamic> v) : tag_(Tag::OBJECT) {
-  payload_.as_intrusive_ptr = v.release();
+#if MINIPY_NAN_BOXING
+static_assert(sizeof(Obj) == 8, "NaN-boxed Obj must fit in one word");
+#endif
+
+inline Obj::Obj(c10::intrusive_ptr<Dynamic> v) {
+  setPtr(v.release(), Tag::OBJECT);
 }
 
 namespace detail {
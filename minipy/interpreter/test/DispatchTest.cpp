@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "minipy/interpreter/Dispatch.h"
+
+namespace minipy {
+namespace {
+
+// A stand-in for FORALL_OPCODES: a counter and an accumulator are enough to
+// exercise straight-line dispatch, jumps and leaving the loop.
+#define FORALL_TEST_OPCODES(_) \
+  _(SET_COUNTER)               \
+  _(ADD_COUNTER)               \
+  _(LOOP)                      \
+  _(RETURN)
+
+enum class TestOpCode : uint8_t {
+#define DEFINE_OPCODE(op) op,
+  FORALL_TEST_OPCODES(DEFINE_OPCODE)
+#undef DEFINE_OPCODE
+};
+
+struct TestInstruction {
+  TestOpCode op;
+  int arg1;
+};
+
+int64_t run(const std::vector<TestInstruction>& code) {
+  int64_t counter = 0;
+  int64_t acc = 0;
+  const TestInstruction* pc = code.data();
+  MINIPY_DISPATCH_TABLE(FORALL_TEST_OPCODES);
+  MINIPY_DISPATCH() {
+    MINIPY_TARGET(SET_COUNTER) {
+      counter = pc->arg1;
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(ADD_COUNTER) {
+      acc += counter;
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(LOOP) {
+      if (--counter > 0) {
+        MINIPY_JUMP(code.data() + pc->arg1);
+      }
+      MINIPY_NEXT();
+    }
+    MINIPY_TARGET(RETURN) {
+      return acc;
+    }
+  }
+  MINIPY_DISPATCH_END();
+}
+
+} // namespace
+
+TEST(Dispatch, Loop) {
+  // sum(range(1, 101))
+  const std::vector<TestInstruction> code = {
+      {TestOpCode::SET_COUNTER, 100},
+      {TestOpCode::ADD_COUNTER, 0},
+      {TestOpCode::LOOP, 1},
+      {TestOpCode::RETURN, 0},
+  };
+  EXPECT_EQ(run(code), 5050);
+}
+
+TEST(Dispatch, StraightLine) {
+  const std::vector<TestInstruction> code = {
+      {TestOpCode::SET_COUNTER, 7},
+      {TestOpCode::ADD_COUNTER, 0},
+      {TestOpCode::ADD_COUNTER, 0},
+      {TestOpCode::SET_COUNTER, 1},
+      {TestOpCode::LOOP, 0},
+      {TestOpCode::ADD_COUNTER, 0},
+      {TestOpCode::RETURN, 0},
+  };
+  EXPECT_EQ(run(code), 14);
+}
+
+} // namespace minipy
@@ -0,0 +1,210 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <vector>
+
+#include "minipy/interpreter/InlineCache.h"
+
+namespace minipy {
+
+namespace {
+
+// An object whose attributes live in slots, plus `fresh`, which getattr()
+// computes as a new object every time.
+class Point : public Dynamic {
+ public:
+  // Points given a shared layout tag all have just `x`, in slot 0.
+  explicit Point(uint64_t sharedLayout = 0)
+      : Dynamic("Point"), sharedLayout_(sharedLayout) {}
+
+  using Dynamic::getattr;
+  using Dynamic::setattr;
+  int attrSlot(const std::string& name) const override {
+    for (size_t i = 0; i < names_.size(); i++) {
+      if (names_[i] == name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  Obj attrSlotValue(int slot) const override {
+    ++slotReads;
+    return values_.at(slot);
+  }
+  uint64_t attrVersion() const override {
+    return sharedLayout_ ? sharedLayout_ : Dynamic::attrVersion();
+  }
+  bool hasGetattr() const override {
+    return true;
+  }
+  Obj getattr(const std::string& name) const override {
+    ++getattrCalls;
+    if (name == "fresh") {
+      return Obj(c10::make_intrusive<Point>());
+    }
+    const int slot = attrSlot(name);
+    if (slot < 0) {
+      throw std::runtime_error("no attribute " + name);
+    }
+    return values_[slot];
+  }
+  bool hasSetattr() const override {
+    return true;
+  }
+  void setattr(const std::string& name, Obj value) override {
+    const int slot = attrSlot(name);
+    if (slot >= 0) {
+      values_[slot] = std::move(value);
+      return;
+    }
+    names_.push_back(name);
+    values_.push_back(std::move(value));
+    invalidateAttrs();
+  }
+
+  mutable int getattrCalls = 0;
+  mutable int slotReads = 0;
+
+ private:
+  uint64_t sharedLayout_;
+  std::vector<std::string> names_ = {"x"};
+  std::vector<Obj> values_ = {int64_t(1)};
+};
+
+} // namespace
+
+TEST(InlineCache, GlobalHitsUntilDictChanges) {
+  VersionedDict globals;
+  globals.set("x", int64_t(1));
+  GlobalCache cache;
+  const InlineCacheStats before = inlineCacheStats();
+
+  EXPECT_EQ(cache.lookup(globals, "x")->toInt(), 1);
+  EXPECT_EQ(cache.lookup(globals, "x")->toInt(), 1);
+  EXPECT_EQ(inlineCacheStats().globalMisses, before.globalMisses + 1);
+  EXPECT_EQ(inlineCacheStats().globalHits, before.globalHits + 1);
+
+  // Every mutation takes a new version, even of another name.
+  const uint64_t version = globals.version();
+  globals.set("y", int64_t(2));
+  EXPECT_NE(globals.version(), version);
+  EXPECT_EQ(cache.lookup(globals, "x")->toInt(), 1);
+  EXPECT_EQ(inlineCacheStats().globalMisses, before.globalMisses + 2);
+
+  globals.set("x", int64_t(3));
+  EXPECT_EQ(cache.lookup(globals, "x")->toInt(), 3);
+  EXPECT_EQ(cache.lookup(globals, "x")->toInt(), 3);
+  EXPECT_EQ(inlineCacheStats().globalHits, before.globalHits + 2);
+
+  EXPECT_EQ(globals.erase("x"), 1);
+  EXPECT_EQ(cache.lookup(globals, "x"), nullptr);
+
+  // Writes that don't change anything keep the version.
+  const uint64_t unchanged = globals.version();
+  EXPECT_FALSE(globals.emplace("y", int64_t(4)));
+  EXPECT_EQ(globals.erase("x"), 0);
+  EXPECT_EQ(globals.version(), unchanged);
+  EXPECT_EQ(globals.at("y").toInt(), 2);
+
+  // Caches don't confuse dicts with each other.
+  VersionedDict other;
+  other.set("y", int64_t(5));
+  EXPECT_EQ(cache.lookup(other, "y")->toInt(), 5);
+  EXPECT_EQ(cache.lookup(globals, "y")->toInt(), 2);
+}
+
+TEST(InlineCache, AttrCachesSlot) {
+  auto point = c10::make_intrusive<Point>();
+  const Obj obj(point);
+  AttrCache cache;
+  const InlineCacheStats before = inlineCacheStats();
+
+  EXPECT_EQ(cache.load(obj, "x").toInt(), 1);
+  EXPECT_EQ(cache.load(obj, "x").toInt(), 1);
+  EXPECT_EQ(point->getattrCalls, 0);
+  EXPECT_EQ(point->slotReads, 2);
+  EXPECT_EQ(inlineCacheStats().attrMisses, before.attrMisses + 1);
+  EXPECT_EQ(inlineCacheStats().attrHits, before.attrHits + 1);
+
+  // Writing a slot keeps the layout, and hits read the new value.
+  point->setattr("x", int64_t(2));
+  EXPECT_EQ(cache.load(obj, "x").toInt(), 2);
+  EXPECT_EQ(inlineCacheStats().attrHits, before.attrHits + 2);
+
+  // Adding an attribute changes the layout.
+  point->setattr("y", int64_t(3));
+  EXPECT_EQ(cache.load(obj, "x").toInt(), 2);
+  EXPECT_EQ(inlineCacheStats().attrMisses, before.attrMisses + 2);
+
+  // Another object with the same attributes has a layout of its own.
+  const Obj other(c10::make_intrusive<Point>());
+  EXPECT_EQ(cache.load(other, "x").toInt(), 1);
+  EXPECT_EQ(inlineCacheStats().attrMisses, before.attrMisses + 3);
+}
+
+TEST(InlineCache, AttrSharedLayoutHitsAcrossObjects) {
+  const uint64_t layout = nextVersionTag();
+  AttrCache cache;
+  const InlineCacheStats before = inlineCacheStats();
+  for (int64_t i = 0; i < 3; i++) {
+    auto point = c10::make_intrusive<Point>(layout);
+    point->setattr("x", i);
+    EXPECT_EQ(cache.load(Obj(point), "x").toInt(), i);
+  }
+  EXPECT_EQ(inlineCacheStats().attrMisses, before.attrMisses + 1);
+  EXPECT_EQ(inlineCacheStats().attrHits, before.attrHits + 2);
+}
+
+TEST(InlineCache, AttrComputedByGetattrIsNotCached) {
+  auto point = c10::make_intrusive<Point>();
+  const Obj obj(point);
+  AttrCache cache;
+  // Every load calls getattr(), which allocates a new object each time.
+  const Obj first = cache.load(obj, "fresh");
+  const Obj second = cache.load(obj, "fresh");
+  EXPECT_EQ(point->getattrCalls, 2);
+  EXPECT_NE(first.toDynamic().get(), second.toDynamic().get());
+
+  // Objects that don't override attrSlot() never hit either.
+  class Plain : public Dynamic {
+   public:
+    Plain() : Dynamic("Plain") {}
+    using Dynamic::getattr;
+    Obj getattr(const std::string& name) const override {
+      return Obj(int64_t(++calls));
+    }
+    mutable int64_t calls = 0;
+  };
+  const Obj plain(c10::make_intrusive<Plain>());
+  EXPECT_EQ(cache.load(plain, "x").toInt(), 1);
+  EXPECT_EQ(cache.load(plain, "x").toInt(), 2);
+}
+
+TEST(InlineCache, AttrVersionIsAssignedOnce) {
+  for (int i = 0; i < 20; i++) {
+    auto point = c10::make_intrusive<Point>();
+    point->share();
+    std::vector<uint64_t> versions(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < versions.size(); t++) {
+      threads.emplace_back([&, t] { versions[t] = point->attrVersion(); });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    for (uint64_t version : versions) {
+      EXPECT_NE(version, 0);
+      EXPECT_EQ(version, point->attrVersion());
+    }
+  }
+
+  // Copies are different objects.
+  Point point;
+  Point copy(point);
+  EXPECT_NE(copy.attrVersion(), point.attrVersion());
+  const uint64_t version = copy.attrVersion();
+  copy = point;
+  EXPECT_NE(copy.attrVersion(), version);
+}
+
+} // namespace minipy
@@ -0,0 +1,174 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include "minipy/interpreter/Obj.h"
+
+namespace minipy {
+
+namespace {
+
+class Thing : public Dynamic {
+ public:
+  Thing() : Dynamic("Thing") {}
+};
+
+double doubleFromBits(uint64_t bits) {
+  double v;
+  std::memcpy(&v, &bits, sizeof(v));
+  return v;
+}
+
+uint64_t bitsOf(double v) {
+  uint64_t bits;
+  std::memcpy(&bits, &v, sizeof(bits));
+  return bits;
+}
+
+} // namespace
+
+#if MINIPY_NAN_BOXING
+TEST(Obj, IsOneWord) {
+  EXPECT_EQ(sizeof(Obj), 8);
+}
+#endif
+
+TEST(Obj, Ints) {
+  // Around the edges of the 48-bit inline payload, and far outside it.
+  const int64_t values[] = {
+      0,
+      1,
+      -1,
+      42,
+      -42,
+      (int64_t(1) << 47) - 1,
+      -(int64_t(1) << 47),
+      int64_t(1) << 47,
+      -(int64_t(1) << 47) - 1,
+      int64_t(1) << 48,
+      -(int64_t(1) << 48),
+      std::numeric_limits<int64_t>::max(),
+      std::numeric_limits<int64_t>::min(),
+  };
+  for (int64_t value : values) {
+    const Obj obj(value);
+    EXPECT_TRUE(obj.isInt()) << value;
+    EXPECT_FALSE(obj.isDouble()) << value;
+    EXPECT_FALSE(obj.isNone()) << value;
+    EXPECT_EQ(obj.toInt(), value);
+    EXPECT_THROW(obj.toDouble(), std::runtime_error);
+
+    Obj copy = obj;
+    EXPECT_EQ(copy.toInt(), value);
+    Obj moved = std::move(copy);
+    EXPECT_EQ(moved.toInt(), value);
+    EXPECT_TRUE(copy.isNone());
+    moved = obj;
+    const Obj& self = moved;
+    moved = self;
+    EXPECT_EQ(moved.toInt(), value);
+  }
+}
+
+TEST(Obj, Doubles) {
+  const double values[] = {
+      0.0,
+      -0.0,
+      1.5,
+      -1.5,
+      std::numeric_limits<double>::infinity(),
+      -std::numeric_limits<double>::infinity(),
+      std::numeric_limits<double>::max(),
+      std::numeric_limits<double>::denorm_min(),
+  };
+  for (double value : values) {
+    const Obj obj(value);
+    EXPECT_TRUE(obj.isDouble()) << value;
+    EXPECT_FALSE(obj.isInt()) << value;
+    EXPECT_EQ(bitsOf(obj.toDouble()), bitsOf(value));
+    EXPECT_THROW(obj.toInt(), std::runtime_error);
+  }
+
+  // Every NaN stays a NaN double, including ones whose bits look like a boxed
+  // value (negative quiet NaNs with a payload).
+  const double nans[] = {
+      std::numeric_limits<double>::quiet_NaN(),
+      -std::numeric_limits<double>::quiet_NaN(),
+      std::numeric_limits<double>::signaling_NaN(),
+      doubleFromBits(0xFFF8000000000000ULL),
+      doubleFromBits(0xFFF9000000000001ULL),
+      doubleFromBits(0xFFFA00000000002AULL),
+      doubleFromBits(0xFFFD123456789ABCULL),
+      doubleFromBits(0xFFFFFFFFFFFFFFFFULL),
+      doubleFromBits(0x7FF0000000000001ULL),
+  };
+  for (double nan : nans) {
+    const Obj obj(nan);
+    EXPECT_TRUE(obj.isDouble()) << std::hex << bitsOf(nan);
+    EXPECT_FALSE(obj.isInt());
+    EXPECT_FALSE(obj.isNone());
+    EXPECT_FALSE(obj.isDynamic());
+    EXPECT_TRUE(std::isnan(obj.toDouble()));
+    // Copies mustn't touch a refcount that isn't there.
+    Obj copy = obj;
+    EXPECT_TRUE(std::isnan(copy.toDouble()));
+  }
+}
+
+TEST(Obj, NoneAndBools) {
+  const Obj none;
+  EXPECT_TRUE(none.isNone());
+  EXPECT_FALSE(none.isDouble());
+  EXPECT_FALSE(none.isInt());
+  EXPECT_TRUE(Obj(nullptr).isNone());
+
+  for (bool value : {false, true}) {
+    const Obj obj(value);
+    EXPECT_TRUE(obj.isBool());
+    EXPECT_FALSE(obj.isInt());
+    EXPECT_FALSE(obj.isDouble());
+    EXPECT_EQ(obj.toBool(), value);
+  }
+}
+
+TEST(Obj, Refcounts) {
+  auto thing = c10::make_intrusive<Thing>();
+  EXPECT_EQ(thing.use_count(), 1);
+  {
+    Obj obj(thing);
+    EXPECT_TRUE(obj.isDynamic());
+    EXPECT_FALSE(obj.isDouble());
+    EXPECT_EQ(thing.use_count(), 2);
+    EXPECT_EQ(&obj.toDynamicRef(), thing.get());
+
+    Obj copy = obj;
+    EXPECT_EQ(thing.use_count(), 3);
+    Obj moved = std::move(copy);
+    EXPECT_EQ(thing.use_count(), 3);
+    EXPECT_TRUE(copy.isNone());
+
+    copy = moved;
+    EXPECT_EQ(thing.use_count(), 4);
+    copy = Obj(int64_t(1) << 50);
+    EXPECT_EQ(thing.use_count(), 3);
+    copy.swap(moved);
+    EXPECT_EQ(moved.toInt(), int64_t(1) << 50);
+    EXPECT_EQ(&copy.toDynamicRef(), thing.get());
+    moved = std::move(copy);
+    EXPECT_EQ(thing.use_count(), 3);
+
+    auto back = obj.toDynamic();
+    EXPECT_EQ(back.get(), thing.get());
+    EXPECT_EQ(thing.use_count(), 4);
+    auto taken = std::move(moved).toDynamic();
+    EXPECT_EQ(thing.use_count(), 4);
+    EXPECT_TRUE(moved.isNone());
+  }
+  EXPECT_EQ(thing.use_count(), 1);
+}
+
+} // namespace minipy
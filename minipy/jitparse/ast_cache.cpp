@@ -0,0 +1,529 @@
+#include "minipy/jitparse/ast_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "minipy/jitparse/parser.h"
+
+namespace minipy {
+
+namespace {
+
+constexpr char kMagic[8] = {'M', 'P', 'Y', 'A', 'S', 'T', '\0', '\0'};
+// Bump whenever the encoding or the shape of parser output changes, so that
+// stale cache files are ignored rather than misread.
+constexpr uint32_t kVersion = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t numNodes;
+  uint64_t sourceHash;
+  uint64_t sourceSize;
+  uint32_t numNumbers;
+  uint32_t numStrings;
+  uint64_t stringBytes;
+  uint64_t nodeBytes;
+  // hashSourceText() of everything after the header, to catch corruption.
+  uint64_t bodyHash;
+};
+
+// Each node is a varint tag, (kind << 3) | NodeType for compounds and just the
+// NodeType for atoms (whose kind is always TK_STRING), followed by:
+//   COMPOUND, COMPOUND_NO_SOURCE: zigzag(start - start of the previous
+//     compound), end - start, number of children. The children are the
+//     nodes that precede it.
+//   STRING, SYMBOL, NUMBER: a string index. A NUMBER's value is the next
+//     NumberRecord.
+enum NodeType : uint32_t {
+  COMPOUND,
+  // Same, but the range has no source.
+  COMPOUND_NO_SOURCE,
+  STRING,
+  // Interned as a Symbol when loaded.
+  SYMBOL,
+  NUMBER,
+  NUM_NODE_TYPES,
+};
+constexpr uint32_t kNodeTypeBits = 3;
+static_assert(NUM_NODE_TYPES <= (1 << kNodeTypeBits), "");
+
+struct NumberRecord {
+  uint8_t isFloat;
+  uint8_t isImaginary;
+  uint8_t overflow;
+  uint8_t padding[5];
+  // intValue or the bits of floatValue, depending on isFloat.
+  uint64_t bits;
+};
+
+template <typename T>
+void append(std::string& out, const T& value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void appendVarint(std::string& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+[[noreturn]] void malformed(const char* what) {
+  throw std::runtime_error(std::string(what) + " in AST cache data");
+}
+
+// Bounds-checked reads from a buffer that may not be suitably aligned.
+class Reader {
+ public:
+  explicit Reader(std::string_view data) : data_(data) {}
+
+  // Returns a pointer to `count` consecutive Ts and skips past them.
+  template <typename T>
+  const char* take(uint64_t count) {
+    if (count > (data_.size() - pos_) / sizeof(T)) {
+      malformed("truncated section");
+    }
+    const char* result = data_.data() + pos_;
+    pos_ += count * sizeof(T);
+    return result;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      if (pos_ == data_.size()) {
+        malformed("truncated varint");
+      }
+      const uint8_t byte = data_[pos_++];
+      value |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    malformed("overlong varint");
+  }
+
+  bool done() const {
+    return pos_ == data_.size();
+  }
+
+ private:
+  std::string_view data_;
+  size_t pos_ = 0;
+};
+
+template <typename T>
+T at(const char* base, size_t i) {
+  T result;
+  std::memcpy(&result, base + i * sizeof(T), sizeof(T));
+  return result;
+}
+
+class Encoder {
+ public:
+  explicit Encoder(const SourceView& source)
+      : text_size_(source.text().size()) {}
+
+  void encode(const TreeRef& root) {
+    // Iterative post-order walk, since trees like long chains of binary
+    // operators can be very deep.
+    std::vector<std::pair<const Tree*, size_t>> stack;
+    stack.emplace_back(root.get(), 0);
+    while (!stack.empty()) {
+      const Tree* tree = stack.back().first;
+      const size_t next = stack.back().second;
+      if (next < tree->trees().size()) {
+        stack.back().second++;
+        stack.emplace_back(tree->trees()[next].get(), 0);
+        continue;
+      }
+      stack.pop_back();
+      emit(tree);
+    }
+  }
+
+  std::string finish(uint64_t sourceHash) {
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.numNodes = num_nodes_;
+    header.sourceHash = sourceHash;
+    header.sourceSize = text_size_;
+    header.numNumbers = numbers_.size();
+    header.numStrings = string_offsets_.size();
+    header.stringBytes = strings_.size();
+    header.nodeBytes = nodes_.size();
+    header.bodyHash = 0;
+
+    std::string out;
+    out.reserve(
+        sizeof(Header) + numbers_.size() * sizeof(NumberRecord) +
+        (string_offsets_.size() + 1) * sizeof(uint32_t) + strings_.size() +
+        nodes_.size());
+    append(out, header);
+    for (const auto& number : numbers_) {
+      append(out, number);
+    }
+    for (uint32_t offset : string_offsets_) {
+      append(out, offset);
+    }
+    append(out, static_cast<uint32_t>(strings_.size()));
+    out += strings_;
+    out += nodes_;
+    header.bodyHash = hashSourceText(
+        std::string_view(out).substr(sizeof(Header)));
+    std::memcpy(&out[0], &header, sizeof(Header));
+    return out;
+  }
+
+ private:
+  void emit(const Tree* tree) {
+    num_nodes_++;
+    if (!tree->isAtom()) {
+      const SourceRange& range = tree->range();
+      NodeType type = COMPOUND;
+      if (range.source_id() == SourceId::NONE) {
+        type = COMPOUND_NO_SOURCE;
+      } else {
+        checkSource(range);
+      }
+      appendVarint(
+          nodes_, (uint64_t(uint32_t(tree->kind())) << kNodeTypeBits) | type);
+      const int64_t delta = int64_t(range.start()) - int64_t(prev_start_);
+      appendVarint(nodes_, (uint64_t(delta) << 1) ^ uint64_t(delta >> 63));
+      appendVarint(nodes_, range.end() - range.start());
+      appendVarint(nodes_, tree->trees().size());
+      prev_start_ = range.start();
+    } else if (const NumberLiteral* number = tree->number()) {
+      NumberRecord value;
+      std::memset(&value, 0, sizeof(value));
+      value.isFloat = number->isFloat;
+      value.isImaginary = number->isImaginary;
+      value.overflow = number->overflow;
+      if (number->isFloat) {
+        std::memcpy(&value.bits, &number->floatValue, sizeof(value.bits));
+      } else {
+        value.bits = static_cast<uint64_t>(number->intValue);
+      }
+      numbers_.push_back(value);
+      appendVarint(nodes_, NUMBER);
+      appendVarint(nodes_, addString(tree->stringValue()));
+    } else if (dynamic_cast<const InternedString*>(tree)) {
+      appendVarint(nodes_, SYMBOL);
+      appendVarint(nodes_, addString(tree->stringValue()));
+    } else {
+      appendVarint(nodes_, STRING);
+      appendVarint(nodes_, addString(tree->stringValue()));
+    }
+  }
+
+  void checkSource(const SourceRange& range) {
+    if (source_ == SourceId::NONE) {
+      source_ = range.source_id();
+    }
+    if (range.source_id() != source_ || range.end() > text_size_) {
+      throw std::runtime_error(
+          "can only serialize trees whose ranges are all in one source");
+    }
+  }
+
+  uint32_t addString(const std::string& str) {
+    auto it = string_ids_.find(str);
+    if (it != string_ids_.end()) {
+      return it->second;
+    }
+    const uint32_t id = string_offsets_.size();
+    string_offsets_.push_back(strings_.size());
+    strings_ += str;
+    string_ids_.emplace(str, id);
+    return id;
+  }
+
+  SourceId source_ = SourceId::NONE;
+  size_t text_size_;
+  uint32_t num_nodes_ = 0;
+  uint32_t prev_start_ = 0;
+  std::string nodes_;
+  std::vector<NumberRecord> numbers_;
+  std::vector<uint32_t> string_offsets_;
+  std::string strings_;
+  std::unordered_map<std::string, uint32_t> string_ids_;
+};
+
+// A read-only mapping of a whole file.
+class MappedFile {
+ public:
+  // Returns false if the file doesn't exist or can't be mapped.
+  bool open(const std::string& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+    size_ = st.st_size;
+    void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return false;
+    }
+    data_ = data;
+    return true;
+  }
+  ~MappedFile() {
+    if (data_) {
+      ::munmap(data_, size_);
+    }
+  }
+  std::string_view contents() const {
+    return std::string_view(static_cast<const char*>(data_), size_);
+  }
+
+ private:
+  void* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace
+
+uint64_t hashSourceText(std::string_view text) {
+  // FNV-1a over 8-byte words with a murmur3 finalizer. Cheap enough to run
+  // on every load; cache files also record the text's size, which the hash
+  // is checked together with.
+  uint64_t h = 0xcbf29ce484222325ull ^ text.size();
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= text.size(); i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, text.data() + i, sizeof(word));
+    h = (h ^ word) * 0x100000001b3ull;
+    h ^= h >> 29;
+  }
+  for (; i < text.size(); i++) {
+    h = (h ^ static_cast<unsigned char>(text[i])) * 0x100000001b3ull;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+bool writeCacheFile(
+    const std::string& directory,
+    const std::string& path,
+    std::string_view data) {
+  if (::mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    return false;
+  }
+  const std::string tmp = path + ".tmp" + std::to_string(::getpid());
+  FILE* f = std::fopen(tmp.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  const bool written = std::fwrite(data.data(), 1, data.size(), f) ==
+      data.size();
+  if (std::fclose(f) != 0 || !written ||
+      std::rename(tmp.c_str(), path.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::string serializeTree(const TreeRef& tree, const SourceView& source) {
+  Encoder encoder(source);
+  encoder.encode(tree);
+  return encoder.finish(hashSourceText(source.text()));
+}
+
+TreeRef deserializeTree(
+    std::string_view data,
+    const std::shared_ptr<SourceView>& source) {
+  Reader reader(data);
+  const auto header = at<Header>(reader.take<Header>(1), 0);
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion) {
+    throw std::runtime_error("not an AST cache file for this version");
+  }
+  const std::string_view text = source->text();
+  if (header.sourceSize != text.size() ||
+      header.sourceHash != hashSourceText(text)) {
+    throw std::runtime_error("AST cache data is for a different source");
+  }
+  if (header.bodyHash != hashSourceText(data.substr(sizeof(Header)))) {
+    malformed("checksum mismatch");
+  }
+  const char* numbers = reader.take<NumberRecord>(header.numNumbers);
+  const char* offsets = reader.take<uint32_t>(header.numStrings + 1ull);
+  const char* strings = reader.take<char>(header.stringBytes);
+  Reader nodes(std::string_view(
+      reader.take<char>(header.nodeBytes), header.nodeBytes));
+  if (!reader.done()) {
+    malformed("trailing bytes");
+  }
+
+  auto string = [&](uint64_t i) {
+    if (i >= header.numStrings) {
+      malformed("bad string index");
+    }
+    const uint32_t begin = at<uint32_t>(offsets, i);
+    const uint32_t end = at<uint32_t>(offsets, i + 1);
+    if (begin > end || end > header.stringBytes) {
+      malformed("bad string offset");
+    }
+    return std::string_view(strings + begin, end - begin);
+  };
+
+  const SourceRef source_ref(source);
+  const SourceId id = source_ref.id();
+  // The root holds the source for the whole tree.
+  Tree::SourceScope source_scope(id);
+  // Identifiers repeat a lot, so intern each distinct one only once.
+  std::vector<std::optional<Symbol>> symbols(header.numStrings);
+  uint32_t next_number = 0;
+  int64_t prev_start = 0;
+  std::vector<TreeRef> stack;
+  for (uint32_t i = 0; i < header.numNodes; i++) {
+    const uint64_t tag = nodes.varint();
+    const uint64_t type = tag & ((1 << kNodeTypeBits) - 1);
+    switch (type) {
+      case COMPOUND:
+      case COMPOUND_NO_SOURCE: {
+        const uint64_t zigzag = nodes.varint();
+        const int64_t start =
+            prev_start + int64_t((zigzag >> 1) ^ (0 - (zigzag & 1)));
+        const uint64_t length = nodes.varint();
+        const uint64_t num_trees = nodes.varint();
+        if (start < 0 || uint64_t(start) > text.size() ||
+            length > text.size() - start || num_trees > stack.size() ||
+            (tag >> kNodeTypeBits) >= uint64_t(kNumTokenKinds)) {
+          malformed("bad node");
+        }
+        prev_start = start;
+        TreeList trees(
+            std::make_move_iterator(stack.end() - num_trees),
+            std::make_move_iterator(stack.end()));
+        stack.resize(stack.size() - num_trees);
+        const SourceRange range(
+            type == COMPOUND ? id : SourceId::NONE, start, start + length);
+        stack.push_back(Compound::create(
+            static_cast<int>(tag >> kNodeTypeBits), range, std::move(trees)));
+        break;
+      }
+      case STRING:
+        stack.push_back(String::create(std::string(string(nodes.varint()))));
+        break;
+      case SYMBOL: {
+        const uint64_t index = nodes.varint();
+        const std::string_view str = string(index);
+        auto& symbol = symbols[index];
+        if (!symbol) {
+          symbol = Symbol(str);
+        }
+        stack.push_back(InternedString::create(*symbol));
+        break;
+      }
+      case NUMBER: {
+        const std::string_view str = string(nodes.varint());
+        if (next_number >= header.numNumbers) {
+          malformed("bad number");
+        }
+        const auto record = at<NumberRecord>(numbers, next_number++);
+        NumberLiteral value;
+        value.isFloat = record.isFloat;
+        value.isImaginary = record.isImaginary;
+        value.overflow = record.overflow;
+        if (value.isFloat) {
+          std::memcpy(&value.floatValue, &record.bits, sizeof(record.bits));
+        } else {
+          value.intValue = static_cast<int64_t>(record.bits);
+        }
+        stack.push_back(NumberString::create(std::string(str), value));
+        break;
+      }
+      default:
+        malformed("bad node type");
+    }
+  }
+  if (!nodes.done() || stack.size() != 1) {
+    malformed("not exactly one tree");
+  }
+  stack.back()->holdSource();
+  return std::move(stack.back());
+}
+
+AstCache::AstCache(std::string directory) : directory_(std::move(directory)) {}
+
+std::string AstCache::pathFor(const SourceView& source) const {
+  char name[32];
+  std::snprintf(
+      name,
+      sizeof(name),
+      "%016llx.ast",
+      static_cast<unsigned long long>(hashSourceText(source.text())));
+  return directory_ + "/" + name;
+}
+
+std::optional<Mod> AstCache::load(
+    const std::shared_ptr<SourceView>& source,
+    bool useArena) const {
+  MappedFile file;
+  if (!file.open(pathFor(*source))) {
+    return std::nullopt;
+  }
+  c10::intrusive_ptr<TreeArena> arena;
+  if (useArena) {
+    arena = c10::make_intrusive<TreeArena>();
+  }
+  TreeArena::Scope scope(arena);
+  try {
+    TreeRef tree = deserializeTree(file.contents(), source);
+    if (arena) {
+      tree = ArenaRoot::create(tree, {arena});
+    }
+    return Mod(tree);
+  } catch (const std::runtime_error&) {
+    // Stale or corrupt; the next store() replaces it.
+    return std::nullopt;
+  }
+}
+
+bool AstCache::store(
+    const std::shared_ptr<SourceView>& source,
+    const Mod& module) const {
+  std::string data;
+  try {
+    data = serializeTree(module.tree(), *source);
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+  return writeCacheFile(directory_, pathFor(*source), data);
+}
+
+Mod AstCache::parseModule(
+    const std::shared_ptr<SourceView>& source,
+    bool useArena) const {
+  if (auto module = load(source, useArena)) {
+    return *module;
+  }
+  Mod module = Parser(source, useArena).parseModule();
+  store(source, module);
+  return module;
+}
+
+} // namespace minipy
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "minipy/jitparse/tree.h"
+#include "minipy/jitparse/tree_views.h"
+
+namespace minipy {
+
+// A compact binary encoding of a parsed tree, so that unchanged scripts don't
+// have to be lexed and parsed again on every process start.
+//
+// The encoding is a fixed header, the values of numeric literals, a
+// deduplicated string table, and then the nodes in post-order (so loading is
+// a simple stack machine, no recursion) as a stream of varints. Ranges are
+// stored as byte offsets and rebound to whichever source the tree is loaded
+// against. See ast_cache.cpp for the details; integers that aren't varints
+// are in native byte order.
+
+// Hash of the source text that keys the cache. Not cryptographic.
+uint64_t hashSourceText(std::string_view text);
+
+// Writes `data` to `path` in `directory`, creating the directory if needed,
+// by way of a temporary file that is renamed into place. Returns false on
+// failure. Shared by the caches that key files by hashSourceText().
+bool writeCacheFile(
+    const std::string& directory,
+    const std::string& path,
+    std::string_view data);
+
+// Encodes `tree`, which must have been parsed from `source`. Throws
+// std::runtime_error if it refers to any other source.
+std::string serializeTree(const TreeRef& tree, const SourceView& source);
+
+// Decodes a tree produced by serializeTree(). Ranges in the result point into
+// `source`, whose text must be the text the tree was parsed from. Throws
+// std::runtime_error if `data` is malformed or was encoded for different text.
+// Nodes are allocated from the current TreeArena, if any, which the caller
+// must keep alive for them (e.g. with an ArenaRoot). Only the root keeps
+// `source` alive (see Tree::SourceScope).
+TreeRef deserializeTree(
+    std::string_view data,
+    const std::shared_ptr<SourceView>& source);
+
+/**
+ * class AstCache
+ *
+ * A directory of serialized modules, one file per distinct source text, named
+ * after hashSourceText(). Cache files are memory-mapped when loaded and the
+ * tree is rebuilt straight from the mapping, without lexing.
+ *
+ * Any number of processes can share a cache directory: files are written to a
+ * temporary name and renamed into place, so readers never see a partial file.
+ */
+class AstCache {
+ public:
+  explicit AstCache(std::string directory);
+
+  // The cached module for `source`, or nullopt if there is no usable entry
+  // (missing, written by a different format version, or corrupt).
+  std::optional<Mod> load(
+      const std::shared_ptr<SourceView>& source,
+      bool useArena = false) const;
+
+  // Writes `module`, which must have been parsed from `source`. Returns false
+  // if it couldn't be written; the cache is only an optimization, so callers
+  // can usually ignore that.
+  bool store(const std::shared_ptr<SourceView>& source, const Mod& module)
+      const;
+
+  // load() if possible, otherwise parse `source` and store() the result.
+  Mod parseModule(
+      const std::shared_ptr<SourceView>& source,
+      bool useArena = false) const;
+
+  // The file `source` is cached in.
+  std::string pathFor(const SourceView& source) const;
+
+ private:
+  std::string directory_;
+};
+
+} // namespace minipy
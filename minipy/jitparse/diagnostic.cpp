@@ -0,0 +1,30 @@
+#include "minipy/jitparse/diagnostic.h"
+
+#include <sstream>
+
+#include "minipy/jitparse/lexer.h"
+
+namespace minipy {
+
+std::string Diagnostic::message() const {
+  std::stringstream ss;
+  switch (code) {
+    case ParseErrorCode::NONE:
+      return "no error";
+    case ParseErrorCode::UNEXPECTED_TOKEN:
+    case ParseErrorCode::INVALID_TOKEN:
+      ss << "expected " << (expected ? kindToString(expected) : what)
+         << " but found '" << kindToString(found) << "' here:\n";
+      break;
+    case ParseErrorCode::INVALID_INDENT:
+    case ParseErrorCode::UNMATCHED_BRACKET:
+    case ParseErrorCode::INVALID_SYNTAX:
+    case ParseErrorCode::INTERNAL:
+      ss << what << ":\n";
+      break;
+  }
+  range.highlight(ss);
+  return ss.str();
+}
+
+} // namespace minipy
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "minipy/jitparse/source_range.h"
+
+namespace minipy {
+
+enum class ParseErrorCode : uint8_t {
+  NONE = 0,
+  // A token of the wrong kind, e.g. a missing ':'.
+  UNEXPECTED_TOKEN,
+  // Text that doesn't start any token, e.g. '$'.
+  INVALID_TOKEN,
+  // A dedent to a column that no enclosing block starts at.
+  INVALID_INDENT,
+  // A closing bracket that was never opened.
+  UNMATCHED_BRACKET,
+  // Tokens that parse but don't make sense together, e.g. `a, b += 1`.
+  INVALID_SYNTAX,
+  // A bug in the lexer.
+  INTERNAL,
+};
+
+/**
+ * struct Diagnostic
+ *
+ * A syntax error, as the lexer and parser record it: what kind of error and
+ * where, but no message yet. Highlighting the source for a message costs a
+ * lot more than finding the error, so message() only does that when it's
+ * asked to.
+ */
+struct Diagnostic {
+  ParseErrorCode code = ParseErrorCode::NONE;
+  // The offending token. Its source is kept alive for message().
+  OwnedSourceRange range;
+  // For UNEXPECTED_TOKEN and INVALID_TOKEN, what was found: a token kind, or
+  // the first character of the invalid token.
+  int found = 0;
+  // For UNEXPECTED_TOKEN, the token kind that was expected, or 0 if `what`
+  // describes what was expected instead.
+  int expected = 0;
+  // What was expected, or what's wrong otherwise.
+  std::string what;
+
+  explicit operator bool() const {
+    return code != ParseErrorCode::NONE;
+  }
+  // The same message the parser's exceptions have always had.
+  std::string message() const;
+};
+
+// The exception a syntax error is thrown as, for callers that don't check
+// for a Diagnostic themselves. The message is formatted when it's thrown, so
+// what() is safe to call from any thread.
+struct ParseError : public std::runtime_error {
+  explicit ParseError(Diagnostic diagnostic)
+      : std::runtime_error(diagnostic.message()),
+        diagnostic_(std::move(diagnostic)) {}
+  const Diagnostic& diagnostic() const {
+    return diagnostic_;
+  }
+
+ private:
+  Diagnostic diagnostic_;
+};
+
+} // namespace minipy
@@ -65,6 +65,14 @@ std::string ErrorReport::current_call_stack() {
 #endif // C10_MOBILE
 }
 
+Diagnostic ErrorReport::diagnostic() const {
+  Diagnostic diagnostic;
+  diagnostic.code = ParseErrorCode::INVALID_SYNTAX;
+  diagnostic.range = context;
+  diagnostic.what = ss.str();
+  return diagnostic;
+}
+
 const char* ErrorReport::what() const noexcept {
   std::stringstream msg;
   msg << "\n" << ss.str();
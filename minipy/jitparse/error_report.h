@@ -1,5 +1,6 @@
 #pragma once
 
+#include "minipy/jitparse/diagnostic.h"
 #include "minipy/jitparse/tree.h"
 
 namespace minipy {
@@ -17,6 +18,8 @@ struct ErrorReport : public std::exception {
   explicit ErrorReport(const Token& tok) : ErrorReport(tok.range) {}
 
   const char* what() const noexcept override;
+  // The error as an INVALID_SYNTAX diagnostic, without the call stack.
+  Diagnostic diagnostic() const;
 
   struct CallStack {
     // These functions are used to report why a function was being compiled
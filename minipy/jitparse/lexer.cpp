@@ -1,84 +1,143 @@
 #include "minipy/jitparse/lexer.h"
 
-#include <mutex>
+#include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 
 namespace minipy {
 
-static const std::unordered_map<int, int> binary_prec = {
-    {TK_IF, 1},
-    {TK_FOR, 1},
-    {TK_AND, 2},
-    {TK_OR, 2},
-    // reserve a level for unary not
-    {TK_IN, 4},
-    {TK_NOTIN, 4},
-    {'<', 4},
-    {'>', 4},
-    {TK_IS, 4},
-    {TK_ISNOT, 4},
-    {TK_EQ, 4},
-    {TK_LE, 4},
-    {TK_GE, 4},
-    {TK_NE, 4},
-    {'|', 5},
-    {'^', 6},
-    {'&', 7},
-    {TK_LSHIFT, 8},
-    {TK_RSHIFT, 8},
-    {'+', 9},
-    {'-', 9},
-    {'*', 10},
-    {'/', 10},
-    {TK_FLOOR_DIV, 10},
-    {'%', 10},
-    {'@', 10},
-    {TK_POW, 11},
-};
+void SharedParserData::buildTables(const TokenTrie& trie) {
+  for (int c = 0; c < 128; c++) {
+    const bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    const bool digit = c >= '0' && c <= '9';
+    const bool space = c == ' ' || (c >= '\t' && c <= '\r');
+    char_flags_[c] = (alpha || c == '_' ? kIdentStart : 0) |
+        (alpha || digit || c == '_' ? kIdentChar : 0) |
+        (space && c != '\n' ? kBlank : 0);
+  }
+
+  // Number the trie nodes breadth-first, starting at kStartState, and give
+  // every byte that labels an edge its own class.
+  std::vector<const TokenTrie*> states = {nullptr, &trie};
+  for (size_t i = kStartState; i < states.size(); i++) {
+    for (size_t j = 0; j < states[i]->child_chars.size(); j++) {
+      auto& cls = char_class_[static_cast<unsigned char>(
+          states[i]->child_chars[j])];
+      if (cls == 0) {
+        cls = num_classes_++;
+      }
+      states.push_back(states[i]->child_tries[j].get());
+    }
+  }
+  assert(states.size() <= UINT16_MAX);
+
+  token_transitions_.assign(states.size() * num_classes_, kDeadState);
+  token_accept_.assign(states.size(), 0);
+  size_t next_state = kStartState + 1;
+  for (size_t i = kStartState; i < states.size(); i++) {
+    token_accept_[i] = states[i]->kind;
+    for (size_t j = 0; j < states[i]->child_chars.size(); j++) {
+      const auto cls =
+          char_class_[static_cast<unsigned char>(states[i]->child_chars[j])];
+      token_transitions_[i * num_classes_ + cls] = next_state++;
+    }
+  }
+}
 
-static const std::unordered_map<int, int> unary_prec = {
-    {TK_NOT, 3},
-    {'~', 3},
-    {'-', 10},
-    {'*', 10},
+namespace {
+
+// A perfect hash table from the text of every token the lexer matches to its
+// kind: no two of them hash to the same slot, so a lookup hashes once and
+// compares one string. It's built at compile time, by trying hash seeds until
+// one without collisions turns up.
+struct TokenString {
+  std::string_view str;
+  int kind = 0;
 };
 
-bool SharedParserData::isUnary(int kind, int* prec) {
-  auto it = unary_prec.find(kind);
-  if (it != unary_prec.end()) {
-    *prec = it->second;
-    return true;
+#define COUNT_STRING(tok, _, str) +(*(str) != '\0')
+constexpr size_t kNumTokenStrings =
+    std::char_traits<char>::length(valid_single_char_tokens)
+        TC_FORALL_TOKEN_KINDS(COUNT_STRING);
+#undef COUNT_STRING
+constexpr size_t kTokenHashSlots = 1024;
+static_assert(kNumTokenStrings < UINT8_MAX, "slots store uint8_t indices");
+
+constexpr size_t hashToken(std::string_view str, uint32_t seed) {
+  // FNV-1a, starting from `seed`
+  uint32_t h = 2166136261u ^ seed;
+  for (char c : str) {
+    h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
   }
-  return false;
+  return (h ^ (h >> 16)) & (kTokenHashSlots - 1);
 }
-bool SharedParserData::isBinary(int kind, int* prec) {
-  auto it = binary_prec.find(kind);
-  if (it != binary_prec.end()) {
-    *prec = it->second;
+
+struct TokenHashTable {
+  TokenString tokens[kNumTokenStrings] = {};
+  uint32_t seed = 0;
+  // 1 + the index into `tokens` of the token that hashes to each slot, or 0.
+  uint8_t slots[kTokenHashSlots] = {};
+
+  constexpr bool trySeed(uint32_t s) {
+    uint64_t used[kTokenHashSlots / 64] = {};
+    for (size_t i = 0; i < kNumTokenStrings; i++) {
+      const size_t h = hashToken(tokens[i].str, s);
+      if (used[h / 64] & (uint64_t(1) << (h % 64))) {
+        return false;
+      }
+      used[h / 64] |= uint64_t(1) << (h % 64);
+    }
+    seed = s;
+    for (size_t i = 0; i < kNumTokenStrings; i++) {
+      slots[hashToken(tokens[i].str, s)] = i + 1;
+    }
     return true;
   }
-  return false;
+  constexpr int find(std::string_view str) const {
+    const uint8_t slot = slots[hashToken(str, seed)];
+    if (slot == 0 || tokens[slot - 1].str != str) {
+      return 0;
+    }
+    return tokens[slot - 1].kind;
+  }
+};
+
+constexpr TokenHashTable makeTokenHashTable() {
+  TokenHashTable table;
+  size_t n = 0;
+  for (const char* c = valid_single_char_tokens; *c; c++) {
+    table.tokens[n++] = {std::string_view(c, 1), *c};
+  }
+#define ADD_STRING(tok, _, str)     \
+  if (*(str) != '\0') {             \
+    table.tokens[n++] = {str, tok}; \
+  }
+  TC_FORALL_TOKEN_KINDS(ADD_STRING)
+#undef ADD_STRING
+  for (uint32_t seed = 0; seed < 1000; seed++) {
+    if (table.trySeed(seed)) {
+      break;
+    }
+  }
+  return table;
 }
 
+constexpr TokenHashTable kTokenHashTable = makeTokenHashTable();
+static_assert(
+    kTokenHashTable.find(kTokenHashTable.tokens[0].str) != 0,
+    "no hash seed without collisions; try more seeds or slots");
+static_assert(kTokenHashTable.find("**=") == TK_POW_EQ, "");
+static_assert(kTokenHashTable.find("+") == '+', "");
+static_assert(kTokenHashTable.find("iff") == 0, "");
+
+} // namespace
+
 int stringToKind(const std::string& str) {
-  static std::once_flag init_flag;
-  static std::unordered_map<std::string, int> str_to_kind;
-  std::call_once(init_flag, []() {
-    for (char tok : std::string(valid_single_char_tokens))
-      // NOLINTNEXTLINE(bugprone-signed-char-misuse)
-      str_to_kind[std::string(1, tok)] = tok;
-#define DEFINE_CASE(tok, _, str) \
-  if (std::string(str) != "")    \
-    str_to_kind[str] = tok;
-    TC_FORALL_TOKEN_KINDS(DEFINE_CASE)
-#undef DEFINE_CASE
-  });
-  try {
-    return str_to_kind.at(str);
-  } catch (std::out_of_range& err) {
+  const int kind = kTokenHashTable.find(str);
+  if (kind == 0) {
     throw std::out_of_range("unknown token in stringToKind");
   }
+  return kind;
 }
 
 std::string kindToString(int kind) {
@@ -95,6 +154,29 @@ std::string kindToString(int kind) {
   }
 }
 
+TokenStream TokenStream::capture(std::shared_ptr<SourceView> source) {
+  TokenStream stream;
+  stream.source = std::move(source);
+  stream.source_ref = SourceRef(stream.source);
+  // Typical code has a token for every two or three bytes, counting NEWLINEs.
+  stream.tokens.reserve(stream.source->text().size() / 2 + 1);
+  Lexer L(stream.source, &stream.error);
+  stream.indent = L.baseIndent();
+  // After an error the lexer only returns EOF, but the token it was returning
+  // when the error came up is still a real one.
+  while (!L.failed()) {
+    const Token t = L.next();
+    stream.tokens.push_back(
+        {static_cast<uint32_t>(t.range.start()),
+         static_cast<uint32_t>(t.range.size()),
+         t.kind});
+    if (t.kind == TK_EOF) {
+      break;
+    }
+  }
+  return stream;
+}
+
 SharedParserData& sharedParserData() {
   static SharedParserData data; // safely handles multi-threaded init
   return data;
@@ -3,15 +3,26 @@
 #include <algorithm>
 #include <cassert>
 #include <clocale>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <vector>
+#include "minipy/jitparse/diagnostic.h"
+#include "minipy/jitparse/number_literal.h"
 #include "minipy/jitparse/parser_constants.h"
 #include "minipy/jitparse/source_range.h"
 #include "minipy/jitparse/strtod.h"
 
+#if defined(__GNUC__) || defined(__clang__)
+#define MINIPY_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define MINIPY_ALWAYS_INLINE
+#endif
+
 namespace minipy {
 
 // single character tokens are just the character itself '+'
@@ -130,10 +141,17 @@ enum TokenKind {
 #undef DEFINE_TOKEN
 };
 
+// One more than the largest token kind, to size tables indexed by kind.
+#define COUNT_TOKEN(tok, _, _2) +1
+constexpr int kNumTokenKinds =
+    TK_DUMMY_START + 1 TC_FORALL_TOKEN_KINDS(COUNT_TOKEN);
+#undef COUNT_TOKEN
+
 std::string kindToString(int kind);
 int stringToKind(const std::string& str);
 
-// nested hash tables that indicate char-by-char what is a valid token.
+// nested hash tables that indicate char-by-char what is a valid token. Only
+// used to build SharedParserData's token DFA.
 struct TokenTrie;
 using TokenTrieRef = std::unique_ptr<TokenTrie>;
 struct TokenTrie {
@@ -163,26 +181,75 @@ struct TokenTrie {
   std::vector<TokenTrieRef> child_tries;
 };
 
+// The precedence of every operator token, indexed by kind, or 0 for kinds
+// that aren't operators of that sort. Operators with a higher precedence bind
+// tighter. The parser looks these up for every token that may follow an
+// expression, so they're plain arrays rather than hash maps.
+struct PrecedenceTable {
+  uint8_t binary[kNumTokenKinds] = {};
+  uint8_t unary[kNumTokenKinds] = {};
+};
+
+constexpr PrecedenceTable makePrecedenceTable() {
+  PrecedenceTable t;
+  t.binary[TK_IF] = 1;
+  t.binary[TK_FOR] = 1;
+  t.binary[TK_AND] = 2;
+  t.binary[TK_OR] = 2;
+  // reserve a level for unary not
+  t.binary[TK_IN] = 4;
+  t.binary[TK_NOTIN] = 4;
+  t.binary['<'] = 4;
+  t.binary['>'] = 4;
+  t.binary[TK_IS] = 4;
+  t.binary[TK_ISNOT] = 4;
+  t.binary[TK_EQ] = 4;
+  t.binary[TK_LE] = 4;
+  t.binary[TK_GE] = 4;
+  t.binary[TK_NE] = 4;
+  t.binary['|'] = 5;
+  t.binary['^'] = 6;
+  t.binary['&'] = 7;
+  t.binary[TK_LSHIFT] = 8;
+  t.binary[TK_RSHIFT] = 8;
+  t.binary['+'] = 9;
+  t.binary['-'] = 9;
+  t.binary['*'] = 10;
+  t.binary['/'] = 10;
+  t.binary[TK_FLOOR_DIV] = 10;
+  t.binary['%'] = 10;
+  t.binary['@'] = 10;
+  t.binary[TK_POW] = 11;
+
+  t.unary[TK_NOT] = 3;
+  t.unary['~'] = 3;
+  t.unary['-'] = 10;
+  t.unary['*'] = 10;
+  return t;
+}
+
 // stuff that is shared against all TC lexers/parsers and is initialized only
 // once.
 struct SharedParserData {
-  SharedParserData() : head(new TokenTrie()) {
-    std::stringstream ss;
+  SharedParserData() {
+    TokenTrie trie;
     for (const char* c = valid_single_char_tokens; *c; c++) {
       std::string str(1, *c);
-      head->insert(str.c_str(), *c);
+      trie.insert(str.c_str(), *c);
     }
 
-#define ADD_CASE(tok, _, tokstring)   \
-  if (*(tokstring) != '\0') {         \
-    head->insert((tokstring), (tok)); \
+#define ADD_CASE(tok, _, tokstring)  \
+  if (*(tokstring) != '\0') {        \
+    trie.insert((tokstring), (tok)); \
   }
     TC_FORALL_TOKEN_KINDS(ADD_CASE)
 #undef ADD_CASE
+    buildTables(trie);
   }
 
   // find the longest match of str.substring(pos) against a token, return true
-  // if successful filling in kind, start,and len
+  // if successful filling in kind, start,and len. If the token is a
+  // TK_NUMBER, its value is stored in `number` (if given).
   bool match(
       std::string_view str,
       size_t pos,
@@ -191,30 +258,39 @@ struct SharedParserData {
       bool whitespace_token, // should we treat whitespace as a token
       int* kind,
       size_t* start,
-      size_t* len) {
-    *start = pos;
-    // skip whitespace
-    while (pos < str.size() && isblank(str[pos]))
-      pos++;
-
-    // special handling
-    if (pos < str.size()) {
+      size_t* len,
+      NumberLiteral* number = nullptr) {
+    // Skip blanks, comments, line continuations and newlines in a single
+    // forward pass. Each of the `continue`s restarts the scan right after the
+    // thing it skipped, so *start ends up at the first character that wasn't
+    // skipped as part of a comment, continuation or newline.
+    while (true) {
+      *start = pos;
+      // skip whitespace
+      while (pos < str.size() && isblank(str[pos]))
+        pos++;
+      if (pos == str.size()) {
+        break;
+      }
       if (str[pos] == '#' && !isTypeComment(str, pos)) {
-        // skip comments
-        while (pos < str.size() && str[pos] != '\n')
-          pos++;
-        // tail call, handle whitespace and more comments
-        return match(
-            str, pos, continuation, whitespace_token, kind, start, len);
+        // skip comments, then handle whitespace and more comments
+        const void* eol =
+            std::memchr(str.data() + pos, '\n', str.size() - pos);
+        pos = eol ? static_cast<const char*>(eol) - str.data() : str.size();
+        continue;
       }
       if (str[pos] == '\\' && pos + 1 < str.size() && str[pos + 1] == '\n' &&
           !whitespace_token) {
-        return match(str, pos + 2, continuation, false, kind, start, len);
+        pos += 2;
+        whitespace_token = false;
+        continue;
       }
       if (str[pos] == '\n') {
-        return match(
-            str, pos + 1, continuation, !continuation, kind, start, len);
+        pos += 1;
+        whitespace_token = !continuation;
+        continue;
       }
+      break;
     }
     // we handle white space before EOF because in the case we have something
     // like the following where we need to generate the dedent token if foo:
@@ -235,7 +311,7 @@ struct SharedParserData {
     // invariant: the next token is not whitespace or newline
     *start = pos;
     // check for a valid number
-    if (isNumber(str, pos, len)) {
+    if (isNumber(str, pos, len, number)) {
       *kind = TK_NUMBER;
       return true;
     }
@@ -245,42 +321,51 @@ struct SharedParserData {
       return true;
     }
 
-    // check for either an ident or a token
-    // ident tracks whether what we have scanned so far could be an identifier
-    // matched indicates if we have found any match.
-    bool matched = false;
-    bool ident = true;
-    TokenTrie* cur = head.get();
-    for (size_t i = 0; pos + i < str.size() && (ident || cur != nullptr); i++) {
-      ident = ident && validIdent(i, str[pos + i]);
-      if (ident) {
-        matched = true;
-        *len = i + 1;
-        *kind = TK_IDENT;
+    // check for either an ident or a token, taking the longer of the two.
+    // On a tie the token wins, so that e.g. 'if' is TK_IF rather than the
+    // identifier 'if' (but 'iffy' is an identifier).
+    size_t ident_len = 0;
+    if (charIs(str[pos], kIdentStart)) {
+      ident_len = 1;
+      while (pos + ident_len < str.size() &&
+             charIs(str[pos + ident_len], kIdentChar)) {
+        ident_len++;
       }
-      // check for token second, so that e.g. 'max' matches the token TK_MAX
-      // rather the
-      // identifier 'max'
-      if (cur) {
-        const auto begin_it = cur->child_chars.begin();
-        const auto end_it = cur->child_chars.end();
-        const auto ch_it = std::find(begin_it, end_it, str[pos + i]);
-
-        cur = (ch_it == end_it) ? nullptr
-                                : cur->child_tries[ch_it - begin_it].get();
-
-        if (cur && cur->kind != 0) {
-          matched = true;
-          *len = i + 1;
-          *kind = cur->kind;
-        }
+    }
+    size_t token_len = 0;
+    int token_kind = 0;
+    size_t state = kStartState;
+    for (size_t i = 0; pos + i < str.size(); i++) {
+      state = token_transitions_
+          [state * num_classes_ +
+           char_class_[static_cast<unsigned char>(str[pos + i])]];
+      if (state == kDeadState) {
+        break;
+      }
+      if (token_accept_[state] != 0) {
+        token_len = i + 1;
+        token_kind = token_accept_[state];
       }
     }
-    return matched;
+    if (token_len == 0 && ident_len == 0) {
+      return false;
+    }
+    if (token_len >= ident_len) {
+      *len = token_len;
+      *kind = token_kind;
+    } else {
+      *len = ident_len;
+      *kind = TK_IDENT;
+    }
+    return true;
   }
 
-  bool isUnary(int kind, int* prec);
-  bool isBinary(int kind, int* prec);
+  bool isUnary(int kind, int* prec) const {
+    return lookupPrecedence(kPrecedence.unary, kind, prec);
+  }
+  bool isBinary(int kind, int* prec) const {
+    return lookupPrecedence(kPrecedence.binary, kind, prec);
+  }
   bool isRightAssociative(int kind) {
     switch (kind) {
       case '?':
@@ -292,31 +377,49 @@ struct SharedParserData {
   }
 
  private:
-  bool validIdent(size_t i, char n) {
-    return isalpha(n) || n == '_' || (i > 0 && isdigit(n));
+  static constexpr PrecedenceTable kPrecedence = makePrecedenceTable();
+  static bool lookupPrecedence(
+      const uint8_t (&table)[kNumTokenKinds],
+      int kind,
+      int* prec) {
+    if (kind < 0 || kind >= kNumTokenKinds || table[kind] == 0) {
+      return false;
+    }
+    *prec = table[kind];
+    return true;
+  }
+
+  enum CharFlags : uint8_t {
+    kIdentStart = 1, // [A-Za-z_]
+    kIdentChar = 2, // [A-Za-z0-9_]
+    kBlank = 4, // whitespace other than '\n'
+  };
+  static constexpr size_t kDeadState = 0;
+  static constexpr size_t kStartState = 1;
+
+  // Compile `trie` into the token DFA and fill in the character tables.
+  void buildTables(const TokenTrie& trie);
+
+  bool charIs(char c, uint8_t flag) const {
+    return char_flags_[static_cast<unsigned char>(c)] & flag;
   }
 
   // 1. skip whitespace
   // 2. handle comment or newline
   //
-  bool isNumber(std::string_view str, size_t start, size_t* len) {
+  bool isNumber(
+      std::string_view str,
+      size_t start,
+      size_t* len,
+      NumberLiteral* number) {
     char first = str[start];
-    // strtod allows numbers to start with + or - or nan or inf
-    // http://en.cppreference.com/w/cpp/string/byte/strtof
-    // but we want only the number part, otherwise 1+3 will turn into two
-    // adjacent numbers in the lexer
-    if (first == '-' || first == '+' || isalpha(first))
+    // numbers start with a digit or '.'. In particular, unlike strtod we don't
+    // accept + or - or nan or inf, otherwise 1+3 will turn into two adjacent
+    // numbers in the lexer
+    if (!(first >= '0' && first <= '9') && first != '.')
       return false;
-    const char* startptr = str.data() + start;
-    // NOLINTNEXTLINE(cppcoreguidelines-init-variables)
-    char* endptr;
-    minipy::strtod_c(startptr, &endptr);
-    *len = endptr - startptr;
-    // check if the number is complex valued
-    // access is safe because string is assumed to be null terminated
-    if (endptr != nullptr && *endptr == 'j') {
-      *len += 1;
-    }
+    NumberLiteral scratch;
+    *len = scanNumber(str.substr(start), number ? number : &scratch);
     return *len > 0;
   }
 
@@ -358,20 +461,26 @@ struct SharedParserData {
     return end < str.size();
   }
 
-  bool isblank(int n) {
-    return isspace(n) && n != '\n';
+  bool isblank(char n) {
+    return charIs(n, kBlank);
   }
   // Make an exception ignoring comments for type annotation comments
   bool isTypeComment(std::string_view str, size_t pos) {
-    const std::string type_string = "# type:";
-    if (str.size() < pos + type_string.length()) {
-      return false;
-    }
-    auto match_string = str.substr(pos, type_string.size());
-    return match_string == type_string;
+    constexpr std::string_view type_string = "# type:";
+    return str.substr(pos, type_string.size()) == type_string;
   }
 
-  TokenTrieRef head;
+  // The fixed-spelling tokens (keywords and operators) as a DFA over byte
+  // classes. Bytes that occur in some token get their own class and all other
+  // bytes share class 0, which always leads to kDeadState. The next state is
+  // token_transitions_[state * num_classes_ + char_class_[byte]], and
+  // token_accept_[state] is the kind of the token ending in `state`, or 0.
+  uint8_t char_class_[256] = {};
+  size_t num_classes_ = 1;
+  std::vector<uint16_t> token_transitions_;
+  std::vector<int> token_accept_;
+  // CharFlags for each byte, in the "C" locale.
+  uint8_t char_flags_[256] = {};
 };
 
 SharedParserData& sharedParserData();
@@ -388,24 +497,175 @@ struct Token {
   }
 };
 
+// FIFO of the lexer's lookahead tokens. Usually only one or two tokens are
+// queued (more only for a NEWLINE followed by several DEDENTs), so this is a
+// power-of-two ring buffer that allocates only when it has to grow. Popping
+// the front is O(1), unlike erasing from the front of a std::vector.
+struct TokenQueue {
+  size_t size() const {
+    return size_;
+  }
+  Token& operator[](size_t i) {
+    return slots_[(head_ + i) & (slots_.size() - 1)];
+  }
+  Token& front() {
+    return (*this)[0];
+  }
+  template <typename... Args>
+  void emplace_back(Args&&... args) {
+    if (size_ == slots_.size()) {
+      grow();
+    }
+    (*this)[size_] = Token(std::forward<Args>(args)...);
+    ++size_;
+  }
+  Token pop_front() {
+    Token r = std::move(front());
+    head_ = (head_ + 1) & (slots_.size() - 1);
+    --size_;
+    return r;
+  }
+  void clear() {
+    head_ = 0;
+    size_ = 0;
+  }
+
+ private:
+  void grow() {
+    const size_t capacity = std::max<size_t>(8, slots_.size() * 2);
+    std::vector<Token> slots;
+    slots.reserve(capacity);
+    for (size_t i = 0; i < size_; ++i) {
+      slots.push_back(std::move((*this)[i]));
+    }
+    slots.resize(capacity, Token(0, SourceRange()));
+    slots_ = std::move(slots);
+    head_ = 0;
+  }
+
+  std::vector<Token> slots_;
+  size_t head_ = 0;
+  size_t size_ = 0;
+};
+
+// A token as stored in a TokenStream: its kind and where it is in the source.
+// The value of a TK_NUMBER is scanned again when the token is replayed.
+struct PackedToken {
+  uint32_t start;
+  uint32_t length;
+  int32_t kind;
+};
+
+// Every token a Lexer returns for a source, including NEWLINE, INDENT and
+// DEDENT, in one flat array. A Lexer (and so a Parser) can replay it instead
+// of lexing the source again: lex once and parse many times, or lex on one
+// thread and parse on another. A stream is immutable once captured, so any
+// number of lexers can replay it at once.
+struct TokenStream {
+  // Lexes all of `source`. A syntax error doesn't throw: it ends the stream
+  // and is kept in `error`, to be reported when a replay gets there.
+  static TokenStream capture(std::shared_ptr<SourceView> source);
+
+  std::shared_ptr<SourceView> source;
+  // Keeps `source` registered for as long as the stream is around.
+  SourceRef source_ref;
+  // The indentation of the first line, see Lexer::baseIndent().
+  int indent = 0;
+  // Ends with TK_EOF, unless there's an error.
+  std::vector<PackedToken> tokens;
+  Diagnostic error;
+};
+
 struct Lexer {
-  explicit Lexer(std::shared_ptr<SourceView> source)
+  // Syntax errors are thrown as ParseError, unless `errors` is given: then the
+  // first one is stored there instead, and the lexer acts as if the source
+  // ended right at the error. Code that goes on parsing sees nothing but EOF
+  // tokens from there on, so it unwinds quickly without an exception.
+  explicit Lexer(
+      std::shared_ptr<SourceView> source,
+      Diagnostic* errors = nullptr)
       : source(std::move(source)),
+        source_ref(this->source),
+        source_id(source_ref.id()),
         pos(0),
         nesting(0),
         indent_stack(),
         next_tokens(),
-        shared(sharedParserData()) {
+        shared(sharedParserData()),
+        errors(errors) {
     auto first_indent = lexRaw(true);
     indent_stack.push_back(first_indent.range.size());
     lex();
   }
+
+  // Enough of the lexer's state to carry on lexing from a point in the
+  // middle of a source, as if everything before it had just been lexed.
+  struct ResumePoint {
+    size_t pos;
+    std::vector<int> indent_stack;
+  };
+  // Starts lexing at `at`, e.g. to come back to a block that was skipped.
+  Lexer(
+      std::shared_ptr<SourceView> source,
+      const ResumePoint& at,
+      Diagnostic* errors = nullptr)
+      : source(std::move(source)),
+        source_ref(this->source),
+        source_id(source_ref.id()),
+        pos(at.pos),
+        nesting(0),
+        indent_stack(at.indent_stack),
+        next_tokens(),
+        shared(sharedParserData()),
+        errors(errors) {
+    lex();
+  }
+  // Replays `tokens` rather than lexing their source again. It returns the
+  // same tokens, and reports the same error at the same point, as a lexer
+  // for the source would.
+  explicit Lexer(
+      std::shared_ptr<const TokenStream> tokens,
+      Diagnostic* errors = nullptr)
+      : source(tokens->source),
+        source_ref(tokens->source_ref),
+        source_id(source_ref.id()),
+        pos(0),
+        nesting(0),
+        indent_stack{tokens->indent},
+        next_tokens(),
+        shared(sharedParserData()),
+        errors(errors),
+        replay(std::move(tokens)) {
+    lex();
+  }
+  bool replaying() const {
+    return replay != nullptr;
+  }
+  // Where lexing continues after the current token. Only available outside
+  // of brackets, and when nothing past the current token was lexed yet.
+  // Never available while replaying, since a replay can't jump ahead.
+  std::optional<ResumePoint> resumePointAfterCur() const {
+    if (replay || nesting != 0 || next_tokens.size() != 1) {
+      return std::nullopt;
+    }
+    return ResumePoint{pos, indent_stack};
+  }
+  // The indentation of top-level statements, which needn't be zero (see the
+  // constructor).
+  int baseIndent() const {
+    return indent_stack.front();
+  }
+
   // Return the current token, and then move to the next one
   Token next() {
-    if (next_tokens.size() == 0)
-      reportError("Lexer invariant violated: empty token queue");
-    Token r = std::move(next_tokens.front());
-    next_tokens.erase(next_tokens.begin());
+    if (next_tokens.size() == 0) {
+      Diagnostic error;
+      error.code = ParseErrorCode::INTERNAL;
+      error.range = SourceRange(source_id, pos, pos);
+      error.what = "Lexer invariant violated: empty token queue";
+      report(std::move(error));
+    }
+    Token r = next_tokens.pop_front();
     if (next_tokens.size() == 0) {
       lex();
     }
@@ -419,35 +679,63 @@ struct Lexer {
     return true;
   }
 
-  [[noreturn]] void reportError(const std::string& what) {
+  void reportError(const std::string& what) {
     reportError(what, cur());
   }
-  [[noreturn]] void reportError(const std::string& what, const Token& t) {
-    std::stringstream ss;
-    ss << what << ":\n";
-    t.range.highlight(ss);
-    throw std::runtime_error(ss.str());
+  void reportError(
+      const std::string& what,
+      const Token& t,
+      ParseErrorCode code = ParseErrorCode::INVALID_SYNTAX) {
+    Diagnostic error;
+    error.code = code;
+    error.range = t.range;
+    error.what = what;
+    report(std::move(error));
   }
-  [[noreturn]] void expected(const std::string& what, const Token& t) {
-    std::stringstream ss;
-    ss << "expected " << what << " but found '" << t.kindString()
-       << "' here:\n";
-    t.range.highlight(ss);
-    throw std::runtime_error(ss.str());
+  void expected(const std::string& what, const Token& t) {
+    Diagnostic error;
+    error.code = ParseErrorCode::UNEXPECTED_TOKEN;
+    error.range = t.range;
+    error.found = t.kind;
+    error.what = what;
+    report(std::move(error));
   }
-  [[noreturn]] void expected(const std::string& what) {
+  void expected(const std::string& what) {
     expected(what, cur());
   }
   // Check that the current token has a given kind, return the current token,
   // and advance to the next one.
   Token expect(int kind) {
     if (cur().kind != kind) {
-      expected(kindToString(kind));
+      Diagnostic error;
+      error.code = ParseErrorCode::UNEXPECTED_TOKEN;
+      error.range = cur().range;
+      error.found = cur().kind;
+      error.expected = kind;
+      report(std::move(error));
     }
     return next();
   }
+  // Throws `error`, or records it if this lexer was given somewhere to.
+  void report(Diagnostic error) {
+    if (!errors) {
+      throw ParseError(std::move(error));
+    }
+    if (!*errors) {
+      *errors = std::move(error);
+    }
+    if (!stopped) {
+      stopped = true;
+      next_tokens.clear();
+      next_tokens.emplace_back(TK_EOF, SourceRange(source_id, pos, pos));
+    }
+  }
+  // Whether an error was recorded; the lexer only returns EOF since.
+  bool failed() const {
+    return stopped;
+  }
   Token& lookahead() {
-    if (next_tokens.size() < 2) {
+    while (next_tokens.size() < 2) {
       lex();
     }
     return next_tokens[1];
@@ -455,10 +743,35 @@ struct Lexer {
   Token& cur() {
     return next_tokens.front();
   }
+  // The value of `t`, a TK_NUMBER token from this lexer. The values of the
+  // last few numbers lexed are kept here rather than in every Token; older
+  // ones, and replayed tokens, are scanned again.
+  NumberLiteral number(const Token& t) {
+    const size_t start = t.range.start();
+    for (const NumberValue& n : numbers) {
+      if (n.start == start) {
+        return n.value;
+      }
+    }
+    NumberLiteral number;
+    scanNumber(source->text().substr(start), &number);
+    return number;
+  }
 
  private:
   void lex() {
+    if (stopped) {
+      next_tokens.emplace_back(TK_EOF, SourceRange(source_id, pos, pos));
+      return;
+    }
+    if (replay) {
+      replayNext();
+      return;
+    }
     auto r = lexRaw();
+    if (stopped) {
+      return;
+    }
     switch (r.kind) {
       case '(':
       case '[':
@@ -492,7 +805,11 @@ struct Lexer {
             indent_stack.pop_back();
             next_tokens.emplace_back(TK_DEDENT, r.range);
             if (indent_stack.size() == 0) {
-              reportError("invalid indent level " + std::to_string(depth), r);
+              reportError(
+                  "invalid indent level " + std::to_string(depth),
+                  r,
+                  ParseErrorCode::INVALID_INDENT);
+              return;
             }
           }
           return; // We've already queued the tokens
@@ -501,15 +818,19 @@ struct Lexer {
       default:
         break;
     }
-    next_tokens.push_back(std::move(r));
+    next_tokens.emplace_back(std::move(r));
   }
-  Token lexRaw(bool whitespace_token = false) {
+  // lex() calls this for every token. Inlined there, the Token goes straight
+  // from registers into the queue; returned from a call, it's spilled and
+  // reloaded with a wider load, which can't be forwarded from the stores.
+  MINIPY_ALWAYS_INLINE Token lexRaw(bool whitespace_token = false) {
     // NOLINTNEXTLINE(cppcoreguidelines-init-variables)
     int kind;
     // NOLINTNEXTLINE(cppcoreguidelines-init-variables)
     size_t start;
     // NOLINTNEXTLINE(cppcoreguidelines-init-variables)
     size_t length;
+    NumberLiteral number;
     // TODO better assert
     assert(source);
     if (!shared.match(
@@ -519,23 +840,61 @@ struct Lexer {
             whitespace_token,
             &kind,
             &start,
-            &length)) {
-      expected(
-          "a valid token",
-          Token(
-              (source->text())[start], SourceRange(source, start, start + 1)));
+            &length,
+            &number)) {
+      Diagnostic error;
+      error.code = ParseErrorCode::INVALID_TOKEN;
+      error.range = SourceRange(source_id, start, start + 1);
+      error.found = source->text()[start];
+      error.what = "a valid token";
+      report(std::move(error));
+      return Token(TK_EOF, SourceRange(source_id, pos, pos));
+    }
+    if (kind == TK_NUMBER) {
+      numbers[next_number++ % kNumNumberValues] = {start, number};
     }
-    auto t = Token(kind, SourceRange(source, start, start + length));
     pos = start + length;
-    return t;
+    return Token(kind, SourceRange(source_id, start, start + length));
+  }
+
+  void replayNext() {
+    if (replay_pos == replay->tokens.size()) {
+      if (replay->error) {
+        report(replay->error);
+      } else {
+        next_tokens.emplace_back(TK_EOF, SourceRange(source_id, pos, pos));
+      }
+      return;
+    }
+    const PackedToken& packed = replay->tokens[replay_pos++];
+    pos = size_t(packed.start) + packed.length;
+    next_tokens.emplace_back(
+        packed.kind, SourceRange(source_id, packed.start, pos));
   }
 
   std::shared_ptr<SourceView> source;
+  SourceRef source_ref;
+  SourceId source_id;
   size_t pos;
   size_t nesting; // depth of ( [ { nesting...
   std::vector<int> indent_stack; // stack of indentation level of blocks
   // Invariant: this should always contain at least a single element
-  std::vector<Token> next_tokens;
+  TokenQueue next_tokens;
+  // The last few TK_NUMBERs lexed, for number(). The parser asks for the
+  // value of the number it just took, which is at most a token or two back.
+  struct NumberValue {
+    size_t start = SIZE_MAX;
+    NumberLiteral value;
+  };
+  static constexpr size_t kNumNumberValues = 4;
+  NumberValue numbers[kNumNumberValues];
+  size_t next_number = 0;
   SharedParserData& shared;
+  // Where errors are recorded, or null to throw them.
+  Diagnostic* errors;
+  bool stopped = false;
+  // The stream this lexer replays, if any, and the next token to take from it.
+  std::shared_ptr<const TokenStream> replay;
+  size_t replay_pos = 0;
 };
 } // namespace minipy
@@ -0,0 +1,232 @@
+#include "minipy/jitparse/number_literal.h"
+
+#include <limits>
+
+#include "minipy/jitparse/strtod.h"
+
+namespace minipy {
+
+namespace {
+
+bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+int hexDigitValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+// Accumulates `digit` into `value`, returning false once it no longer fits.
+bool accumulate(uint64_t* value, unsigned base, unsigned digit) {
+  return !__builtin_mul_overflow(*value, base, value) &&
+      !__builtin_add_overflow(*value, digit, value);
+}
+
+// Scans a literal without a sign. `magnitude` is the absolute value of an
+// integral literal, and `fits` is false if it doesn't fit in a uint64_t.
+size_t scanUnsigned(
+    std::string_view str,
+    NumberLiteral* out,
+    uint64_t* magnitude,
+    bool* fits) {
+  *out = NumberLiteral();
+  *magnitude = 0;
+  *fits = true;
+  const char* const begin = str.data();
+  const char* const end = begin + str.size();
+  const char* p = begin;
+
+  // Hex literals. "0x" not followed by a hex digit is just the number 0.
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    const char* q = p + 2;
+    bool digits = false;
+    while (q < end && hexDigitValue(*q) >= 0) {
+      *fits = *fits && accumulate(magnitude, 16, hexDigitValue(*q));
+      q++;
+      digits = true;
+    }
+    if (q < end && *q == '.') {
+      out->isFloat = true;
+      q++;
+      while (q < end && hexDigitValue(*q) >= 0) {
+        q++;
+        digits = true;
+      }
+    }
+    if (digits) {
+      if (q < end && (*q == 'p' || *q == 'P')) {
+        const char* e = q + 1;
+        if (e < end && (*e == '+' || *e == '-')) {
+          e++;
+        }
+        if (e < end && isDigit(*e)) {
+          out->isFloat = true;
+          while (e < end && isDigit(*e)) {
+            e++;
+          }
+          q = e;
+        }
+      }
+      if (out->isFloat) {
+        // Hex floats are rare enough to leave to strtod.
+        char* strtod_end;
+        out->floatValue = strtod_c(begin, &strtod_end);
+      }
+      return q - begin;
+    }
+    *magnitude = 0;
+    *fits = true;
+    out->isFloat = false;
+  }
+
+  // Decimal literals. Collect up to 19 significant digits of the mantissa,
+  // which always fit in a uint64_t.
+  uint64_t mantissa = 0;
+  int significant = 0;
+  int64_t exp10 = 0;
+  bool digits = false;
+  while (p < end && isDigit(*p)) {
+    if (significant < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      significant += mantissa != 0;
+    } else {
+      exp10++;
+      significant++;
+    }
+    p++;
+    digits = true;
+  }
+  const char* const int_end = p;
+  if (p < end && *p == '.') {
+    out->isFloat = true;
+    p++;
+    while (p < end && isDigit(*p)) {
+      if (significant < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        significant += mantissa != 0;
+        exp10--;
+      } else {
+        significant++;
+      }
+      p++;
+      digits = true;
+    }
+  }
+  if (!digits) {
+    return 0;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* e = p + 1;
+    bool negative = false;
+    if (e < end && (*e == '+' || *e == '-')) {
+      negative = *e == '-';
+      e++;
+    }
+    if (e < end && isDigit(*e)) {
+      out->isFloat = true;
+      int64_t exponent = 0;
+      while (e < end && isDigit(*e)) {
+        if (exponent < 100000) {
+          exponent = exponent * 10 + (*e - '0');
+        }
+        e++;
+      }
+      exp10 += negative ? -exponent : exponent;
+      p = e;
+    }
+  }
+
+  if (out->isFloat) {
+    // Clinger's fast path: if the mantissa and the power of ten are both
+    // exactly representable, a single multiplication or division is correctly
+    // rounded. Everything else goes to strtod.
+    static constexpr double kPowersOfTen[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    if (significant <= 19 && mantissa <= (uint64_t(1) << 53) &&
+        exp10 >= -22 && exp10 <= 22) {
+      const double m = static_cast<double>(mantissa);
+      out->floatValue =
+          exp10 < 0 ? m / kPowersOfTen[-exp10] : m * kPowersOfTen[exp10];
+    } else {
+      char* strtod_end;
+      out->floatValue = strtod_c(begin, &strtod_end);
+    }
+  } else {
+    // Like strtoll with base 0, a leading 0 means octal, stopping at the first
+    // digit that isn't one.
+    const bool octal = begin[0] == '0';
+    for (const char* d = octal ? begin + 1 : begin; d < int_end; d++) {
+      if (octal && *d > '7') {
+        break;
+      }
+      *fits = *fits && accumulate(magnitude, octal ? 8 : 10, *d - '0');
+    }
+  }
+  return p - begin;
+}
+
+} // namespace
+
+size_t scanNumber(std::string_view str, NumberLiteral* out) {
+  uint64_t magnitude;
+  bool fits;
+  size_t len = scanUnsigned(str, out, &magnitude, &fits);
+  if (len == 0) {
+    return 0;
+  }
+  if (!out->isFloat) {
+    out->overflow =
+        !fits || magnitude > uint64_t(std::numeric_limits<int64_t>::max());
+    out->intValue = out->overflow ? 0 : static_cast<int64_t>(magnitude);
+  }
+  if (len < str.size() && str[len] == 'j') {
+    out->isImaginary = true;
+    len++;
+  }
+  return len;
+}
+
+bool parseNumber(std::string_view text, NumberLiteral* out) {
+  const bool negative = !text.empty() && text[0] == '-';
+  if (negative) {
+    text.remove_prefix(1);
+  }
+  uint64_t magnitude;
+  bool fits;
+  size_t len = scanUnsigned(text, out, &magnitude, &fits);
+  if (len == 0) {
+    return false;
+  }
+  if (len < text.size() && text[len] == 'j') {
+    out->isImaginary = true;
+    len++;
+  }
+  if (len != text.size()) {
+    return false;
+  }
+  if (out->isFloat) {
+    out->floatValue = negative ? -out->floatValue : out->floatValue;
+    return true;
+  }
+  // -2^63 fits even though 2^63 doesn't.
+  const uint64_t limit =
+      uint64_t(std::numeric_limits<int64_t>::max()) + (negative ? 1 : 0);
+  out->overflow = !fits || magnitude > limit;
+  if (!out->overflow) {
+    out->intValue = negative ? static_cast<int64_t>(0 - magnitude)
+                             : static_cast<int64_t>(magnitude);
+  }
+  return true;
+}
+
+} // namespace minipy
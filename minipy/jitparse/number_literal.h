@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace minipy {
+
+// The value of a numeric literal, computed by the lexer while it finds the
+// end of the token and then cached on the Const node.
+struct NumberLiteral {
+  // Has a decimal point or an exponent. Otherwise the literal is integral.
+  bool isFloat = false;
+  // Ends in 'j'. The value is the imaginary part.
+  bool isImaginary = false;
+  // Integral, but doesn't fit in an int64_t.
+  bool overflow = false;
+  // Only meaningful for integral literals.
+  int64_t intValue = 0;
+  // Only meaningful for floating point literals.
+  double floatValue = 0;
+};
+
+// Scans the numeric literal at the start of `str`, with the same extent that
+// strtod would accept plus an optional trailing 'j'. Returns its length, or 0
+// if `str` doesn't start with a number. Never allocates and doesn't depend on
+// the current locale.
+//
+// Integral literals follow strtoll's base-0 rules (0x for hex, a leading 0 for
+// octal), which is how Const has always interpreted them.
+//
+// `str` must be followed by a null byte or other non-numeric character, like
+// the lexer's source text.
+size_t scanNumber(std::string_view str, NumberLiteral* out);
+
+// Parses `text`, which may be negated with a leading '-'. Returns false unless
+// all of `text` is a single numeric literal.
+bool parseNumber(std::string_view text, NumberLiteral* out);
+
+} // namespace minipy
@@ -1,5 +1,10 @@
 #include "parser.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+
 #include "minipy/jitparse/lexer.h"
 #include "minipy/jitparse/parse_string_literal.h"
 #include "minipy/jitparse/tree.h"
@@ -43,16 +48,182 @@ Decl mergeTypesFromTypeComment(
       type_annotation_decl.return_type());
 }
 
+// Where the top-level statements of a module are: the offset of the first
+// token of each, the EOF token, and the indentation they're all at. That's
+// enough to resume parsing the module at any of its statements.
+struct ModuleLayout {
+  std::vector<uint32_t> starts;
+  SourceRange eof;
+  int indent = 0;
+};
+
+// The body of a module as parsed by ParserImpl, which keeps its layout around
+// for reparseModule().
+struct ModuleBody : public Compound {
+  ModuleBody(const SourceRange& range, TreeList stmts, ModuleLayout layout)
+      : Compound(TK_LIST, range),
+        stmts(std::move(stmts)),
+        layout(std::move(layout)) {
+    setStmtList();
+  }
+  const TreeList& trees() const override {
+    return stmts;
+  }
+
+  const TreeList stmts;
+  const ModuleLayout layout;
+
+ protected:
+  void share_referents() override {
+    Compound::share_referents();
+    for (const auto& t : stmts) {
+      t->share();
+    }
+  }
+};
+
+static_assert(alignof(ModuleBody) <= alignof(void*), "");
+
+// A function body that is only parsed the first time its statements are
+// needed (see ParserOptions::lazyFunctionBodies). It remembers where it
+// starts, so that reparseModule() can move it into a new version of the source
+// without parsing it.
+struct LazyBody : public LazyCompound {
+  LazyBody(
+      const SourceRange& range,
+      Lexer::ResumePoint start,
+      const ParserOptions& options)
+      : LazyCompound(TK_LIST, range, [this] { return parse(); }),
+        start(std::move(start)),
+        options(options) {
+    // parseStatements() only returns statements, so List<Stmt> doesn't need
+    // to parse the body just to check that.
+    setStmtList();
+  }
+  TreeRef parse() const;
+
+  const Lexer::ResumePoint start;
+  const ParserOptions options;
+};
+
+static_assert(alignof(LazyBody) <= alignof(void*), "");
+
+// A top-level statement that reparseModule() reused from `previous`, a
+// statement of the previous version of the source. It's a copy of `original`
+// (`previous` itself, or what that is a copy of), which was `delta` bytes from
+// where it is now. Its range is moved into the new source right away, but its
+// subtrees are only copied there the first time they're needed, so reusing a
+// statement costs the same however big it is. Until then it keeps the
+// original tree and its source alive. It always keeps `arenas`, the arenas
+// that `original` and its leaves are in, alive, since the copy shares its
+// leaves.
+struct RebasedStmt : private ArenaRefs, public LazyCompound {
+  RebasedStmt(
+      const TreeRef& original,
+      const Tree* previous,
+      SourceId source_id,
+      int64_t delta,
+      std::vector<c10::intrusive_ptr<TreeArena>> arenas)
+      : ArenaRefs{std::move(arenas)},
+        LazyCompound(
+            original->kind(),
+            SourceRange(
+                source_id,
+                original->range().start() + delta,
+                original->range().end() + delta),
+            [this] { return copy(); }),
+        previous(previous),
+        delta(delta),
+        original_source_(original->range().source_id()),
+        original_(original) {
+    // So that a SymbolTable built over `previous` finds its entry.
+    setBlockId(previous->blockId());
+  }
+  // The statement this is a copy of, or nullptr once it has been copied.
+  TreeRef original() const {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return original_;
+  }
+  TreeRef copy() const;
+  // The arenas that `stmt`, a statement of a module with `module_arenas`
+  // (see ArenaRoot::arenasOf()), and its leaves are in.
+  static std::vector<c10::intrusive_ptr<TreeArena>> arenasOf(
+      const TreeRef& stmt,
+      std::vector<c10::intrusive_ptr<TreeArena>> module_arenas) {
+    if (const auto* rebased = dynamic_cast<const RebasedStmt*>(stmt.get())) {
+      module_arenas.insert(
+          module_arenas.end(), rebased->arenas.begin(), rebased->arenas.end());
+    }
+    return module_arenas;
+  }
+
+  // Only to compare against: it may be gone by now.
+  const Tree* const previous;
+  const int64_t delta;
+
+ protected:
+  void share_referents() override {
+    for (const auto& arena : arenas) {
+      arena->share();
+    }
+    LazyCompound::share_referents();
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (original_) {
+      original_->share();
+    }
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  // Declared first, so that it's released after the tree in it.
+  mutable SourceRef original_source_;
+  mutable TreeRef original_;
+};
+
+static_assert(alignof(RebasedStmt) <= alignof(void*), "");
+
 struct ParserImpl {
-  explicit ParserImpl(const std::shared_ptr<SourceView>& source)
-      : L(source), shared(sharedParserData()) {}
+  ParserImpl(
+      const std::shared_ptr<SourceView>& source,
+      const ParserOptions& options)
+      : L(source, &error), options(options), shared(sharedParserData()) {
+    if (options.useArena) {
+      arena = c10::make_intrusive<TreeArena>();
+    }
+  }
+  // Parses a replay of `tokens`.
+  ParserImpl(
+      std::shared_ptr<const TokenStream> tokens,
+      const ParserOptions& options)
+      : L(std::move(tokens), &error),
+        options(options),
+        shared(sharedParserData()) {
+    if (options.useArena) {
+      arena = c10::make_intrusive<TreeArena>();
+    }
+  }
+  // Parses from the middle of `source`, for lazily parsed function bodies.
+  ParserImpl(
+      const std::shared_ptr<SourceView>& source,
+      const Lexer::ResumePoint& at,
+      const ParserOptions& options)
+      : L(source, at, &error), options(options), shared(sharedParserData()) {}
 
   Ident parseIdent() {
     auto t = L.expect(TK_IDENT);
     // whenever we parse something that has a TreeView type we always
     // use its create method so that the accessors and the constructor
     // of the Compound tree are in the same place.
-    return Ident::create(t.range, t.text());
+    // Intern straight from the source text to avoid a temporary string, and
+    // only take the global interning lock once per distinct name. Threads
+    // parsing a module in parallel would otherwise all contend on it.
+    const std::string_view name =
+        t.range.source()->text().substr(t.range.start(), t.range.size());
+    auto it = symbols.find(name);
+    if (it == symbols.end()) {
+      it = symbols.emplace(name, Symbol(name)).first;
+    }
+    return Ident::create(t.range, it->second);
   }
   TreeRef createApply(const Expr& expr) {
     TreeList attributes;
@@ -140,8 +311,9 @@ struct ParserImpl {
         } else {
           for (auto se : list) {
             if (se.kind() == TK_LIST_COMP) {
-              throw ErrorReport(list.range())
-                  << " expected a single list comprehension within '[' , ']'";
+              reportError(
+                  "expected a single list comprehension within '[' , ']'",
+                  list.range());
             }
           }
           prefix = ListLiteral::create(list.range(), List<Expr>(list));
@@ -339,9 +511,8 @@ struct ParserImpl {
   }
 
   Const parseConst() {
-    auto range = L.cur().range;
     auto t = L.expect(TK_NUMBER);
-    return Const::create(t.range, t.text());
+    return Const::create(t.range, t.text(), L.number(t));
   }
 
   StringLiteral parseConcatenatedStringLiterals() {
@@ -413,7 +584,7 @@ struct ParserImpl {
         parseList('[', ',', ']', &ParserImpl::parseSubscriptExp);
 
     const auto whole_range =
-        SourceRange(range.source(), range.start(), L.cur().range.start());
+        SourceRange(range.source_id(), range.start(), L.cur().range.start());
     return Subscript::create(whole_range, Expr(value), subscript_exprs);
   }
 
@@ -492,8 +663,9 @@ struct ParserImpl {
           rhs = parseExpOrExpTuple();
         }
         if (type.present() && lhs_list.size() > 1) {
-          throw ErrorReport(type.range())
-              << "Annotated multiple assignment is not supported in python";
+          reportError(
+              "Annotated multiple assignment is not supported in python",
+              type.range());
         }
         L.expect(TK_NEWLINE);
         return Assign::create(
@@ -505,16 +677,18 @@ struct ParserImpl {
         L.expect(TK_NEWLINE);
         // this is an augmented assignment
         if (lhs.kind() == TK_TUPLE_LITERAL) {
-          throw ErrorReport(lhs.range())
-              << " augmented assignment can only have one LHS expression";
+          reportError(
+              "augmented assignment can only have one LHS expression",
+              lhs.range());
         }
         return AugAssign::create(
             lhs.range(), lhs, AugAssignKind(*maybeOp), Expr(rhs));
       }
     } else {
       // There is no assignment operator, so this is of the form `lhs : <type>`
-      // TODO better assert
-      assert(type.present());
+      if (!type.present()) {
+        L.expected("an assignment or the end of the statement");
+      }
       L.expect(TK_NEWLINE);
       return Assign::create(
           lhs.range(),
@@ -678,19 +852,350 @@ struct ParserImpl {
     TreeList stmts;
     do {
       stmts.push_back(parseStmt(in_class));
-    } while (!L.nextIf(TK_DEDENT));
-    return create_compound(TK_LIST, r, std::move(stmts));
+    } while (!L.nextIf(TK_DEDENT) && !L.failed());
+    auto list = create_compound(TK_LIST, r, std::move(stmts));
+    list->setStmtList();
+    return list;
   }
 
   Mod parseModule() {
+    if (options.parallelism > 1 && !L.replaying()) {
+      if (auto module = parseModuleInParallel()) {
+        return *module;
+      }
+    }
     auto r = L.cur().range;
     TreeList stmts;
+    ModuleLayout layout;
     do {
+      layout.starts.push_back(L.cur().range.start());
       stmts.push_back(parseStmt(false));
     } while (!L.nextIf(TK_EOF));
-    TreeRef stmts_list =
-        create_compound(TK_LIST, L.cur().range, std::move(stmts));
-    return Mod::create(r, List<Stmt>(stmts_list));
+    layout.eof = L.cur().range;
+    const SourceRange range = mergeRanges(layout.eof, stmts);
+    return createModule(r, range, std::move(stmts), std::move(layout));
+  }
+
+  Mod createModule(
+      const SourceRange& first,
+      const SourceRange& range,
+      TreeList&& stmts,
+      ModuleLayout&& layout) {
+    layout.indent = L.baseIndent();
+    TreeRef body = c10::make_intrusive<ModuleBody>(
+        range, std::move(stmts), std::move(layout));
+    return Mod::create(first, List<Stmt>(body));
+  }
+
+  // Splits the module into runs of top-level statements with a quick pass of
+  // the lexer, and parses those on up to `options.parallelism` threads, each
+  // with its own Lexer (and TreeArena). Returns nullopt if the module is too
+  // small to be worth it, or if there is any error: parsing it again in order
+  // reports the same error the sequential parser would.
+  std::optional<Mod> parseModuleInParallel() {
+    static constexpr size_t kMinSegmentBytes = 64 * 1024;
+    const SourceId source_id = L.cur().range.source_id();
+    const auto& source = source_for_id(source_id);
+    const size_t target_bytes = std::max(
+        kMinSegmentBytes, source->text().size() / (options.parallelism * 4));
+    if (source->text().size() < 2 * target_bytes) {
+      return std::nullopt;
+    }
+
+    // Segment i + 1 starts at starts[i]. A segment can only start right after
+    // a NEWLINE or DEDENT back at the module's indentation, and not at an
+    // `else` or `elif` that continues the statement before it.
+    std::vector<Lexer::ResumePoint> starts;
+    SourceRange first, eof;
+    try {
+      Lexer scan(source);
+      first = scan.cur().range;
+      size_t next_split = target_bytes;
+      while (scan.cur().kind != TK_EOF) {
+        std::optional<Lexer::ResumePoint> split;
+        const int kind = scan.cur().kind;
+        if ((kind == TK_NEWLINE || kind == TK_DEDENT) &&
+            scan.cur().range.end() >= next_split) {
+          split = scan.resumePointAfterCur();
+          if (split && split->indent_stack.size() != 1) {
+            split.reset();
+          }
+        }
+        scan.next();
+        const int following = scan.cur().kind;
+        if (split && following != TK_EOF && following != TK_ELSE &&
+            following != TK_ELIF) {
+          starts.push_back(std::move(*split));
+          next_split = starts.back().pos + target_bytes;
+        }
+      }
+      eof = scan.cur().range;
+    } catch (const std::exception&) {
+      return std::nullopt;
+    }
+    if (starts.empty()) {
+      return std::nullopt;
+    }
+
+    // Each worker allocates from its own arena, if any. Declared before the
+    // trees in them, so that they outlive those if parsing fails.
+    ParserOptions segment_options = options;
+    segment_options.useArena = false;
+    const size_t num_segments = starts.size() + 1;
+    const size_t num_threads = std::min(options.parallelism, num_segments);
+    std::vector<c10::intrusive_ptr<TreeArena>> arenas(num_threads);
+    std::vector<TreeList> segments(num_segments);
+    std::vector<std::vector<uint32_t>> segment_starts(num_segments);
+    std::atomic<size_t> next_segment{0};
+    std::atomic<bool> failed{false};
+    auto work = [&](size_t thread) {
+      if (options.useArena) {
+        arenas[thread] = c10::make_intrusive<TreeArena>();
+      }
+      TreeArena::Scope scope(arenas[thread]);
+      Tree::SourceScope source_scope(source_id);
+      size_t i;
+      while (!failed && (i = next_segment++) < num_segments) {
+        try {
+          auto p = i == 0
+              ? std::make_unique<ParserImpl>(source, segment_options)
+              : std::make_unique<ParserImpl>(
+                    source, starts[i - 1], segment_options);
+          const size_t end =
+              i < starts.size() ? starts[i].pos : source->text().size() + 1;
+          while (p->L.cur().kind != TK_EOF &&
+                 p->L.cur().range.start() < end) {
+            segment_starts[i].push_back(p->L.cur().range.start());
+            segments[i].push_back(p->parseStmt(false));
+          }
+          if (p->error) {
+            failed = true;
+          }
+        } catch (const std::exception&) {
+          failed = true;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < num_threads; t++) {
+      threads.emplace_back(work, t);
+    }
+    work(0);
+    // Joining hands the trees over to this thread, so they don't need to be
+    // share()d: the threads that created them are gone.
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    if (failed) {
+      return std::nullopt;
+    }
+    for (auto& arena : arenas) {
+      if (arena) {
+        worker_arenas.push_back(std::move(arena));
+      }
+    }
+
+    TreeList stmts;
+    ModuleLayout layout;
+    for (size_t i = 0; i < num_segments; i++) {
+      stmts.insert(
+          stmts.end(),
+          std::make_move_iterator(segments[i].begin()),
+          std::make_move_iterator(segments[i].end()));
+      layout.starts.insert(
+          layout.starts.end(),
+          segment_starts[i].begin(),
+          segment_starts[i].end());
+    }
+    layout.eof = eof;
+    const SourceRange range = mergeRanges(eof, stmts);
+    return createModule(first, range, std::move(stmts), std::move(layout));
+  }
+
+  // The layout of a module that wasn't parsed by a ParserImpl (e.g. one loaded
+  // from an AstCache), found by lexing its source again.
+  static ModuleLayout scanLayout(const std::shared_ptr<SourceView>& source) {
+    Lexer scan(source);
+    ModuleLayout layout;
+    layout.indent = scan.baseIndent();
+    size_t depth = 0;
+    bool at_start = true;
+    while (scan.cur().kind != TK_EOF) {
+      const int kind = scan.cur().kind;
+      if (at_start && kind != TK_ELSE && kind != TK_ELIF) {
+        layout.starts.push_back(scan.cur().range.start());
+      }
+      if (kind == TK_INDENT) {
+        depth++;
+      } else if (kind == TK_DEDENT) {
+        depth--;
+      }
+      at_start = depth == 0 && (kind == TK_NEWLINE || kind == TK_DEDENT);
+      scan.next();
+    }
+    layout.eof = scan.cur().range;
+    return layout;
+  }
+
+  Mod reparseModule(const Mod& previous, const TextEdit& edit) {
+    const SourceId source_id = L.cur().range.source_id();
+    const auto& source = source_for_id(source_id);
+    const std::string_view text = source->text();
+    const std::string_view old_text = previous.range().source()->text();
+    const size_t edit_end = edit.offset + edit.inserted.size();
+    if (edit.offset > old_text.size() ||
+        edit.removed > old_text.size() - edit.offset ||
+        text.size() + edit.removed != old_text.size() + edit.inserted.size() ||
+        text.substr(0, edit.offset) != old_text.substr(0, edit.offset) ||
+        text.substr(edit.offset, edit.inserted.size()) != edit.inserted ||
+        text.substr(edit_end) != old_text.substr(edit.offset + edit.removed)) {
+      throw std::runtime_error(
+          "reparseModule: the edit doesn't match the source text");
+    }
+    // Offsets of old statements after the edit, plus delta, are new offsets.
+    const int64_t delta =
+        int64_t(edit.inserted.size()) - int64_t(edit.removed);
+
+    const TreeList& old_stmts = previous.body().get()->trees();
+    const auto old_arenas = ArenaRoot::arenasOf(previous.get());
+    const auto* old_body =
+        dynamic_cast<const ModuleBody*>(previous.body().get().get());
+    const ModuleLayout old = old_body
+        ? old_body->layout
+        : scanLayout(previous.range().source());
+    if (old.starts.size() != old_stmts.size()) {
+      return parseModule();
+    }
+
+    // Statements that start before the edit are unchanged, except that the
+    // last of them may run into it. And if an `else` or `elif` now starts
+    // where a statement used to, that one joins the statement before it.
+    size_t first =
+        std::lower_bound(old.starts.begin(), old.starts.end(), edit.offset) -
+        old.starts.begin();
+    first = first > 0 ? first - 1 : 0;
+    std::unique_ptr<ParserImpl> resumed;
+    ParserImpl* p = this;
+    for (; first > 0; first--) {
+      resumed = std::make_unique<ParserImpl>(
+          source,
+          Lexer::ResumePoint{old.starts[first], {old.indent}},
+          options);
+      const int kind = resumed->L.cur().kind;
+      if (kind != TK_ELSE && kind != TK_ELIF) {
+        p = resumed.get();
+        break;
+      }
+    }
+
+    TreeList stmts;
+    for (size_t i = 0; i < first; i++) {
+      stmts.push_back(rebaseStmt(old_stmts[i], source_id, 0, old_arenas));
+    }
+    ModuleLayout layout;
+    layout.starts.assign(old.starts.begin(), old.starts.begin() + first);
+    // Parse until we're past the edit and at a statement that also started a
+    // statement before it: the text and lexer state from there on are the
+    // same as back then, so the rest of the old statements are too.
+    size_t reused = old_stmts.size();
+    const bool same_indent = L.baseIndent() == old.indent;
+    while (p->L.cur().kind != TK_EOF) {
+      const size_t start = p->L.cur().range.start();
+      if (same_indent && start >= edit_end) {
+        const auto it = std::lower_bound(
+            old.starts.begin() + first, old.starts.end(), start - delta);
+        if (it != old.starts.end() && *it == start - delta) {
+          reused = it - old.starts.begin();
+          break;
+        }
+      }
+      layout.starts.push_back(start);
+      stmts.push_back(p->parseStmt(false));
+    }
+    if (p->error) {
+      // The caller reports it, as for any other syntax error.
+      if (p != this) {
+        error = std::move(p->error);
+      }
+      return previous;
+    }
+    if (stmts.empty() && reused == old_stmts.size()) {
+      // Nothing but whitespace and comments; report it like parseModule().
+      return parseModule();
+    }
+
+    if (reused < old_stmts.size()) {
+      for (size_t i = reused; i < old_stmts.size(); i++) {
+        stmts.push_back(
+            rebaseStmt(old_stmts[i], source_id, delta, old_arenas));
+        layout.starts.push_back(old.starts[i] + delta);
+      }
+      layout.eof = SourceRange(
+          source_id, old.eof.start() + delta, old.eof.end() + delta);
+    } else {
+      layout.eof = p->L.cur().range;
+    }
+    const SourceRange first_token(
+        source_id, layout.starts.front(), layout.starts.front());
+    const SourceRange range = mergeRanges(layout.eof, stmts);
+    return createModule(
+        first_token, range, std::move(stmts), std::move(layout));
+  }
+
+  // `stmt`, a top-level statement of the previous version of the source, as
+  // a statement of the source `source_id`, `delta` bytes further on.
+  // `module_arenas` are the arenas of the module `stmt` is in.
+  static TreeRef rebaseStmt(
+      const TreeRef& stmt,
+      SourceId source_id,
+      int64_t delta,
+      const std::vector<c10::intrusive_ptr<TreeArena>>& module_arenas) {
+    auto arenas = RebasedStmt::arenasOf(stmt, module_arenas);
+    // Statements that weren't used since the last reparse are copied from
+    // their original in one go, rather than through a chain of them.
+    if (const auto* rebased = dynamic_cast<const RebasedStmt*>(stmt.get())) {
+      if (TreeRef original = rebased->original()) {
+        return c10::make_intrusive<RebasedStmt>(
+            original,
+            stmt.get(),
+            source_id,
+            rebased->delta + delta,
+            std::move(arenas));
+      }
+    }
+    return c10::make_intrusive<RebasedStmt>(
+        stmt, stmt.get(), source_id, delta, std::move(arenas));
+  }
+
+  // A copy of `tree` with its ranges moved by `delta` into the source
+  // `source_id`. Leaves are shared, and function bodies that haven't been
+  // parsed yet stay that way.
+  static TreeRef rebase(
+      const TreeRef& tree,
+      SourceId source_id,
+      int64_t delta) {
+    if (tree->isAtom()) {
+      return tree;
+    }
+    const SourceRange& old = tree->range();
+    const SourceRange range(source_id, old.start() + delta, old.end() + delta);
+    const auto* lazy = dynamic_cast<const LazyBody*>(tree.get());
+    if (lazy && !lazy->materialized()) {
+      Lexer::ResumePoint start = lazy->start;
+      start.pos += delta;
+      return c10::make_intrusive<LazyBody>(
+          range, std::move(start), lazy->options);
+    }
+    TreeList trees;
+    trees.reserve(tree->trees().size());
+    for (const auto& t : tree->trees()) {
+      trees.push_back(rebase(t, source_id, delta));
+    }
+    TreeRef copy = Compound::create(tree->kind(), range, std::move(trees));
+    if (tree->isStmtList()) {
+      copy->setStmtList();
+    }
+    return copy;
   }
 
   Maybe<Expr> parseReturnAnnotation() {
@@ -749,16 +1254,25 @@ struct ParserImpl {
     auto decl = parseDecl();
 
     TreeRef stmts_list;
-    if (L.nextIf(TK_INDENT)) {
+    if (L.cur().kind == TK_INDENT) {
+      std::optional<Lexer::ResumePoint> body;
+      if (options.lazyFunctionBodies) {
+        body = L.resumePointAfterCur();
+      }
+      L.next();
       // Handle type annotations specified in a type comment as the first line
       // of the function.
       if (L.cur().kind == TK_TYPE_COMMENT) {
         auto type_annotation_decl = Decl(parseTypeComment());
+        if (body) {
+          body = L.resumePointAfterCur();
+        }
         L.expect(TK_NEWLINE);
         decl = mergeTypesFromTypeComment(decl, type_annotation_decl, is_method);
       }
 
-      stmts_list = parseStatements(false);
+      stmts_list = body ? skipStatements(std::move(*body))
+                        : parseStatements(false);
     } else {
       // Special case: the Python grammar allows one-line functions with a
       // single statement.
@@ -770,16 +1284,83 @@ struct ParserImpl {
       TreeList stmts;
       stmts.push_back(parseStmt(is_method));
       stmts_list = create_compound(TK_LIST, L.cur().range, std::move(stmts));
+      stmts_list->setStmtList();
     }
 
     return Def::create(
         name.range(), Ident(name), Decl(decl), List<Stmt>(stmts_list));
   }
+  // Skips over an indented block of statements, like parseStatements(false)
+  // would parse it, and returns a list that parses them on first use. `body`
+  // is where the first statement starts.
+  TreeRef skipStatements(Lexer::ResumePoint body) {
+    const SourceRange first = L.cur().range;
+    size_t end = first.end();
+    size_t depth = 1;
+    size_t brackets = 0;
+    while (true) {
+      const Token& t = L.cur();
+      switch (t.kind) {
+        case TK_INDENT:
+          depth++;
+          break;
+        case TK_DEDENT:
+          depth--;
+          break;
+        case TK_EOF:
+          L.expected("the end of the function body");
+          return makeList(first, {});
+        case '(':
+        case '[':
+        case '{':
+          brackets++;
+          break;
+        case ')':
+        case ']':
+        case '}':
+          // Past this the lexer would no longer see newlines, so the end of
+          // the body can't be found. Report it now rather than on first use.
+          if (brackets-- == 0) {
+            L.reportError(
+                "unmatched closing bracket",
+                t,
+                ParseErrorCode::UNMATCHED_BRACKET);
+            return makeList(first, {});
+          }
+          break;
+        default:
+          break;
+      }
+      if (depth == 0) {
+        break;
+      }
+      if (t.kind != TK_NEWLINE && t.kind != TK_INDENT) {
+        end = t.range.end();
+      }
+      L.next();
+    }
+    L.next();
+    return c10::make_intrusive<LazyBody>(
+        SourceRange(first.source_id(), first.start(), end),
+        std::move(body),
+        options);
+  }
   Lexer& lexer() {
     return L;
   }
+  // Installed by each Parser entry point; null means the heap.
+  c10::intrusive_ptr<TreeArena> arena;
+  // The arenas of the threads parseModuleInParallel() used, which the root
+  // it's building takes over.
+  std::vector<c10::intrusive_ptr<TreeArena>> worker_arenas;
+  // The first syntax error. Parsing carries on past it, but only sees EOF.
+  // Declared before L, which records errors here.
+  Diagnostic error;
 
  private:
+  void reportError(const std::string& what, const SourceRange& range) {
+    L.reportError(what, Token(TK_NOTHING, range));
+  }
   // short helpers to create nodes
   TreeRef create_compound(
       int kind,
@@ -791,31 +1372,143 @@ struct ParserImpl {
     return create_compound(TK_LIST, range, std::move(trees));
   }
   Lexer L;
+  ParserOptions options;
   SharedParserData& shared;
+  // Names interned so far. The keys point into the source text.
+  std::unordered_map<std::string_view, Symbol> symbols;
 };
 
-Parser::Parser(const std::shared_ptr<SourceView>& src)
-    : pImpl(new ParserImpl(src)) {}
+const Tree* reusedFrom(const TreeRef& stmt) {
+  const auto* rebased = dynamic_cast<const RebasedStmt*>(stmt.get());
+  return rebased ? rebased->previous : nullptr;
+}
+
+TreeRef RebasedStmt::copy() const {
+  TreeRef copy = ParserImpl::rebase(original(), range().source_id(), delta);
+  std::lock_guard<std::mutex> guard(mutex_);
+  original_.reset();
+  original_source_ = SourceRef();
+  return copy;
+}
+
+TreeRef LazyBody::parse() const {
+  ParserImpl p(range().source(), start, options);
+  TreeRef stmts;
+  try {
+    stmts = p.parseStatements(/*expect_indent=*/false);
+  } catch (...) {
+    if (!p.error) {
+      throw;
+    }
+  }
+  if (p.error) {
+    throw ParseError(std::move(p.error));
+  }
+  return stmts;
+}
+
+Parser::Parser(const std::shared_ptr<SourceView>& src, bool useArena)
+    : Parser(src, [&] {
+        ParserOptions options;
+        options.useArena = useArena;
+        return options;
+      }()) {}
+
+Parser::Parser(
+    const std::shared_ptr<SourceView>& src,
+    const ParserOptions& options)
+    : pImpl(new ParserImpl(src, options)) {}
+
+Parser::Parser(
+    std::shared_ptr<const TokenStream> tokens,
+    const ParserOptions& options)
+    : pImpl(new ParserImpl(std::move(tokens), options)) {}
 
 Parser::~Parser() = default;
 
+// The root of a tree that `impl` just parsed in a Tree::SourceScope, made to
+// keep its source and the arenas its nodes were allocated from (see ArenaRoot)
+// alive.
+static TreeRef ownRoot(ParserImpl& impl, const TreeRef& root) {
+  std::vector<c10::intrusive_ptr<TreeArena>> arenas =
+      std::move(impl.worker_arenas);
+  impl.worker_arenas.clear();
+  if (impl.arena) {
+    arenas.push_back(impl.arena);
+  }
+  TreeRef owner = ArenaRoot::create(root, std::move(arenas));
+  owner->holdSource();
+  return owner;
+}
+template <typename View>
+static View ownRoot(ParserImpl& impl, const View& root) {
+  return View(ownRoot(impl, root.get()));
+}
+
+// Runs `parse` on `impl` and throws the first syntax error it recorded, if
+// any. Other exceptions are only passed on if there was no syntax error
+// before them: past one, the parser may well build trees that don't check.
+template <typename F>
+static auto run(ParserImpl& impl, F&& parse) {
+  TreeArena::Scope scope(impl.arena);
+  Tree::SourceScope source_scope(impl.lexer().cur().range.source_id());
+  std::optional<decltype(parse())> result;
+  try {
+    result = parse();
+  } catch (...) {
+    if (!impl.error) {
+      throw;
+    }
+  }
+  if (impl.error) {
+    throw ParseError(std::move(impl.error));
+  }
+  return ownRoot(impl, *result);
+}
+
 TreeRef Parser::parseFunction(bool is_method) {
-  return pImpl->parseFunction(is_method);
+  return run(*pImpl, [&] { return pImpl->parseFunction(is_method); });
 }
 TreeRef Parser::parseClass() {
-  return pImpl->parseClass();
+  return run(*pImpl, [&] { return pImpl->parseClass(); });
 }
 Lexer& Parser::lexer() {
   return pImpl->lexer();
 }
 Decl Parser::parseTypeComment() {
-  return pImpl->parseTypeComment();
+  return run(*pImpl, [&] { return pImpl->parseTypeComment(); });
 }
 Expr Parser::parseExp() {
-  return pImpl->parseExp();
+  return run(*pImpl, [&] { return pImpl->parseExp(); });
 }
 Mod Parser::parseModule() {
-  return pImpl->parseModule();
+  return run(*pImpl, [&] { return pImpl->parseModule(); });
+}
+std::optional<Mod> Parser::tryParseModule(Diagnostic* error) {
+  TreeArena::Scope scope(pImpl->arena);
+  Tree::SourceScope source_scope(pImpl->lexer().cur().range.source_id());
+  try {
+    Mod module = pImpl->parseModule();
+    if (!pImpl->error) {
+      return ownRoot(*pImpl, module);
+    }
+  } catch (const ErrorReport& e) {
+    // Errors found after parsing, e.g. in string escapes or type comments.
+    if (!pImpl->error) {
+      pImpl->error = e.diagnostic();
+    }
+  } catch (const std::exception&) {
+    if (!pImpl->error) {
+      throw;
+    }
+  }
+  if (error) {
+    *error = std::move(pImpl->error);
+  }
+  return std::nullopt;
+}
+Mod Parser::reparseModule(const Mod& previous, const TextEdit& edit) {
+  return run(*pImpl, [&] { return pImpl->reparseModule(previous, edit); });
 }
 
 } // namespace minipy
@@ -1,5 +1,8 @@
 #pragma once
 #include <memory>
+#include <optional>
+#include <string>
+#include "minipy/jitparse/diagnostic.h"
 #include "minipy/jitparse/tree.h"
 #include "minipy/jitparse/tree_views.h"
 
@@ -8,17 +11,76 @@ namespace minipy {
 struct Decl;
 struct ParserImpl;
 struct Lexer;
+struct TokenStream;
 
 Decl mergeTypesFromTypeComment(
     const Decl& decl,
     const Decl& type_annotation_decl,
     bool is_method);
 
+struct ParserOptions {
+  // Allocate every tree this parser returns from a single TreeArena (one per
+  // thread with `parallelism`), which the returned root keeps alive. This is
+  // much cheaper for large modules than one heap allocation per node, but
+  // subtrees mustn't be kept past their root (see ArenaRoot).
+  bool useArena = false;
+  // Only find where the body of each multi-line `def` ends, and parse it the
+  // first time its statements are needed (e.g. by Def::statements() or the
+  // compiler). Syntax errors in a body are reported then rather than by
+  // parseModule(). Worthwhile for big modules where most functions never run.
+  bool lazyFunctionBodies = false;
+  // How many threads parseModule() may use. Above 1, large modules are split
+  // into runs of top-level statements that are lexed and parsed concurrently.
+  // The result is the same as parsing on one thread.
+  size_t parallelism = 1;
+};
+
+// A change to a source text: `removed` bytes at `offset` are replaced by
+// `inserted`.
+struct TextEdit {
+  size_t offset = 0;
+  size_t removed = 0;
+  std::string inserted;
+};
+
+// If `stmt` is a top-level statement of a module from Parser::reparseModule()
+// that was reused rather than parsed again, the statement of the previous
+// module that it's a copy of. Otherwise nullptr. That statement may have been
+// freed since, so this is only good for comparing against trees that are
+// known to be alive.
+const Tree* reusedFrom(const TreeRef& stmt);
+
 struct Parser {
-  explicit Parser(const std::shared_ptr<SourceView>& src);
+  explicit Parser(
+      const std::shared_ptr<SourceView>& src,
+      bool useArena = false);
+  Parser(const std::shared_ptr<SourceView>& src, const ParserOptions& options);
+  // Parses the tokens in `tokens` rather than lexing their source. The result
+  // is the same, except that function bodies are never lazy and parsing is
+  // always done on this thread: both need to lex the source from some point
+  // on, which a replay can't do.
+  explicit Parser(
+      std::shared_ptr<const TokenStream> tokens,
+      const ParserOptions& options = ParserOptions());
   TreeRef parseFunction(bool is_method);
   TreeRef parseClass();
+  // Syntax errors are thrown as ParseError, a std::runtime_error.
   Mod parseModule();
+  // Like parseModule(), but returns nullopt for a syntax error instead of
+  // throwing, and stores the error in `error` if given. Cheaper for sources
+  // that are often invalid (e.g. while they're being edited), since the error
+  // is neither thrown nor formatted: call error->message() if it's shown.
+  std::optional<Mod> tryParseModule(Diagnostic* error = nullptr);
+  // Parses this parser's source, which is `previous`'s source after `edit`,
+  // by reusing what it can of `previous`. Only the top-level statements the
+  // edit touches are lexed and parsed again. The others are reused from
+  // `previous` with their ranges moved into this source; their subtrees are
+  // only copied the first time they're needed (until then they keep
+  // `previous`'s trees alive), and function bodies that haven't been parsed
+  // yet stay that way. The result is what parseModule() would return. Throws
+  // std::runtime_error if `edit` doesn't turn `previous`'s source into this
+  // one.
+  Mod reparseModule(const Mod& previous, const TextEdit& edit);
   Decl parseTypeComment();
   Expr parseExp();
   Lexer& lexer();
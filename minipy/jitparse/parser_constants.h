@@ -1,5 +1,5 @@
 #pragma once
 
 namespace minipy {
-static const char* valid_single_char_tokens = "+-*/%@()[]:,={}><.?!&^|~";
+static constexpr const char* valid_single_char_tokens = "+-*/%@()[]:,={}><.?!&^|~";
 } // namespace minipy
@@ -1,11 +1,197 @@
 #include "minipy/jitparse/source_range.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
 // #include <torch/csrc/jit/serialization/source_range_serialization.h>
 
 namespace minipy {
+
+MappedSource::MappedSource(const std::string& path, size_t starting_line_no)
+    : SourceView(std::string_view(), path, starting_line_no) {
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  auto fail = [&](const char* what) {
+    const int err = errno;
+    if (mapping_) {
+      ::munmap(mapping_, mapping_size_);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    throw std::runtime_error(
+        std::string(what) + " " + path + ": " + std::strerror(err));
+  };
+  if (fd < 0) {
+    fail("failed to open");
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0) {
+    fail("failed to stat");
+  }
+  const size_t size = st.st_size;
+  const size_t page = ::sysconf(_SC_PAGESIZE);
+  // Reserve at least one byte more than the file needs, then map the file over
+  // the front of the reservation. The kernel zero-fills the rest of the file's
+  // last page, and if the file ends exactly on a page boundary the extra
+  // anonymous page supplies the terminating zero.
+  mapping_size_ = (size / page + 1) * page;
+  void* reserved = ::mmap(
+      nullptr, mapping_size_, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (reserved == MAP_FAILED) {
+    fail("failed to map");
+  }
+  mapping_ = reserved;
+  if (size > 0 &&
+      ::mmap(mapping_, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+          MAP_FAILED) {
+    fail("failed to map");
+  }
+  ::close(fd);
+  ::madvise(mapping_, size, MADV_SEQUENTIAL);
+  text_view_ = std::string_view(static_cast<const char*>(mapping_), size);
+}
+
+MappedSource::~MappedSource() {
+  ::munmap(mapping_, mapping_size_);
+}
+namespace {
+// Sources are stored in fixed-size chunks that are never moved or freed, so
+// source_for_id() can read them without taking the lock. An id is a slot index
+// in the low bits and, in the high bits, how many times the slot has been
+// reused, so that an id that was released doesn't find the slot's next source.
+// A slot that has been through all its generations is retired rather than
+// wrapping around, so no id is ever given out twice.
+constexpr size_t kSourceIndexBits = 20;
+constexpr uint32_t kSourceIndexMask = (uint32_t(1) << kSourceIndexBits) - 1;
+constexpr size_t kSourceChunkBits = 10;
+constexpr size_t kSourceChunkSize = size_t(1) << kSourceChunkBits;
+constexpr size_t kMaxSourceChunks =
+    size_t(1) << (kSourceIndexBits - kSourceChunkBits);
+constexpr uint32_t kMaxSourceGeneration = UINT32_MAX >> kSourceIndexBits;
+
+struct SourceSlot {
+  std::shared_ptr<SourceView> source;
+  // The id the slot is registered as, or 0 while it's free.
+  std::atomic<uint32_t> id{0};
+  std::atomic<uint32_t> refs{0};
+  // Guarded by the registry's mutex.
+  uint32_t generation = 0;
+};
+
+struct SourceRegistry {
+  std::mutex mutex;
+  std::unordered_map<const SourceView*, SourceId> ids;
+  std::atomic<SourceSlot*> chunks[kMaxSourceChunks] = {};
+  // Released slots, to be reused before new ones.
+  std::vector<uint32_t> free_slots;
+  // Slot 0 is SourceId::NONE.
+  size_t next_slot = 1;
+};
+
+SourceRegistry& source_registry() {
+  // Leaked on purpose: SourceRanges may be used during static destruction.
+  static SourceRegistry* registry = new SourceRegistry();
+  return *registry;
+}
+
+SourceSlot& slot_for(SourceId id) {
+  const uint32_t index = static_cast<uint32_t>(id) & kSourceIndexMask;
+  auto* slots = source_registry().chunks[index >> kSourceChunkBits].load(
+      std::memory_order_acquire);
+  return slots[index & (kSourceChunkSize - 1)];
+}
+} // namespace
+
+SourceId register_source(const std::shared_ptr<SourceView>& source) {
+  auto& registry = source_registry();
+  std::lock_guard<std::mutex> guard(registry.mutex);
+  auto it = registry.ids.find(source.get());
+  if (it != registry.ids.end()) {
+    // Under the lock, so release_source() can't be freeing it right now.
+    slot_for(it->second).refs.fetch_add(1, std::memory_order_relaxed);
+    return it->second;
+  }
+  if (source->text().size() >= UINT32_MAX) {
+    throw std::runtime_error("source is too large (4GB or more)");
+  }
+  uint32_t index;
+  if (!registry.free_slots.empty()) {
+    index = registry.free_slots.back();
+    registry.free_slots.pop_back();
+  } else {
+    const size_t chunk = registry.next_slot >> kSourceChunkBits;
+    if (chunk >= kMaxSourceChunks) {
+      throw std::runtime_error("out of source ids");
+    }
+    if (!registry.chunks[chunk].load(std::memory_order_relaxed)) {
+      registry.chunks[chunk].store(
+          new SourceSlot[kSourceChunkSize], std::memory_order_release);
+    }
+    index = static_cast<uint32_t>(registry.next_slot++);
+  }
+  SourceSlot& slot = slot_for(static_cast<SourceId>(index));
+  const auto id =
+      static_cast<SourceId>((slot.generation << kSourceIndexBits) | index);
+  slot.source = source;
+  slot.refs.store(1, std::memory_order_relaxed);
+  slot.id.store(static_cast<uint32_t>(id), std::memory_order_release);
+  return registry.ids[source.get()] = id;
+}
+
+void retain_source(SourceId id) {
+  if (id != SourceId::NONE) {
+    slot_for(id).refs.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void release_source(SourceId id) {
+  if (id == SourceId::NONE) {
+    return;
+  }
+  SourceSlot& slot = slot_for(id);
+  if (slot.refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+  // Freed once the lock is released, since it may take a while (e.g. to unmap
+  // a MappedSource).
+  std::shared_ptr<SourceView> source;
+  auto& registry = source_registry();
+  std::lock_guard<std::mutex> guard(registry.mutex);
+  // register_source() may have found it again, and perhaps even released it
+  // again, while we weren't holding the lock.
+  if (slot.refs.load(std::memory_order_relaxed) != 0 ||
+      slot.id.load(std::memory_order_relaxed) != static_cast<uint32_t>(id)) {
+    return;
+  }
+  registry.ids.erase(slot.source.get());
+  source = std::move(slot.source);
+  slot.id.store(0, std::memory_order_release);
+  if (slot.generation < kMaxSourceGeneration) {
+    slot.generation++;
+    registry.free_slots.push_back(
+        static_cast<uint32_t>(id) & kSourceIndexMask);
+  }
+}
+
+const std::shared_ptr<SourceView>& source_for_id(SourceId id) {
+  static const std::shared_ptr<SourceView> none;
+  if (id == SourceId::NONE) {
+    return none;
+  }
+  const SourceSlot& slot = slot_for(id);
+  if (slot.id.load(std::memory_order_acquire) != static_cast<uint32_t>(id)) {
+    return none;
+  }
+  return slot.source;
+}
 size_t SourceRangeHasher::operator()(const SourceRange& key) const {
   return (
-      std::hash<uintptr_t>()(reinterpret_cast<uintptr_t>(key.source().get())) ^
+      std::hash<uint32_t>()(static_cast<uint32_t>(key.source_id())) ^
       std::hash<size_t>()(key.start()) ^ std::hash<size_t>()(key.end()));
 }
 
@@ -70,11 +256,12 @@ void SourceRange::print_with_context(
     bool highlight,
     const std::string& funcname) const {
   // This is an empty SourceRange, used as a sentinel value.
-  if (!source_view_) {
+  const auto& source_view = source();
+  if (!source_view) {
     return;
   }
 
-  std::string_view str = source_view_->text();
+  std::string_view str = source_view->text();
   if (size() == str.size()) {
     // this is just the entire file, not a subset, so print it out.
     // primarily used to print out python stack traces
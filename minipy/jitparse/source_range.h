@@ -1,10 +1,14 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace minipy {
@@ -18,6 +22,8 @@ struct SourceRange;
 //                          which the code segment originated.
 //  - starting_line_no : represents the line in the original file where the
 //                       code segment started.
+// Line offsets are only computed the first time they're needed (usually to
+// report an error), so lexing doesn't pay for a second pass over the text.
 struct SourceView {
   explicit SourceView(
       std::string_view text_view,
@@ -25,9 +31,7 @@ struct SourceView {
       : text_view_(text_view),
         filename_(std::nullopt),
         starting_line_no_(0),
-        gen_ranges_(std::move(gen_ranges)) {
-    calc_line_start_offsets();
-  }
+        gen_ranges_(std::move(gen_ranges)) {}
 
   SourceView(
       std::string_view text_view,
@@ -37,28 +41,32 @@ struct SourceView {
       : text_view_(text_view),
         filename_(std::move(filename)),
         starting_line_no_(starting_line_no),
-        gen_ranges_(std::move(gen_ranges)) {
-    calc_line_start_offsets();
-  }
+        gen_ranges_(std::move(gen_ranges)) {}
+
+  // The line offsets aren't copied; the copy recomputes them if needed.
+  SourceView(const SourceView& other)
+      : text_view_(other.text_view_),
+        filename_(other.filename_),
+        starting_line_no_(other.starting_line_no_),
+        gen_ranges_(other.gen_ranges_) {}
+  SourceView& operator=(const SourceView&) = delete;
 
   // Given a line number (within source_), return the byte offset of the
   // beginning of that line.
   size_t offset_for_line(size_t line) const {
-    return line_starting_offsets_.at(line);
+    return line_start_offsets().at(line);
   }
 
   // Returns number of lines present.
   size_t num_lines() const {
-    return line_starting_offsets_.size();
+    return line_start_offsets().size();
   }
 
   // Calculate the line (within the code segment) on which `offset` resides.
   size_t lineno_for_offset(size_t offset) const {
-    return std::upper_bound(
-               line_starting_offsets_.begin(),
-               line_starting_offsets_.end(),
-               offset) -
-        line_starting_offsets_.begin() - 1;
+    const auto& offsets = line_start_offsets();
+    return std::upper_bound(offsets.begin(), offsets.end(), offset) -
+        offsets.begin() - 1;
   }
 
   // Calculate the line (within the original source file, if present) on which
@@ -90,20 +98,24 @@ struct SourceView {
   std::string_view text_view_;
 
  private:
-  void calc_line_start_offsets() {
-    line_starting_offsets_.push_back(0);
-    size_t pos = 0;
-    while ((pos = text().find('\n', pos)) != std::string::npos) {
-      line_starting_offsets_.push_back(++pos);
-    }
+  const std::vector<size_t>& line_start_offsets() const {
+    std::call_once(line_offsets_once_, [this] {
+      line_starting_offsets_.push_back(0);
+      size_t pos = 0;
+      while ((pos = text().find('\n', pos)) != std::string::npos) {
+        line_starting_offsets_.push_back(++pos);
+      }
+    });
+    return line_starting_offsets_;
   }
 
   std::optional<std::string> filename_;
   // If filename_ is not present, starting_line_no_ is don't care
   size_t starting_line_no_;
   // Starting offsets for lines into the source. e.g. line 0 starts at
-  // line_starting_offsets_[0], etc.
-  std::vector<size_t> line_starting_offsets_;
+  // line_starting_offsets_[0], etc. Filled in by line_start_offsets().
+  mutable std::vector<size_t> line_starting_offsets_;
+  mutable std::once_flag line_offsets_once_;
 
   std::shared_ptr<SourceRangeUnpickler> gen_ranges_;
 };
@@ -156,18 +168,91 @@ struct Source : public SourceView {
   std::string text_;
 };
 
+// MappedSource is a SourceView over a read-only memory-mapped file, so large
+// files can be lexed without first copying them into memory. The mapping is
+// followed by at least one zero byte, like the std::string in Source, because
+// the lexer relies on the text being null terminated.
+struct MappedSource : public SourceView {
+  explicit MappedSource(const std::string& path, size_t starting_line_no = 0);
+  ~MappedSource();
+  MappedSource(const MappedSource&) = delete;
+
+ private:
+  void* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+};
+
+// Sources are registered and then referred to by a small id, so that
+// SourceRanges don't need to hold (and atomically copy) a shared_ptr each.
+// The registry keeps a source alive for as long as anything holds a reference
+// to its id: the root of a parsed tree holds one for its source (see
+// Tree::SourceScope), and so do lexers, token streams and OwnedSourceRanges.
+// Once the last reference is released the source is freed, so a bare
+// SourceRange is only meaningful while something still holds its source. Ids
+// are never reused, so a range whose source was freed finds no source rather
+// than another one. SourceId::NONE is the id of "no source".
+enum class SourceId : uint32_t { NONE = 0 };
+
+// Returns the id of `source`, registering it if it isn't yet, and takes a
+// reference to it that the caller has to give back with release_source().
+// Thread-safe. Only sources whose text fits in 32-bit offsets can be
+// registered. Throws std::runtime_error if there are no ids left, after about
+// four billion sources.
+SourceId register_source(const std::shared_ptr<SourceView>& source);
+// Takes another reference to `id`, which must already be held by something.
+// Doesn't lock.
+void retain_source(SourceId id);
+// Gives back a reference taken by register_source() or retain_source(). The
+// last one frees the source. Only locks for the last one.
+void release_source(SourceId id);
+// The source registered as `id`, or nullptr for SourceId::NONE and ids that
+// have been released. Doesn't lock.
+const std::shared_ptr<SourceView>& source_for_id(SourceId id);
+
+// A counted reference to a registered source. It keeps the source alive like
+// a shared_ptr would, but copying it only touches a count in the registry.
+class SourceRef {
+ public:
+  SourceRef() = default;
+  explicit SourceRef(const std::shared_ptr<SourceView>& source)
+      : id_(register_source(source)) {}
+  explicit SourceRef(SourceId id) : id_(id) {
+    retain_source(id_);
+  }
+  SourceRef(const SourceRef& other) : SourceRef(other.id_) {}
+  SourceRef(SourceRef&& other) noexcept : id_(other.id_) {
+    other.id_ = SourceId::NONE;
+  }
+  SourceRef& operator=(SourceRef other) noexcept {
+    std::swap(id_, other.id_);
+    return *this;
+  }
+  ~SourceRef() {
+    release_source(id_);
+  }
+
+  SourceId id() const {
+    return id_;
+  }
+
+ private:
+  SourceId id_ = SourceId::NONE;
+};
+
 // A SourceRange is a reference to subset of a Source, specified by `start` and
-// `end` byte offsets into the source text.
+// `end` byte offsets into the source text. It is 12 bytes and trivially
+// copyable; the SourceView is only looked up when it's actually needed, e.g.
+// to highlight() the range in an error message. The offsets are 32-bit;
+// constructing a range past that throws std::out_of_range.
 struct SourceRange {
-  SourceRange(
-      std::shared_ptr<SourceView> source_view_,
-      size_t start_,
-      size_t end_)
-      : source_view_(std::move(source_view_)), start_(start_), end_(end_) {}
-  SourceRange() : source_view_(nullptr), start_(0), end_(0) {}
+  SourceRange(SourceId source_id_, size_t start_, size_t end_)
+      : source_id_(source_id_),
+        start_(checkedOffset(start_)),
+        end_(checkedOffset(end_)) {}
+  SourceRange() : source_id_(SourceId::NONE), start_(0), end_(0) {}
 
   const std::string text() const {
-    auto text_view = source_view_->text().substr(start(), end() - start());
+    auto text_view = source()->text().substr(start(), end() - start());
     return std::string(text_view.begin(), text_view.end());
   }
   size_t size() const {
@@ -184,7 +269,10 @@ struct SourceRange {
       const std::string& funcname) const;
 
   const std::shared_ptr<SourceView>& source() const {
-    return source_view_;
+    return source_for_id(source_id_);
+  }
+  SourceId source_id() const {
+    return source_id_;
   }
   size_t start() const {
     return start_;
@@ -199,22 +287,23 @@ struct SourceRange {
   }
 
   std::optional<std::tuple<std::string, size_t, size_t>> file_line_col() const {
-    if (!source_view_ || !source()->filename()) {
+    const auto& source_view = source();
+    if (!source_view || !source_view->filename()) {
       return std::nullopt;
     }
 
-    auto lineno = source_view_->lineno_for_offset(start_);
-    auto col_offset = (int)start_ - (int)source_view_->offset_for_line(lineno);
+    auto lineno = source_view->lineno_for_offset(start());
+    auto col_offset = (int)start() - (int)source_view->offset_for_line(lineno);
     // TODO: std::optional<>::value returns an rvalue ref so can't use it here??
     return std::make_tuple<std::string, size_t, size_t>(
-        source_view_->filename().value_or(""),
-        source_view_->lineno_to_source_lineno(lineno),
+        source_view->filename().value_or(""),
+        source_view->lineno_to_source_lineno(lineno),
         (size_t)col_offset);
   }
 
   bool operator==(const SourceRange& rhs) const {
-    return start() == rhs.start() && end() == rhs.end() &&
-        source() == rhs.source();
+    return start_ == rhs.start_ && end_ == rhs.end_ &&
+        source_id_ == rhs.source_id_;
   }
 
   bool operator!=(const SourceRange& rhs) const {
@@ -222,30 +311,35 @@ struct SourceRange {
   }
 
   std::optional<SourceRange> findSourceRangeThatGenerated() const {
-    if (!source_view_) {
+    const auto& source_view = source();
+    if (!source_view) {
       return std::nullopt;
     }
-    return source_view_->findSourceRangeThatGenerated(*this);
+    return source_view->findSourceRangeThatGenerated(*this);
   }
 
- protected:
-  std::shared_ptr<SourceView> source_view_;
-
  private:
-  size_t start_;
-  size_t end_;
+  static uint32_t checkedOffset(size_t offset) {
+    if (offset > UINT32_MAX) {
+      throw std::out_of_range("source offset doesn't fit in 32 bits");
+    }
+    return static_cast<uint32_t>(offset);
+  }
+
+  SourceId source_id_;
+  uint32_t start_;
+  uint32_t end_;
 };
 
-// OwnedSourceRange is just like a SourceRange except that it owns a `Source`
-// instead of `SourceView`. Thus OwnedSourceRange owns a copy of source text.
+// A SourceRange that keeps its source alive, for things that may outlive the
+// trees the range came from, like error reports.
 struct OwnedSourceRange : public SourceRange {
-  OwnedSourceRange(const SourceRange& source_range)
-      : SourceRange(source_range) {
-    const auto& source = source_range.source();
-    if (source) {
-      source_view_ = std::make_shared<Source>(*source);
-    }
-  }
+  OwnedSourceRange() = default;
+  OwnedSourceRange(const SourceRange& range)
+      : SourceRange(range), source_ref_(range.source_id()) {}
+
+ private:
+  SourceRef source_ref_;
 };
 
 struct SourceRangeHasher {
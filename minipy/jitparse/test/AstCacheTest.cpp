@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+
+#include "minipy/jitparse/ast_cache.h"
+#include "minipy/jitparse/parser.h"
+#include "minipy/jitparse/test/ParserTestUtils.h"
+
+namespace minipy {
+
+// Compares kinds, ranges and atoms of two trees.
+static void expectSameTree(const TreeRef& a, const TreeRef& b) {
+  ASSERT_EQ(a->kind(), b->kind());
+  ASSERT_EQ(a->isAtom(), b->isAtom());
+  if (a->isAtom()) {
+    EXPECT_EQ(a->stringValue(), b->stringValue());
+    ASSERT_EQ(a->number() != nullptr, b->number() != nullptr);
+    if (a->number()) {
+      EXPECT_EQ(a->number()->isFloat, b->number()->isFloat);
+      EXPECT_EQ(a->number()->isImaginary, b->number()->isImaginary);
+      EXPECT_EQ(a->number()->overflow, b->number()->overflow);
+      EXPECT_EQ(a->number()->intValue, b->number()->intValue);
+      EXPECT_EQ(a->number()->floatValue, b->number()->floatValue);
+    }
+    return;
+  }
+  EXPECT_EQ(a->range().start(), b->range().start());
+  EXPECT_EQ(a->range().end(), b->range().end());
+  ASSERT_EQ(a->trees().size(), b->trees().size());
+  for (size_t i = 0; i < a->trees().size(); i++) {
+    expectSameTree(a->trees()[i], b->trees()[i]);
+  }
+}
+
+struct TempDir {
+  TempDir() {
+    char name[] = "/tmp/minipy_ast_cache_test_XXXXXX";
+    EXPECT_NE(mkdtemp(name), nullptr);
+    path = name;
+  }
+  ~TempDir() {
+    // Only cache files are ever written here.
+    std::system(("rm -rf " + path).c_str());
+  }
+  std::string path;
+};
+
+TEST(AstCache, RoundTrip) {
+  auto source = std::make_shared<Source>(moduleSource);
+  const auto parsed = Parser(source).parseModule();
+  const std::string data = serializeTree(parsed.get(), *source);
+
+  // Load against a separate copy of the text, as a new process would.
+  auto other = std::make_shared<Source>(moduleSource);
+  const auto loaded = Mod(deserializeTree(data, other));
+  expectSameTree(parsed.get(), loaded.get());
+  EXPECT_EQ(dump(parsed.get()), dump(loaded.get()));
+  EXPECT_EQ(loaded.range().source(), other);
+
+  Def def(loaded.body()[0]);
+  EXPECT_EQ(def.name().symbol(), Symbol("foo"));
+  EXPECT_EQ(def.name().range().text(), "foo");
+}
+
+TEST(AstCache, RejectsOtherSources) {
+  auto source = std::make_shared<Source>(moduleSource);
+  const std::string data =
+      serializeTree(Parser(source).parseModule().get(), *source);
+  auto changed = std::make_shared<Source>(std::string(moduleSource) + "\n");
+  EXPECT_THROW(deserializeTree(data, changed), std::runtime_error);
+  for (size_t size : {size_t(0), size_t(8), data.size() / 2, data.size() - 1}) {
+    EXPECT_THROW(
+        deserializeTree(data.substr(0, size), source), std::runtime_error);
+  }
+}
+
+TEST(AstCache, RejectsBadKinds) {
+  auto source = std::make_shared<Source>(moduleSource);
+  const SourceRange range = Parser(source).parseModule().range();
+  // Tree::kind() only has room for token kinds.
+  for (int kind : {kNumTokenKinds, -1}) {
+    const std::string data = serializeTree(
+        Compound::create(kind, range, TreeList()), *source);
+    EXPECT_THROW(deserializeTree(data, source), std::runtime_error) << kind;
+  }
+}
+
+TEST(AstCache, LoadAndStore) {
+  TempDir dir;
+  AstCache cache(dir.path + "/cache");
+  auto source = std::make_shared<Source>(moduleSource);
+  EXPECT_FALSE(cache.load(source).has_value());
+
+  const auto parsed = cache.parseModule(source);
+  auto loaded = cache.load(source, /*useArena=*/true);
+  ASSERT_TRUE(loaded.has_value());
+  expectSameTree(parsed.get(), loaded->get());
+  EXPECT_TRUE(loaded->body().get()->inArena());
+
+  // Corrupt entries are misses, and get replaced.
+  std::ofstream(cache.pathFor(*source), std::ios::binary) << "garbage";
+  EXPECT_FALSE(cache.load(source).has_value());
+  cache.parseModule(source);
+  EXPECT_TRUE(cache.load(source).has_value());
+}
+
+TEST(AstCache, StoresReparsedModule) {
+  TempDir dir;
+  AstCache cache(dir.path + "/cache");
+  const std::string text = moduleSource;
+  const auto previous = Parser(std::make_shared<Source>(text)).parseModule();
+
+  const TextEdit edit{0, 0, "x = 1\n\n"};
+  auto source = std::make_shared<Source>(edit.inserted + text);
+  const auto reparsed = Parser(source).reparseModule(previous, edit);
+  EXPECT_TRUE(cache.store(source, reparsed));
+  auto loaded = cache.load(source);
+  ASSERT_TRUE(loaded.has_value());
+  expectSameTree(Parser(source).parseModule().get(), loaded->get());
+}
+
+} // namespace minipy
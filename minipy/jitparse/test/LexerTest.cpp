@@ -0,0 +1,363 @@
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+#include <cstdio>
+#include <fstream>
+#include <set>
+
+#include "minipy/jitparse/lexer.h"
+
+namespace minipy {
+
+static std::vector<std::pair<int, std::string>> tokenize(
+    std::shared_ptr<SourceView> source) {
+  std::vector<std::pair<int, std::string>> tokens;
+  Lexer L(std::move(source));
+  while (true) {
+    auto t = L.next();
+    tokens.emplace_back(t.kind, t.text());
+    if (t.kind == TK_EOF) {
+      return tokens;
+    }
+  }
+}
+
+// Writes `text` to a temporary file that is removed when the test ends.
+struct TempFile {
+  explicit TempFile(const std::string& text) {
+    char name[] = "/tmp/minipy_lexer_test_XXXXXX";
+    const int fd = mkstemp(name);
+    EXPECT_GE(fd, 0);
+    close(fd);
+    path = name;
+    std::ofstream(path, std::ios::binary) << text;
+  }
+  ~TempFile() {
+    std::remove(path.c_str());
+  }
+  std::string path;
+};
+
+static constexpr auto moduleSource = R"SCRIPT(
+def foo(x, y=1.5e3):
+    if x >= 2 and not y:
+        while x:
+            for i in range(3):
+                x -= i  # comment
+    return [x, 'a' "b", 0x1f, 3j]
+
+foo(1)
+)SCRIPT";
+
+TEST(Lexer, LongestMatch) {
+  using Tokens = std::vector<std::pair<int, std::string>>;
+  auto lex = [](const std::string& src) {
+    return tokenize(std::make_shared<Source>(src));
+  };
+  // Keywords win ties with identifiers, but not longer identifiers.
+  EXPECT_EQ(
+      lex("if iffy _if1"),
+      (Tokens{
+          {TK_IF, "if"},
+          {TK_IDENT, "iffy"},
+          {TK_IDENT, "_if1"},
+          {TK_EOF, ""}}));
+  // Multi-word and multi-character tokens take the longest match.
+  EXPECT_EQ(
+      lex("a is not b is notc"),
+      (Tokens{
+          {TK_IDENT, "a"},
+          {TK_ISNOT, "is not"},
+          {TK_IDENT, "b"},
+          {TK_ISNOT, "is not"},
+          {TK_IDENT, "c"},
+          {TK_EOF, ""}}));
+  EXPECT_EQ(
+      lex("a<<=b<=>c**d..."),
+      (Tokens{
+          {TK_IDENT, "a"},
+          {TK_LSHIFT_EQ, "<<="},
+          {TK_IDENT, "b"},
+          {TK_EQUIVALENT, "<=>"},
+          {TK_IDENT, "c"},
+          {TK_POW, "**"},
+          {TK_IDENT, "d"},
+          {TK_DOTS, "..."},
+          {TK_EOF, ""}}));
+  EXPECT_EQ(
+      lex("x.y # comment"),
+      (Tokens{{TK_IDENT, "x"}, {'.', "."}, {TK_IDENT, "y"}, {TK_EOF, ""}}));
+}
+
+TEST(Lexer, NumberValues) {
+  Lexer L(std::make_shared<Source>(
+      "12 0x1f 017 2.5e3 .5 4j 1e 99999999999999999999"));
+  auto number = [&] { return L.number(L.next()); };
+  auto n = number();
+  EXPECT_FALSE(n.isFloat);
+  EXPECT_EQ(n.intValue, 12);
+  EXPECT_EQ(number().intValue, 0x1f);
+  // Same as strtoll with base 0.
+  EXPECT_EQ(number().intValue, 017);
+  n = number();
+  EXPECT_TRUE(n.isFloat);
+  EXPECT_EQ(n.floatValue, 2500.0);
+  EXPECT_EQ(number().floatValue, 0.5);
+  n = number();
+  EXPECT_TRUE(n.isImaginary);
+  EXPECT_EQ(n.intValue, 4);
+  // An incomplete exponent isn't part of the number.
+  auto t = L.next();
+  EXPECT_EQ(t.text(), "1");
+  EXPECT_EQ(L.next().kind, TK_IDENT);
+  EXPECT_TRUE(number().overflow);
+}
+
+TEST(Lexer, HexDigitsAreNotExponents) {
+  // 'e' is a hex digit, so these are ints. strtod, which the lexer used to
+  // find the end of numbers with, read 0x1e as a hex float.
+  Lexer L(std::make_shared<Source>("0x1e 0X1E5 0xe"));
+  for (int64_t expected : {0x1e, 0x1e5, 0xe}) {
+    Token t = L.next();
+    EXPECT_EQ(t.kind, TK_NUMBER);
+    const NumberLiteral n = L.number(t);
+    EXPECT_FALSE(n.isFloat) << t.text();
+    EXPECT_EQ(n.intValue, expected) << t.text();
+  }
+  EXPECT_EQ(L.next().kind, TK_EOF);
+}
+
+TEST(Lexer, RecordedErrors) {
+  const auto source = std::make_shared<Source>("x = (a\ny $ z)\n");
+  EXPECT_THROW(tokenize(source), ParseError);
+
+  Diagnostic error;
+  Lexer L(source, &error);
+  std::vector<int> kinds;
+  for (int i = 0; i < 8; i++) {
+    kinds.push_back(L.next().kind);
+  }
+  // The invalid token stops the lexer; it only returns EOF after that.
+  EXPECT_EQ(
+      kinds,
+      (std::vector<int>{
+          TK_IDENT, '=', '(', TK_IDENT, TK_IDENT, TK_EOF, TK_EOF, TK_EOF}));
+  EXPECT_TRUE(L.failed());
+  EXPECT_EQ(error.code, ParseErrorCode::INVALID_TOKEN);
+  EXPECT_EQ(error.range.text(), "$");
+
+  // Only the first error is kept.
+  L.expect(TK_IDENT);
+  EXPECT_EQ(error.code, ParseErrorCode::INVALID_TOKEN);
+}
+
+TEST(Lexer, KindTables) {
+  // stringToKind() knows every token the lexer matches.
+  for (const char* c = valid_single_char_tokens; *c; c++) {
+    EXPECT_EQ(stringToKind(std::string(1, *c)), *c);
+  }
+#define CHECK_STRING(tok, _, str)      \
+  if (*(str) != '\0') {                \
+    EXPECT_EQ(stringToKind(str), tok); \
+  }
+  TC_FORALL_TOKEN_KINDS(CHECK_STRING)
+#undef CHECK_STRING
+  EXPECT_THROW(stringToKind("iff"), std::out_of_range);
+  EXPECT_THROW(stringToKind(""), std::out_of_range);
+
+  auto& shared = sharedParserData();
+  int prec = 0;
+  EXPECT_TRUE(shared.isBinary(TK_POW, &prec));
+  EXPECT_EQ(prec, 11);
+  EXPECT_TRUE(shared.isUnary('-', &prec));
+  EXPECT_EQ(prec, 10);
+  EXPECT_FALSE(shared.isUnary('+', &prec));
+  EXPECT_FALSE(shared.isBinary(TK_NOT, &prec));
+  EXPECT_FALSE(shared.isBinary(kNumTokenKinds, &prec));
+  EXPECT_FALSE(shared.isBinary(-1, &prec));
+}
+
+static std::vector<std::pair<int, std::string>> replay(
+    std::shared_ptr<const TokenStream> stream) {
+  std::vector<std::pair<int, std::string>> tokens;
+  Lexer L(std::move(stream));
+  while (true) {
+    auto t = L.next();
+    tokens.emplace_back(t.kind, t.text());
+    if (t.kind == TK_EOF) {
+      return tokens;
+    }
+  }
+}
+
+TEST(Lexer, CaptureAndReplay) {
+  const auto source = std::make_shared<Source>(moduleSource);
+  const auto stream =
+      std::make_shared<TokenStream>(TokenStream::capture(source));
+  EXPECT_FALSE(stream->error);
+  EXPECT_EQ(stream->tokens.back().kind, TK_EOF);
+  EXPECT_EQ(replay(stream), tokenize(source));
+  // Replays can be repeated.
+  EXPECT_EQ(replay(stream), tokenize(source));
+
+  // Including number values and the base indentation.
+  const auto numbers = std::make_shared<TokenStream>(
+      TokenStream::capture(std::make_shared<Source>("  0x1f + 2.5\n")));
+  Lexer L(numbers);
+  EXPECT_EQ(L.baseIndent(), 2);
+  EXPECT_EQ(L.number(L.next()).intValue, 0x1f);
+  L.next();
+  EXPECT_EQ(L.number(L.next()).floatValue, 2.5);
+
+  // An error is reported where the lexer would have reported it.
+  for (const char* text :
+       {"x = (a\ny $ z)\n", "$", "if x:\n    y\n  z\n"}) {
+    const auto invalid = std::make_shared<Source>(text);
+    const auto stream =
+        std::make_shared<TokenStream>(TokenStream::capture(invalid));
+    EXPECT_TRUE(stream->error) << text;
+    Diagnostic live, replayed;
+    Lexer live_lexer(invalid, &live);
+    Lexer replay_lexer(stream, &replayed);
+    while (!live_lexer.failed()) {
+      EXPECT_EQ(live_lexer.next().range, replay_lexer.next().range) << text;
+      EXPECT_EQ(live_lexer.failed(), replay_lexer.failed()) << text;
+    }
+    EXPECT_EQ(replayed.message(), live.message());
+    EXPECT_THROW(replay(stream), ParseError);
+  }
+}
+
+TEST(Lexer, DedentsCollapse) {
+  // Closing four blocks at once queues a NEWLINE and four DEDENTs.
+  auto tokens = tokenize(std::make_shared<Source>(moduleSource));
+  size_t dedents = 0;
+  for (const auto& t : tokens) {
+    dedents += t.first == TK_DEDENT;
+  }
+  EXPECT_EQ(dedents, 4);
+  EXPECT_EQ(tokens.back().first, TK_EOF);
+}
+
+TEST(Lexer, ManyCommentLines) {
+  // Skipping comments, blank lines and continuations must not use stack
+  // proportional to the number of lines skipped.
+  std::string src = "x = 1\n";
+  for (int i = 0; i < 500000; i++) {
+    src += i % 2 ? "# comment\n" : "  \n";
+  }
+  src += "y = \\\n  2 # trailing\n";
+  auto tokens = tokenize(std::make_shared<Source>(src));
+  std::vector<int> kinds;
+  for (const auto& t : tokens) {
+    kinds.push_back(t.first);
+  }
+  EXPECT_EQ(
+      kinds,
+      (std::vector<int>{
+          TK_IDENT,
+          '=',
+          TK_NUMBER,
+          TK_NEWLINE,
+          TK_IDENT,
+          '=',
+          TK_NUMBER,
+          TK_NEWLINE,
+          TK_EOF}));
+}
+
+TEST(Lexer, CompactRanges) {
+  static_assert(sizeof(SourceRange) == 12, "SourceRange should stay compact");
+  OwnedSourceRange x, y;
+  std::weak_ptr<SourceView> weak;
+  {
+    auto source = std::make_shared<Source>("x = y\n");
+    weak = source;
+    Lexer L(source);
+    x = L.next().range;
+    L.next();
+    y = L.next().range;
+    EXPECT_EQ(x.source(), source);
+  }
+  // Owned ranges keep the source alive after the lexer and the caller's
+  // reference to it are gone.
+  EXPECT_EQ(x.source_id(), y.source_id());
+  EXPECT_EQ(x.text(), "x");
+  EXPECT_EQ(y.text(), "y");
+  EXPECT_NE(y.str().find("~ <--- HERE"), std::string::npos);
+  EXPECT_EQ(SourceRange().source(), nullptr);
+
+  // Until the last of them is gone, and its id no longer finds it.
+  const SourceId id = x.source_id();
+  x = OwnedSourceRange();
+  EXPECT_FALSE(weak.expired());
+  y = OwnedSourceRange();
+  EXPECT_TRUE(weak.expired());
+  EXPECT_EQ(source_for_id(id), nullptr);
+}
+
+TEST(Lexer, SourceIdsAreNotReused) {
+  // More releases than a slot has generations, so that it's retired.
+  std::set<SourceId> ids;
+  for (int i = 0; i < 5000; i++) {
+    const SourceRef ref(std::make_shared<Source>("x\n"));
+    EXPECT_TRUE(ids.insert(ref.id()).second);
+  }
+  for (SourceId id : ids) {
+    EXPECT_EQ(source_for_id(id), nullptr);
+  }
+}
+
+TEST(Lexer, RangeOffsetsAreChecked) {
+  const SourceRange range(SourceId::NONE, UINT32_MAX, UINT32_MAX);
+  EXPECT_EQ(range.end(), UINT32_MAX);
+  EXPECT_THROW(
+      SourceRange(SourceId::NONE, 0, size_t(UINT32_MAX) + 1),
+      std::out_of_range);
+}
+
+TEST(Lexer, MappedSourceMatchesSource) {
+  TempFile file(moduleSource);
+  auto mapped = std::make_shared<MappedSource>(file.path);
+  EXPECT_EQ(mapped->text(), moduleSource);
+  EXPECT_EQ(*mapped->filename(), file.path);
+  EXPECT_EQ(
+      tokenize(mapped), tokenize(std::make_shared<Source>(moduleSource)));
+  // Line offsets are computed on demand.
+  EXPECT_EQ(mapped->lineno_for_offset(mapped->text().find("def")), 1);
+}
+
+TEST(Lexer, MappedSourcePageSized) {
+  // A file that ends exactly on a page boundary, with a number as the last
+  // token, must still be null terminated.
+  std::string text(sysconf(_SC_PAGESIZE), ' ');
+  text[0] = '1';
+  text.back() = '2';
+  TempFile file(text);
+  auto tokens = tokenize(std::make_shared<MappedSource>(file.path));
+  ASSERT_EQ(tokens.size(), 3);
+  EXPECT_EQ(tokens[0].second, "1");
+  EXPECT_EQ(tokens[1].second, "2");
+}
+
+TEST(Lexer, MappedSourcesAreUnmapped) {
+  // Each of these takes two mappings, so the kernel's default limit of 65530
+  // would run out long before the end if the registry kept them all.
+  TempFile file("x = 1\n" + std::string(sysconf(_SC_PAGESIZE), '#'));
+  for (int i = 0; i < 40000; i++) {
+    auto source = std::make_shared<MappedSource>(file.path);
+    const std::weak_ptr<SourceView> weak = source;
+    {
+      Lexer L(std::move(source));
+      ASSERT_EQ(L.next().kind, TK_IDENT);
+    }
+    ASSERT_TRUE(weak.expired());
+  }
+}
+
+TEST(Lexer, MappedSourceMissingFile) {
+  EXPECT_THROW(
+      MappedSource("/nonexistent/minipy_lexer_test.py"), std::runtime_error);
+}
+
+} // namespace minipy
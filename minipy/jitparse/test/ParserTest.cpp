@@ -0,0 +1,523 @@
+#include <gtest/gtest.h>
+
+#include <optional>
+#include <thread>
+
+#include "minipy/jitparse/lexer.h"
+#include "minipy/jitparse/parser.h"
+#include "minipy/jitparse/test/ParserTestUtils.h"
+
+namespace minipy {
+
+static ParserOptions lazyOptions() {
+  ParserOptions options;
+  options.lazyFunctionBodies = true;
+  return options;
+}
+
+static const LazyCompound* lazyBody(const Def& def) {
+  return dynamic_cast<const LazyCompound*>(def.statements().get().get());
+}
+
+TEST(Parser, LazyFunctionBodies) {
+  const auto source = std::make_shared<Source>(moduleSource);
+  const auto eager = Parser(source).parseModule();
+  const auto lazy = Parser(source, lazyOptions()).parseModule();
+  ASSERT_EQ(lazy.body().size(), 4);
+
+  Def foo(lazy.body()[0]);
+  const LazyCompound* body = lazyBody(foo);
+  ASSERT_NE(body, nullptr);
+  EXPECT_FALSE(body->materialized());
+  // The type comment is part of the signature, so it's still parsed eagerly.
+  EXPECT_EQ(dump(foo.decl().get()), dump(Def(eager.body()[0]).decl().get()));
+  EXPECT_EQ(foo.statements().range().text().substr(0, 5), "z = [");
+  EXPECT_FALSE(body->materialized());
+
+  EXPECT_EQ(foo.statements().size(), 3);
+  EXPECT_TRUE(body->materialized());
+  // Nested functions are lazy too.
+  Def inner(foo.statements()[1]);
+  EXPECT_FALSE(lazyBody(inner)->materialized());
+
+  // One-line functions have nothing worth skipping.
+  EXPECT_EQ(lazyBody(Def(lazy.body()[1])), nullptr);
+
+  EXPECT_EQ(dump(eager.get()), dump(lazy.get()));
+}
+
+TEST(Parser, LazyBodyErrorsOnFirstUse) {
+  const auto source = std::make_shared<Source>(
+      "def broken():\n"
+      "    return 1 +\n"
+      "\n"
+      "def fine():\n"
+      "    return 1\n");
+  EXPECT_THROW(Parser(source).parseModule(), std::runtime_error);
+
+  const auto module = Parser(source, lazyOptions()).parseModule();
+  EXPECT_EQ(Def(module.body()[1]).statements().size(), 1);
+  const auto broken = Def(module.body()[0]).statements();
+  EXPECT_THROW(broken.size(), std::runtime_error);
+  // The error isn't cached away.
+  EXPECT_THROW(broken.size(), std::runtime_error);
+
+  // Without balanced brackets the end of a body can't be found at all.
+  const auto unbalanced =
+      std::make_shared<Source>("def f():\n    return )\nx = 1\n");
+  EXPECT_THROW(
+      Parser(unbalanced, lazyOptions()).parseModule(), std::runtime_error);
+}
+
+// Big enough to be split into several segments.
+static std::string bigModule() {
+  std::string src = "# header comment\n";
+  for (int i = 0; i < 2000; i++) {
+    const auto n = std::to_string(i);
+    src += "def f" + n + "(a, b):\n    return a + " + n + " * b\n\n";
+    src += "if f" + n + "(1, 2):\n    x = [1,\n2]\nelif x:\n    pass\n";
+    src += "else:\n    y = 'else:'\n";
+    src += "# def not_a_statement():\n";
+  }
+  return src;
+}
+
+TEST(Parser, ParallelMatchesSequential) {
+  const auto source = std::make_shared<Source>(bigModule());
+  ParserOptions options;
+  options.parallelism = 4;
+  const auto sequential = Parser(source).parseModule();
+  const auto parallel = Parser(source, options).parseModule();
+  EXPECT_EQ(parallel.body().size(), 4000);
+  EXPECT_EQ(sequential.range(), parallel.range());
+  EXPECT_EQ(dump(sequential.get()), dump(parallel.get()));
+
+  options.useArena = true;
+  options.lazyFunctionBodies = true;
+  const auto lazy = Parser(source, options).parseModule();
+  EXPECT_EQ(dump(sequential.get()), dump(lazy.get()));
+}
+
+TEST(Parser, ParallelReportsFirstError) {
+  auto text = bigModule();
+  text.insert(text.size() / 4, "x = (\n");
+  text += "y = )\n";
+  const auto source = std::make_shared<Source>(text);
+  std::string expected;
+  try {
+    Parser(source).parseModule();
+  } catch (const std::runtime_error& e) {
+    expected = e.what();
+  }
+  ASSERT_FALSE(expected.empty());
+  ParserOptions options;
+  options.parallelism = 4;
+  try {
+    Parser(source, options).parseModule();
+    ADD_FAILURE() << "expected a parse error";
+  } catch (const std::runtime_error& e) {
+    EXPECT_EQ(e.what(), expected);
+  }
+}
+
+// Sources with a syntax error each, found by the lexer or by the parser.
+static const char* const invalidSources[] = {
+    "x = $\n",
+    "def f(x):\n    return x\n  y = 1\n",
+    "x = (1,\n",
+    "if x:\npass\n",
+    "def f(:\n    pass\n",
+    "x = [1 for a in b, 2]\n",
+    "a: int = b = 1\n",
+    "a, b += 1\n",
+    "x = 1 +\n",
+    "def f():\n    return )\n",
+    "x = 'a\\x41'\n",
+};
+
+TEST(Parser, TryParseModule) {
+  const auto source = std::make_shared<Source>(moduleSource);
+  Diagnostic error;
+  const auto module = Parser(source).tryParseModule(&error);
+  ASSERT_TRUE(module);
+  EXPECT_FALSE(error);
+  EXPECT_EQ(dump(module->get()), dump(Parser(source).parseModule().get()));
+
+  for (const auto& options : {ParserOptions(), lazyOptions()}) {
+    for (const char* text : invalidSources) {
+      const auto invalid = std::make_shared<Source>(text);
+      std::string expected;
+      try {
+        Parser(invalid, options).parseModule();
+      } catch (const std::exception& e) {
+        expected = e.what();
+      }
+      Diagnostic error;
+      const auto result = Parser(invalid, options).tryParseModule(&error);
+      if (expected.empty()) {
+        // Only found once the lazy body is parsed.
+        EXPECT_TRUE(options.lazyFunctionBodies) << text;
+        EXPECT_TRUE(result) << text;
+        continue;
+      }
+      EXPECT_FALSE(result) << text;
+      ASSERT_TRUE(error) << text;
+      EXPECT_EQ(error.range.source(), invalid);
+      // The same message, just formatted later. Errors found after parsing,
+      // like bad escapes, are thrown as ErrorReports in their own format.
+      if (expected[0] != '\n') {
+        EXPECT_EQ(error.message(), expected);
+      }
+      EXPECT_FALSE(Parser(invalid, options).tryParseModule());
+    }
+  }
+}
+
+TEST(Parser, SourceIsFreedWithItsTrees) {
+  for (const auto& options : {ParserOptions(), lazyOptions()}) {
+    std::weak_ptr<SourceView> weak;
+    std::optional<Mod> module;
+    {
+      auto source = std::make_shared<Source>(moduleSource);
+      weak = source;
+      module = Parser(source, options).parseModule();
+    }
+    // The root keeps the source alive for the whole tree, and a lazy body can
+    // still be parsed from it.
+    EXPECT_FALSE(weak.expired());
+    EXPECT_TRUE(module->get()->holdsSource());
+    const Def def(module->body()[0].get());
+    EXPECT_FALSE(def.get()->holdsSource());
+    EXPECT_EQ(def.name().range().text(), "foo");
+    EXPECT_EQ(def.statements().size(), 3);
+    const SourceId id = def.range().source_id();
+    module.reset();
+    EXPECT_TRUE(weak.expired());
+    EXPECT_EQ(source_for_id(id), nullptr);
+  }
+
+  // As does a syntax error, until its message is formatted.
+  Diagnostic error;
+  std::weak_ptr<SourceView> weak;
+  {
+    auto source = std::make_shared<Source>("x = (1,\n");
+    weak = source;
+    EXPECT_FALSE(Parser(source).tryParseModule(&error));
+  }
+  EXPECT_NE(error.message().find("x = (1,"), std::string::npos);
+  error = Diagnostic();
+  EXPECT_TRUE(weak.expired());
+}
+
+TEST(Parser, ParseErrorCodes) {
+  const auto errorFor = [](const char* text) {
+    Diagnostic error;
+    Parser(std::make_shared<Source>(text)).tryParseModule(&error);
+    return error;
+  };
+  auto error = errorFor("x = $\n");
+  EXPECT_EQ(error.code, ParseErrorCode::INVALID_TOKEN);
+  EXPECT_EQ(error.range.text(), "$");
+  error = errorFor("def f(:\n    pass\n");
+  EXPECT_EQ(error.code, ParseErrorCode::UNEXPECTED_TOKEN);
+  EXPECT_EQ(error.found, ':');
+  EXPECT_EQ(error.expected, TK_IDENT);
+  EXPECT_EQ(error.message().substr(0, 28), "expected ident but found ':'");
+  EXPECT_EQ(
+      errorFor("def f(x):\n    return x\n  y = 1\n").code,
+      ParseErrorCode::INVALID_INDENT);
+  EXPECT_EQ(errorFor("a, b += 1\n").code, ParseErrorCode::INVALID_SYNTAX);
+
+  ParserOptions options = lazyOptions();
+  const auto unbalanced = std::make_shared<Source>("def f():\n    return )\n");
+  error = Diagnostic();
+  EXPECT_FALSE(Parser(unbalanced, options).tryParseModule(&error));
+  EXPECT_EQ(error.code, ParseErrorCode::UNMATCHED_BRACKET);
+
+  // Thrown errors carry the same diagnostic.
+  try {
+    Parser(std::make_shared<Source>("x = $\n")).parseModule();
+    ADD_FAILURE() << "expected a parse error";
+  } catch (const ParseError& e) {
+    EXPECT_EQ(e.diagnostic().code, ParseErrorCode::INVALID_TOKEN);
+    EXPECT_EQ(e.what(), e.diagnostic().message());
+    // The message is formatted when the error is thrown, so what() reads the
+    // same from any thread.
+    std::string message;
+    std::thread([&] { message = e.what(); }).join();
+    EXPECT_EQ(message, e.what());
+  }
+}
+
+TEST(Parser, ReplayTokenStream) {
+  const auto source = std::make_shared<Source>(bigModule());
+  const auto tokens =
+      std::make_shared<TokenStream>(TokenStream::capture(source));
+  const auto expected = dump(Parser(source).parseModule().get());
+  // Options that need to lex the source are ignored.
+  ParserOptions options = lazyOptions();
+  options.parallelism = 4;
+  EXPECT_EQ(dump(Parser(tokens, options).parseModule().get()), expected);
+  // Lexed on this thread, parsed on another.
+  std::string parsed;
+  std::thread([&] {
+    parsed = dump(Parser(tokens).parseModule().get());
+  }).join();
+  EXPECT_EQ(parsed, expected);
+
+  for (const char* text : invalidSources) {
+    const auto invalid = std::make_shared<Source>(text);
+    std::string message;
+    try {
+      Parser(invalid).parseModule();
+    } catch (const std::exception& e) {
+      message = e.what();
+    }
+    const auto stream =
+        std::make_shared<TokenStream>(TokenStream::capture(invalid));
+    try {
+      Parser(stream).parseModule();
+      ADD_FAILURE() << "expected a parse error for " << text;
+    } catch (const std::exception& e) {
+      EXPECT_EQ(e.what(), message);
+    }
+  }
+}
+
+static constexpr auto reparseSource = R"SCRIPT(# leading comment
+def foo(x, y):
+    z = [x + 1,
+y * 2]
+    return z
+
+if foo(1, 2):
+    a = 'if:'
+elif a:
+    pass
+else:
+    b = """
+x = 1
+"""
+
+def bar():
+    return (1 +
+  2)
+bar()
+)SCRIPT";
+
+// Parses `text` from scratch and by reparsing `previous` after `edit`, and
+// checks that the two agree, even if that's on a syntax error.
+// Compares the ranges of two trees that dump() the same.
+static void expectSameRanges(const TreeRef& a, const TreeRef& b) {
+  if (a->isAtom()) {
+    return;
+  }
+  ASSERT_EQ(a->range(), b->range()) << a;
+  // Lazy bodies with syntax errors have to report them at the same place.
+  std::string a_error, b_error;
+  try {
+    a->trees();
+  } catch (const std::runtime_error& e) {
+    a_error = e.what();
+  }
+  try {
+    b->trees();
+  } catch (const std::runtime_error& e) {
+    b_error = e.what();
+  }
+  ASSERT_EQ(a_error, b_error);
+  if (!a_error.empty()) {
+    return;
+  }
+  ASSERT_EQ(a->trees().size(), b->trees().size());
+  for (size_t i = 0; i < a->trees().size(); i++) {
+    expectSameRanges(a->trees()[i], b->trees()[i]);
+  }
+}
+
+static void expectSameReparse(
+    const Mod& previous,
+    const std::string& text,
+    const TextEdit& edit,
+    const ParserOptions& options = {}) {
+  const auto source = std::make_shared<Source>(text);
+  std::string expected, actual;
+  std::optional<Mod> parsed, reparsed;
+  try {
+    parsed = Parser(source, options).parseModule();
+    expected = dump(parsed->get());
+  } catch (const std::runtime_error& e) {
+    expected = e.what();
+  }
+  try {
+    reparsed = Parser(source, options).reparseModule(previous, edit);
+    actual = dump(reparsed->get());
+  } catch (const std::runtime_error& e) {
+    actual = e.what();
+  }
+  EXPECT_EQ(expected, actual) << "after replacing " << edit.removed
+                              << " bytes at " << edit.offset << " by '"
+                              << edit.inserted << "'";
+  if (parsed && reparsed && expected == actual) {
+    expectSameRanges(parsed->get(), reparsed->get());
+  }
+}
+
+// The first leaf of `tree`, or nullptr if it has none. Statements that a
+// reparse reuses are copies that share their leaves with the original.
+static const Tree* firstLeaf(const TreeRef& tree) {
+  if (tree->isAtom()) {
+    return tree.get();
+  }
+  for (const auto& t : tree->trees()) {
+    if (const Tree* leaf = firstLeaf(t)) {
+      return leaf;
+    }
+  }
+  return nullptr;
+}
+
+static bool reused(const Stmt& stmt, const Stmt& old) {
+  return firstLeaf(stmt.get()) == firstLeaf(old.get());
+}
+
+static std::string applyEdit(const std::string& text, const TextEdit& edit) {
+  return text.substr(0, edit.offset) + edit.inserted +
+      text.substr(edit.offset + edit.removed);
+}
+
+TEST(Parser, ReparseEveryOffset) {
+  const std::string text = reparseSource;
+  for (const auto& options : {ParserOptions(), lazyOptions()}) {
+    const auto previous =
+        Parser(std::make_shared<Source>(text), options).parseModule();
+    for (size_t offset = 0; offset <= text.size(); offset++) {
+      for (const char* inserted :
+           {"", " ", "\n", "x", "#", "(", "\"", "else"}) {
+        const size_t removed = *inserted || offset == text.size() ? 0 : 1;
+        const TextEdit edit{offset, removed, inserted};
+        expectSameReparse(previous, applyEdit(text, edit), edit, options);
+      }
+    }
+  }
+}
+
+TEST(Parser, ReparseReusesUnchangedStatements) {
+  const std::string text = reparseSource;
+  const auto previous = Parser(std::make_shared<Source>(text)).parseModule();
+  ASSERT_EQ(previous.body().size(), 4);
+
+  // Edit the body of bar().
+  TextEdit edit{text.find("1 +"), 1, "100"};
+  const auto source = std::make_shared<Source>(applyEdit(text, edit));
+  const auto module = Parser(source).reparseModule(previous, edit);
+  ASSERT_EQ(module.body().size(), 4);
+  EXPECT_TRUE(reused(module.body()[0], previous.body()[0]));
+  EXPECT_TRUE(reused(module.body()[1], previous.body()[1]));
+  EXPECT_FALSE(reused(module.body()[2], previous.body()[2]));
+  EXPECT_TRUE(reused(module.body()[3], previous.body()[3]));
+  EXPECT_EQ(module.range(), Parser(source).parseModule().range());
+  // Reused statements are moved into the new source.
+  for (size_t i = 0; i < module.body().size(); i++) {
+    EXPECT_EQ(module.body()[i].range().source(), source);
+  }
+  EXPECT_EQ(module.body()[3].range().text().substr(0, 3), "bar");
+
+  // Without being parsed again: bodies that weren't parsed yet still aren't.
+  const auto lazy =
+      Parser(std::make_shared<Source>(text), lazyOptions()).parseModule();
+  const auto relaxed =
+      Parser(source, lazyOptions()).reparseModule(lazy, edit);
+  EXPECT_FALSE(lazyBody(Def(relaxed.body()[0].get()))->materialized());
+  EXPECT_EQ(dump(relaxed.get()), dump(module.get()));
+
+  // The statement before an edit is parsed again too, in case the edit
+  // continues it (e.g. with an `else`).
+  edit = TextEdit{text.find("def bar"), 0, "\n\n"};
+  const auto spaced = Parser(std::make_shared<Source>(applyEdit(text, edit)))
+                          .reparseModule(previous, edit);
+  EXPECT_TRUE(reused(spaced.body()[0], previous.body()[0]));
+  EXPECT_FALSE(reused(spaced.body()[1], previous.body()[1]));
+  EXPECT_TRUE(reused(spaced.body()[2], previous.body()[2]));
+
+  // Lines after an edit that adds some are where they are now.
+  edit = TextEdit{0, 0, "\n\n"};
+  const auto moved = std::make_shared<Source>(applyEdit(text, edit));
+  const auto shifted = Parser(moved).reparseModule(previous, edit);
+  for (size_t i = 0; i < shifted.body().size(); i++) {
+    const size_t start = previous.body()[i].range().start();
+    EXPECT_EQ(
+        moved->lineno_for_offset(shifted.body()[i].range().start()),
+        previous.range().source()->lineno_for_offset(start) + 2);
+  }
+
+  // The edit has to match the text.
+  EXPECT_THROW(
+      Parser(source).reparseModule(previous, TextEdit{0, 1, "#"}),
+      std::runtime_error);
+}
+
+TEST(Parser, ReparseReleasesOldSources) {
+  std::string text = reparseSource;
+  std::weak_ptr<SourceView> first, second;
+  std::optional<Mod> module;
+  {
+    auto source = std::make_shared<Source>(text);
+    first = source;
+    const auto v0 = Parser(source).parseModule();
+    TextEdit edit{text.find("1 +"), 1, "100"};
+    text = applyEdit(text, edit);
+    source = std::make_shared<Source>(text);
+    second = source;
+    const auto v1 = Parser(source).reparseModule(v0, edit);
+    edit = TextEdit{0, 0, "\n"};
+    text = applyEdit(text, edit);
+    module = Parser(std::make_shared<Source>(text)).reparseModule(v1, edit);
+  }
+  // Reused statements hold on to the trees they're copied from until they
+  // have been copied.
+  EXPECT_FALSE(first.expired());
+  EXPECT_EQ(
+      dump(module->get()),
+      dump(Parser(std::make_shared<Source>(text)).parseModule().get()));
+  EXPECT_TRUE(first.expired());
+  EXPECT_TRUE(second.expired());
+}
+
+TEST(Parser, ReparseRepeatedly) {
+  std::string text = bigModule();
+  ParserOptions options;
+  options.useArena = true;
+  auto module = Parser(std::make_shared<Source>(text), options).parseModule();
+  // Also start from a module that didn't come straight from the parser.
+  auto copy = Mod::create(
+      module.range(),
+      List<Stmt>(Compound::create(
+          TK_LIST,
+          module.body().range(),
+          TreeList(module.body().get()->trees()))));
+  size_t offset = 0;
+  for (int i = 0; i < 4; i++) {
+    // Grow a number somewhere, front to back, and then shrink it again.
+    TextEdit edit{offset, 5, "6"};
+    if (i % 2 == 0) {
+      offset = text.find_first_of("0123456789", i * text.size() / 4);
+      edit = TextEdit{offset, 1, "12345"};
+    }
+    text = applyEdit(text, edit);
+    if (i == 0) {
+      expectSameReparse(copy, text, edit);
+    }
+    expectSameReparse(module, text, edit);
+    const auto previous = module;
+    module = Parser(std::make_shared<Source>(text), options)
+                 .reparseModule(previous, edit);
+    size_t num_reused = 0;
+    for (size_t j = 0; j < module.body().size(); j++) {
+      num_reused += reused(module.body()[j], previous.body()[j]);
+    }
+    EXPECT_GE(num_reused, module.body().size() - 2);
+  }
+}
+
+} // namespace minipy
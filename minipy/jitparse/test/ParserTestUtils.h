@@ -0,0 +1,43 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+#include "minipy/jitparse/tree.h"
+
+namespace minipy {
+
+// A small module that touches most of the grammar: a def with a type comment,
+// defaults and a nested def, numbers in several forms, implicitly
+// concatenated strings, a bracketed continuation line, a one-line def and
+// top-level code.
+constexpr auto moduleSource = R"SCRIPT(
+def foo(x, y=1.5e3):
+    # type: (int, float) -> float
+    z = [x + 1, y * 2, 0x1f, 3j, 99999999999999999999]
+    def inner(a):
+        while a:
+            a -= 1
+        if a is not None:
+            return a
+        return (a +
+    1)
+    return inner(z[0]).bar(x, key='a' "b")
+
+def one_liner(x): return x
+
+def bar():
+    """doc"""
+    while True:
+        pass
+foo(1, 2.5)
+)SCRIPT";
+
+// The s-expression form of `tree`, for comparing trees in tests.
+inline std::string dump(const TreeRef& tree) {
+  std::stringstream ss;
+  ss << tree;
+  return ss.str();
+}
+
+} // namespace minipy
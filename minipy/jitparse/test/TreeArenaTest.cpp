@@ -0,0 +1,72 @@
+#include <gtest/gtest.h>
+
+#include "minipy/jitparse/parser.h"
+#include "minipy/jitparse/test/ParserTestUtils.h"
+
+namespace minipy {
+
+TEST(TreeArena, MatchesHeapParse) {
+  Parser heapParser(std::make_shared<Source>(moduleSource));
+  const auto heapAst = heapParser.parseModule();
+  EXPECT_FALSE(heapAst.body().get()->inArena());
+  EXPECT_TRUE(ArenaRoot::arenasOf(heapAst.get()).empty());
+
+  Parser arenaParser(std::make_shared<Source>(moduleSource), /*useArena=*/true);
+  const auto arenaAst = arenaParser.parseModule();
+  // The root is on the heap, holding the arena the rest of the tree is in.
+  EXPECT_FALSE(arenaAst.get()->inArena());
+  const auto arenas = ArenaRoot::arenasOf(arenaAst.get());
+  ASSERT_EQ(arenas.size(), 1u);
+  EXPECT_GT(arenas[0]->bytesAllocated(), 0);
+
+  EXPECT_EQ(dump(heapAst.get()), dump(arenaAst.get()));
+  // All other nodes, including atoms, come from the arena.
+  EXPECT_TRUE(arenaAst.body().get()->inArena());
+  for (const auto& stmt : arenaAst.body()) {
+    EXPECT_TRUE(stmt.get()->inArena());
+  }
+  Def def(arenaAst.body()[0]);
+  EXPECT_TRUE(def.name().get()->inArena());
+}
+
+TEST(TreeArena, RootOutlivesParser) {
+  const Mod module = [] {
+    Parser p(std::make_shared<Source>(moduleSource), /*useArena=*/true);
+    return p.parseModule();
+  }();
+  // The parser is gone, but the root keeps the arena alive.
+  EXPECT_TRUE(module.body().get()->inArena());
+  EXPECT_EQ(Def(module.body()[0]).name().name(), "foo");
+}
+
+TEST(TreeArena, ReparseKeepsPreviousArena) {
+  const std::string text = std::string(moduleSource) + "x = 1\n";
+  const TextEdit edit{text.size(), 0, "y = 2\n"};
+  const auto edited = std::make_shared<Source>(text + edit.inserted);
+  const Mod reparsed = [&] {
+    const Mod previous =
+        Parser(std::make_shared<Source>(text), /*useArena=*/true)
+            .parseModule();
+    return Parser(edited, /*useArena=*/true).reparseModule(previous, edit);
+  }();
+  // The previous module is gone, but the statements reused from it, and
+  // copied on first use, still have its arena.
+  EXPECT_NE(reusedFrom(reparsed.body()[0].get()), nullptr);
+  EXPECT_EQ(dump(reparsed.get()), dump(Parser(edited).parseModule().get()));
+}
+
+TEST(TreeArena, ScopeRestoresHeap) {
+  auto arena = c10::make_intrusive<TreeArena>();
+  {
+    TreeArena::Scope scope(arena);
+    EXPECT_TRUE(String::create("a")->inArena());
+    {
+      TreeArena::Scope heap(c10::intrusive_ptr<TreeArena>{});
+      EXPECT_FALSE(String::create("b")->inArena());
+    }
+    EXPECT_TRUE(String::create("c")->inArena());
+  }
+  EXPECT_FALSE(String::create("d")->inArena());
+}
+
+} // namespace minipy
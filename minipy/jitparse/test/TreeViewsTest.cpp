@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+
+#include <limits>
+
+#include "minipy/jitparse/parser.h"
+
+namespace minipy {
+
+TEST(TreeViews, ParsedStmtListsAreMarked) {
+  Parser p(std::make_shared<Source>("def foo(x):\n    return x\n\nfoo(1)\n"));
+  auto mod = p.parseModule();
+  EXPECT_TRUE(mod.body().get()->isStmtList());
+  Def def(mod.body()[0]);
+  EXPECT_FALSE(def.decl().params().get()->isStmtList());
+  EXPECT_TRUE(def.statements().get()->isStmtList());
+}
+
+TEST(TreeViews, ConstValues) {
+  Parser p(std::make_shared<Source>("[7, 1.25, 0x10, -3, 9223372036854775808]"));
+  ListLiteral list(p.parseExp());
+  auto inputs = list.inputs();
+  EXPECT_EQ(Const(inputs[0]).asIntegral(), 7);
+  EXPECT_TRUE(Const(inputs[1]).isFloatingPoint());
+  EXPECT_EQ(Const(inputs[1]).asFloatingPoint(), 1.25);
+  EXPECT_EQ(Const(inputs[2]).asIntegral(), 16);
+  EXPECT_EQ(Const(inputs[3]).asIntegral(), -3);
+  EXPECT_THROW(Const(inputs[4]).asIntegral(), ErrorReport);
+
+  // Consts that aren't number literals are still parsed from their text.
+  auto inf = Const::create(SourceRange(), "inf");
+  EXPECT_TRUE(inf.isFloatingPoint());
+  EXPECT_EQ(inf.asFloatingPoint(), std::numeric_limits<double>::infinity());
+}
+
+TEST(TreeViews, ListsAreCheckedPerElementType) {
+  SourceRange range;
+  auto ident = Ident::create(range, "x");
+  auto list = List<Ident>::create(range, {ident}).get();
+  List<Ident> idents(list);
+  EXPECT_EQ(idents[0].name(), "x");
+  // Only the parser's statement lists are taken on trust.
+  EXPECT_FALSE(list->isStmtList());
+  EXPECT_THROW(List<Stmt>{list}, std::exception);
+}
+
+} // namespace minipy
@@ -1,13 +1,19 @@
 #pragma once
 
+#include <atomic>
+#include <cassert>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <typeinfo>
 #include <unordered_map>
 #include <vector>
 
+#include "minipy/common/Symbol.h"
 #include "minipy/common/intrusive_ptr.h"
 #include "minipy/jitparse/lexer.h"
+#include "minipy/jitparse/tree_arena.h"
 
 namespace minipy {
 // Trees are used to represent all forms of TC IR, pre- and post-typechecking.
@@ -21,7 +27,9 @@ namespace minipy {
 // operators like '+' are represented using the character itself (so, add.kind()
 // would be '+'). Each Compound object also contains a list of subtrees and is
 // associated with a SourceRange for error reporting.
-// Memory management of trees is done using intrusive_ptr.
+// Memory management of trees is done using intrusive_ptr. Nodes created while
+// a TreeArena::Scope is active are allocated from that arena (see
+// tree_arena.h).
 
 struct Tree;
 // TODO originall intrusive ptr
@@ -32,7 +40,11 @@ using TreeList = std::vector<TreeRef>;
 static const TreeList empty_trees = {};
 
 struct Tree : public c10::intrusive_ptr_target {
-  Tree(int kind_) : kind_(kind_) {}
+  Tree(int kind_)
+      : stmt_list_(false),
+        in_arena_(TreeArena::isNewNode(this)),
+        holds_source_(false),
+        kind_(kind_) {}
   int kind() const {
     return kind_;
   }
@@ -45,12 +57,87 @@ struct Tree : public c10::intrusive_ptr_target {
   virtual const std::string& stringValue() const {
     throw std::runtime_error("stringValue can only be called on TK_STRING");
   }
+  virtual Symbol symbol() const {
+    throw std::runtime_error(
+        "symbol can only be called on an interned TK_STRING");
+  }
+  // The parsed value of a numeric TK_STRING, or nullptr.
+  virtual const NumberLiteral* number() const {
+    return nullptr;
+  }
   virtual const TreeList& trees() const {
     return empty_trees;
   }
   const TreeRef& tree(size_t i) const {
     return trees().at(i);
   }
+  // Set by the parser on the statement lists it builds, so that List<Stmt>
+  // can take their elements on trust instead of checking every statement (or,
+  // for a lazy function body, parsing them all). Only set while the tree is
+  // being built, before anything else can see it.
+  bool isStmtList() const {
+    return stmt_list_;
+  }
+  void setStmtList() {
+    stmt_list_ = true;
+  }
+  // Whether this node was allocated from a TreeArena rather than the heap.
+  bool inArena() const {
+    return in_arena_;
+  }
+
+  /**
+   * While a SourceScope for a source is active on a thread, Compounds created
+   * on it with a range in that source don't keep the source alive themselves.
+   * Whoever builds the tree has the root do that for all of them instead, with
+   * holdSource(). The parser does, so that building a tree doesn't touch the
+   * source's count once per node: threads parsing a module in parallel would
+   * all contend on it. Subtrees of such a tree mustn't be used past its root
+   * unless the source is held too (e.g. with a SourceRef).
+   */
+  class SourceScope {
+   public:
+    explicit SourceScope(SourceId source) : prev_(current()) {
+      current() = source;
+    }
+    ~SourceScope() {
+      current() = prev_;
+    }
+    SourceScope(const SourceScope&) = delete;
+    SourceScope& operator=(const SourceScope&) = delete;
+
+    // The source of the innermost active scope, or SourceId::NONE.
+    static SourceId& current() {
+      static thread_local SourceId source = SourceId::NONE;
+      return source;
+    }
+
+   private:
+    SourceId prev_;
+  };
+  // Makes this node, the root of a tree built in a SourceScope, keep the
+  // source its range is in alive, if it doesn't yet. Only called while the
+  // tree is being built, before anything else can see it.
+  void holdSource() {
+    if (!isAtom() && !holds_source_) {
+      retain_source(range().source_id());
+      holds_source_ = true;
+    }
+  }
+  // Whether this node keeps the source its range is in alive.
+  bool holdsSource() const {
+    return holds_source_;
+  }
+  // For the SymbolTable: the id of the block (scope) that this Def, ClassDef
+  // or Mod opens, in the table that was last built over it. This is a cache
+  // on an immutable tree. Trees can be in several tables at
+  // once, so a table checks that the id is one of its own before using it.
+  uint32_t blockId() const {
+    return block_id_.load(std::memory_order_relaxed);
+  }
+  void setBlockId(uint32_t id) const {
+    block_id_.store(id, std::memory_order_relaxed);
+  }
   virtual TreeRef map(const std::function<TreeRef(TreeRef)>& fn) {
     (void)fn;
     c10::raw::intrusive_ptr::incref(this); // we are creating a new pointer
@@ -88,6 +175,10 @@ struct Tree : public c10::intrusive_ptr_target {
       range().highlight(ss);
       throw std::runtime_error(ss.str());
     }
+    if (expected_subtrees == 0 && allow_more) {
+      // Nothing to check, and trees() may be expensive (see LazyCompound).
+      return;
+    }
     if (trees().size() < expected_subtrees ||
         (!allow_more && trees().size() != expected_subtrees)) {
       std::stringstream ss;
@@ -100,8 +191,31 @@ struct Tree : public c10::intrusive_ptr_target {
   }
   virtual ~Tree() = default;
 
+  static void* operator new(size_t size) {
+    return TreeArena::allocateNode(size);
+  }
+  static void operator delete(void* p) {
+    TreeArena::freeNode(p);
+  }
+
  private:
-  int kind_;
+  void delete_self() override {
+    if (in_arena_) {
+      // The arena's memory is freed all at once.
+      this->~Tree();
+    } else {
+      delete this;
+    }
+  }
+
+  // Ordered and sized to fit in the tail padding of intrusive_ptr_target, so
+  // a Tree is no bigger than its refcounts.
+  bool stmt_list_ : 1;
+  const bool in_arena_ : 1;
+  bool holds_source_ : 1;
+  int16_t kind_;
+  mutable std::atomic<uint32_t> block_id_{0};
+  static_assert(kNumTokenKinds <= INT16_MAX, "kind_ is too small");
 };
 
 struct String : public Tree {
@@ -118,24 +232,77 @@ struct String : public Tree {
   std::string value_;
 };
 
+// A TK_STRING whose value is an interned Symbol, used for identifiers.
+struct InternedString : public Tree {
+  InternedString(Symbol value) : Tree(TK_STRING), value_(value) {}
+  const std::string& stringValue() const override {
+    return value_.str();
+  }
+  Symbol symbol() const override {
+    return value_;
+  }
+  static TreeRef create(Symbol value) {
+    return c10::make_intrusive<InternedString>(value);
+  }
+
+ private:
+  Symbol value_;
+};
+
+// A TK_STRING holding the text of a numeric literal along with its value, so
+// that Const doesn't have to parse the text again.
+struct NumberString : public Tree {
+  NumberString(std::string text, const NumberLiteral& value)
+      : Tree(TK_STRING), text_(std::move(text)), value_(value) {}
+  const std::string& stringValue() const override {
+    return text_;
+  }
+  const NumberLiteral* number() const override {
+    return &value_;
+  }
+  static TreeRef create(std::string text, const NumberLiteral& value) {
+    return c10::make_intrusive<NumberString>(std::move(text), value);
+  }
+
+ private:
+  std::string text_;
+  NumberLiteral value_;
+};
+
 static SourceRange mergeRanges(SourceRange c, const TreeList& others) {
   for (const auto& t : others) {
     if (t->isAtom())
       continue;
     size_t s = std::min(c.start(), t->range().start());
     size_t e = std::max(c.end(), t->range().end());
-    c = SourceRange(c.source(), s, e);
+    c = SourceRange(c.source_id(), s, e);
   }
   return c;
 }
 
+// A Compound keeps the source its range is in alive (see SourceRef), so a
+// tree can be used without holding on to its source separately; unless it's
+// created in a SourceScope for that source, which leaves it to the root.
 struct Compound : public Tree {
   Compound(int kind, SourceRange range)
-      : Tree(kind), range_(std::move(range)) {}
+      : Tree(kind), range_(std::move(range)) {
+    if (range_.source_id() != SourceScope::current()) {
+      holdSource();
+    }
+  }
   Compound(int kind, const SourceRange& range_, TreeList&& trees_)
       : Tree(kind),
         range_(mergeRanges(range_, trees_)),
-        trees_(std::move(trees_)) {}
+        trees_(std::move(trees_)) {
+    if (this->range_.source_id() != SourceScope::current()) {
+      holdSource();
+    }
+  }
+  ~Compound() override {
+    if (holdsSource()) {
+      release_source(range_.source_id());
+    }
+  }
   const TreeList& trees() const override {
     return trees_;
   }
@@ -160,11 +327,135 @@ struct Compound : public Tree {
     return range_;
   }
 
+ protected:
+  void share_referents() override {
+    Tree::share_referents();
+    for (const auto& t : trees_) {
+      t->share();
+    }
+  }
+
  private:
   SourceRange range_;
   TreeList trees_;
 };
 
+// The arenas that an ArenaRoot keeps alive. A base of ArenaRoot ahead of
+// Compound, so that it's destroyed after the subtrees are.
+struct ArenaRefs {
+  std::vector<c10::intrusive_ptr<TreeArena>> arenas;
+};
+
+// The root of a tree whose other nodes are in TreeArenas, which it keeps alive
+// for them: arena nodes don't refer to their arena. Subtrees must not be kept
+// past their root unless its arenas are held too (see arenasOf()).
+struct ArenaRoot : private ArenaRefs, public Compound {
+  ArenaRoot(
+      const Tree& root,
+      std::vector<c10::intrusive_ptr<TreeArena>> arenas)
+      : ArenaRefs{std::move(arenas)},
+        Compound(root.kind(), root.range(), TreeList(root.trees())) {}
+  // A copy of `root`, a plain Compound, on the heap and holding `arenas`; or
+  // `root` itself if there are no arenas.
+  static TreeRef create(
+      const TreeRef& root,
+      std::vector<c10::intrusive_ptr<TreeArena>> arenas) {
+    if (arenas.empty()) {
+      return root;
+    }
+    assert(typeid(*root) == typeid(Compound));
+    TreeArena::Scope heap(c10::intrusive_ptr<TreeArena>{});
+    return c10::make_intrusive<ArenaRoot>(*root, std::move(arenas));
+  }
+  // The arenas that `root` keeps alive, if it's an ArenaRoot.
+  static std::vector<c10::intrusive_ptr<TreeArena>> arenasOf(
+      const TreeRef& root) {
+    const auto* arena_root = dynamic_cast<const ArenaRoot*>(root.get());
+    return arena_root ? arena_root->arenas
+                      : std::vector<c10::intrusive_ptr<TreeArena>>();
+  }
+
+ protected:
+  void share_referents() override {
+    for (const auto& arena : arenas) {
+      arena->share();
+    }
+    Compound::share_referents();
+  }
+};
+
+// A Compound whose subtrees are only computed the first time anything asks
+// for them, by a callback that returns a Compound of the same kind to take
+// them from. The parser uses this to put off parsing function bodies (see
+// ParserOptions::lazyFunctionBodies). If the callback throws, trees() rethrows
+// the error, and tries again on the next call.
+//
+// The range is fixed up front, since the subtrees aren't known yet.
+struct LazyCompound : public Compound {
+  LazyCompound(
+      int kind,
+      const SourceRange& range,
+      std::function<TreeRef()> materialize)
+      : Compound(kind, range), materialize_(std::move(materialize)) {}
+  const TreeList& trees() const override {
+    // Not std::call_once: it doesn't cope with exceptions everywhere.
+    if (!materialized()) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (!materialized_.load(std::memory_order_relaxed)) {
+        // Not from whichever arena the caller has active: this may run on any
+        // thread, long after the parser is gone. Whatever keeps this node's
+        // source alive does for the subtrees too.
+        TreeArena::Scope heap(c10::intrusive_ptr<TreeArena>{});
+        SourceScope source(range().source_id());
+        TreeRef tree = materialize_();
+        tree->match(kind());
+        if (is_shared()) {
+          tree->share();
+        }
+        tree_ = std::move(tree);
+        materialize_ = nullptr;
+        materialized_.store(true, std::memory_order_release);
+      }
+    }
+    return tree_->trees();
+  }
+  // Whether trees() has been computed yet.
+  bool materialized() const {
+    return materialized_.load(std::memory_order_acquire);
+  }
+  static TreeRef create(
+      int kind,
+      const SourceRange& range,
+      std::function<TreeRef()> materialize) {
+    return c10::make_intrusive<LazyCompound>(
+        kind, range, std::move(materialize));
+  }
+
+ protected:
+  void share_referents() override {
+    Compound::share_referents();
+    // Under the lock, so that a trees() in progress either sees is_shared()
+    // and shares what it materializes, or has finished and is shared here.
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (materialized_.load(std::memory_order_relaxed)) {
+      tree_->share();
+    }
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  mutable std::atomic<bool> materialized_{false};
+  mutable std::function<TreeRef()> materialize_;
+  mutable TreeRef tree_;
+};
+
+// TreeArena only guarantees pointer alignment.
+static_assert(alignof(String) <= alignof(void*), "");
+static_assert(alignof(InternedString) <= alignof(void*), "");
+static_assert(alignof(NumberString) <= alignof(void*), "");
+static_assert(alignof(Compound) <= alignof(void*), "");
+static_assert(alignof(LazyCompound) <= alignof(void*), "");
+
 // tree pretty printer
 struct pretty_tree {
   pretty_tree(const TreeRef& tree, size_t col = 40) : tree(tree), col(col) {}
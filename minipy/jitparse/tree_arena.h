@@ -0,0 +1,113 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "minipy/common/intrusive_ptr.h"
+
+namespace minipy {
+
+/**
+ * class TreeArena
+ *
+ * A bump allocator for Tree nodes. While a TreeArena::Scope is active on a
+ * thread, every Tree created on that thread (Compound::create, String::create,
+ * the TreeView create() methods, ...) is carved out of the arena instead of
+ * being a separate heap allocation. The nodes are still ordinary
+ * intrusive_ptr-managed Trees, so TreeRef and the TreeView wrappers don't
+ * change.
+ *
+ * Arena nodes carry no header and don't refer to their arena: the arena's
+ * memory is only released as a whole, once the last reference to the arena is
+ * dropped. Destroying a node runs its destructor but doesn't return its bytes.
+ * Whoever hands out arena trees keeps the arena alive for them (see ArenaRoot
+ * in tree.h), and the nodes mustn't outlive it.
+ */
+class TreeArena : public c10::intrusive_ptr_target {
+ public:
+  TreeArena() = default;
+  TreeArena(const TreeArena&) = delete;
+  TreeArena& operator=(const TreeArena&) = delete;
+
+  // Total bytes handed out to nodes.
+  size_t bytesAllocated() const {
+    return bytesAllocated_;
+  }
+
+  /**
+   * Makes `arena` the destination of all Tree allocations on this thread for
+   * the lifetime of the Scope. Scopes nest; a null `arena` means the heap.
+   */
+  class Scope {
+   public:
+    explicit Scope(c10::intrusive_ptr<TreeArena> arena)
+        : arena_(std::move(arena)), prev_(current()) {
+      current() = arena_.get();
+    }
+    ~Scope() {
+      current() = prev_;
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    c10::intrusive_ptr<TreeArena> arena_;
+    TreeArena* prev_;
+  };
+
+  // Allocation hooks for Tree::operator new/delete.
+  static void* allocateNode(size_t size) {
+    if (TreeArena* arena = current()) {
+      return arena->allocate(size);
+    }
+    return ::operator new(size);
+  }
+  // Only called for heap nodes, and for arena nodes whose constructor threw,
+  // which were the last allocation from the active arena.
+  static void freeNode(void* node) {
+    if (!isNewNode(node)) {
+      ::operator delete(node);
+    }
+  }
+  // Whether `node`, which is being constructed, came from the active arena.
+  // Tree records this, since freeNode() can't tell the two apart otherwise.
+  static bool isNewNode(const void* node) {
+    TreeArena* arena = current();
+    return arena && arena->cur_ &&
+        static_cast<const char*>(node) >= arena->chunks_.back().get() &&
+        static_cast<const char*>(node) < arena->cur_;
+  }
+
+ private:
+  static constexpr size_t kAlignment = alignof(void*);
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+  static TreeArena*& current() {
+    static thread_local TreeArena* arena = nullptr;
+    return arena;
+  }
+
+  void* allocate(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    if (static_cast<size_t>(end_ - cur_) < size) {
+      const size_t chunkSize = std::max(size, kChunkSize);
+      chunks_.emplace_back(new char[chunkSize]);
+      cur_ = chunks_.back().get();
+      end_ = cur_ + chunkSize;
+    }
+    void* result = cur_;
+    cur_ += size;
+    bytesAllocated_ += size;
+    return result;
+  }
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  char* cur_ = nullptr;
+  char* end_ = nullptr;
+  size_t bytesAllocated_ = 0;
+};
+
+} // namespace minipy
@@ -6,6 +6,15 @@
 #include <functional>
 #include <iostream>
 #include <string>
+#include <type_traits>
+
+// List<Stmt> trusts the statement lists the parser marks with
+// Tree::setStmtList(). Building with MINIPY_TRUST_STMT_LISTS=0 makes it check
+// them on every view instead, which symtable_benchmark uses to measure what
+// that saves.
+#ifndef MINIPY_TRUST_STMT_LISTS
+#define MINIPY_TRUST_STMT_LISTS 1
+#endif
 
 namespace minipy {
 
@@ -153,6 +162,8 @@ struct ListIterator {
   TreeList::const_iterator it;
 };
 
+struct Stmt;
+
 template <typename T>
 struct List : public TreeView {
   using iterator = ListIterator<T>;
@@ -160,6 +171,10 @@ struct List : public TreeView {
 
   List(const TreeRef& tree) : TreeView(tree) {
     tree->match(TK_LIST);
+    if (MINIPY_TRUST_STMT_LISTS && std::is_same<T, Stmt>::value &&
+        tree->isStmtList()) {
+      return;
+    }
     // Iterate over list to temporarily instantiate Ts that will check the type
     for (const T& elem : *this) {
       (void)elem; // silence unused warning
@@ -224,8 +239,15 @@ struct Ident : public TreeView {
   const std::string& name() const {
     return subtree(0)->stringValue();
   }
-  static Ident create(const SourceRange& range, const std::string& name) {
-    return Ident(Compound::create(TK_IDENT, range, {String::create(name)}));
+  Symbol symbol() const {
+    return subtree(0)->symbol();
+  }
+  static Ident create(const SourceRange& range, Symbol name) {
+    return Ident(
+        Compound::create(TK_IDENT, range, {InternedString::create(name)}));
+  }
+  static Ident create(const SourceRange& range, std::string_view name) {
+    return create(range, Symbol(name));
   }
 };
 
@@ -819,7 +841,12 @@ struct Const : public Expr {
   explicit Const(const TreeRef& tree) : Expr(tree) {
     tree_->matchNumSubtrees(TK_CONST, 1);
   }
+  // Consts created from number literals carry their parsed value. Others
+  // (e.g. "inf") are parsed from the text on each access.
   bool isFloatingPoint() const {
+    if (const auto* number = subtree(0)->number()) {
+      return number->isFloat;
+    }
     bool is_inf = subtree(0)->stringValue() == "inf";
     return is_inf ||
         subtree(0)->stringValue().find_first_of(".eE") != std::string::npos;
@@ -828,6 +855,13 @@ struct Const : public Expr {
     return !isFloatingPoint();
   }
   int64_t asIntegral() const {
+    if (const auto* number = subtree(0)->number()) {
+      if (number->overflow) {
+        throw ErrorReport(range()) << "Integral constant out of range "
+                                      "(must fit in a signed 64 bit integer)";
+      }
+      return number->intValue;
+    }
     try {
       // TODO c10::stoll exists because no stoll in android env
       return std::stoll(subtree(0)->stringValue(), /*pos=*/0, /*base=*/0);
@@ -837,6 +871,10 @@ struct Const : public Expr {
     }
   }
   double asFloatingPoint() const {
+    const auto* number = subtree(0)->number();
+    if (number && number->isFloat) {
+      return number->floatValue;
+    }
     // We can't pass in nullptr as the dummy pointer gets dereferenced for
     // Android version of strtod_c().
     char* dummy;
@@ -846,8 +884,19 @@ struct Const : public Expr {
     return subtree(0)->stringValue();
   }
   static Const create(const SourceRange& range, const std::string& value) {
+    NumberLiteral number;
+    if (parseNumber(value, &number)) {
+      return create(range, value, number);
+    }
     return Const(Compound::create(TK_CONST, range, {String::create(value)}));
   }
+  static Const create(
+      const SourceRange& range,
+      std::string value,
+      const NumberLiteral& number) {
+    return Const(Compound::create(
+        TK_CONST, range, {NumberString::create(std::move(value), number)}));
+  }
 };
 
 struct StringLiteral : public Expr {
@@ -961,7 +1010,7 @@ struct Subscript : public Expr {
       const Expr& value,
       const List<Expr>& subscript_exprs) {
     auto whole_range = SourceRange(
-        range.source(), range.start(), subscript_exprs.range().end() + 1);
+        range.source_id(), range.start(), subscript_exprs.range().end() + 1);
     return Subscript(
         Compound::create(TK_SUBSCRIPT, whole_range, {value, subscript_exprs}));
   }